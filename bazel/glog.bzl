@@ -100,6 +100,8 @@ def glog_library(namespace = "google", with_gflags = 1, **kwargs):
     linux_only_copts = [
         # For utilities.h.
         "-DHAVE_EXECINFO_H",
+        # For uring_file_writer.cc.
+        "-DHAVE_LINUX_IO_URING_H",
     ]
 
     darwin_only_copts = [
@@ -173,10 +175,17 @@ def glog_library(namespace = "google", with_gflags = 1, **kwargs):
         srcs = [
             ":config_h",
             ":shared_headers",
+            "src/async_log_sink.cc",
             "src/base/googleinit.h",
+            "src/binary_log.cc",
+            "src/binary_log.h",
             "src/demangle.cc",
             "src/demangle.h",
+            "src/log_compressor.cc",
+            "src/log_compressor.h",
             "src/logging.cc",
+            "src/mmap_file_writer.cc",
+            "src/mmap_file_writer.h",
             "src/raw_logging.cc",
             "src/signalhandler.cc",
             "src/stacktrace_generic-inl.h",
@@ -187,6 +196,8 @@ def glog_library(namespace = "google", with_gflags = 1, **kwargs):
             "src/stacktrace_x86-inl.h",
             "src/symbolize.cc",
             "src/symbolize.h",
+            "src/uring_file_writer.cc",
+            "src/uring_file_writer.h",
             "src/utilities.cc",
             "src/vlog_is_on.cc",
         ] + select({
@@ -219,6 +230,22 @@ def glog_library(namespace = "google", with_gflags = 1, **kwargs):
         **kwargs
     )
 
+    native.cc_binary(
+        name = "glog_benchmark",
+        srcs = ["src/glog_benchmark.cc"],
+        copts = final_lib_copts,
+        deps = [":glog"],
+        **kwargs
+    )
+
+    native.cc_binary(
+        name = "glog_load_generator",
+        srcs = ["src/glog_load_generator.cc"],
+        copts = final_lib_copts,
+        deps = [":glog"],
+        **kwargs
+    )
+
     test_list = [
         "cleanup_immediately",
         "cleanup_with_absolute_prefix",
@@ -0,0 +1,262 @@
+// Copyright (c) 2024, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "utilities.h"
+
+_START_GOOGLE_NAMESPACE_
+
+#ifndef NO_THREADS
+
+struct AsyncLogSink::Impl {
+  // A message, with copies of everything send() got by reference.
+  struct Record {
+    uint64 seq;
+    LogSeverity severity;
+    std::string full_filename;
+    std::string base_filename;
+    int line;
+    LogMessageTime time;
+    std::string message;
+  };
+
+  Impl(LogSink* sink, const Options& options)
+      : sink(sink), options(options), fork_generation(ForkGeneration()) {
+    if (this->options.max_queued_messages == 0) {
+      this->options.max_queued_messages = 1;
+    }
+  }
+
+  // Starts the worker unless it runs.  Restarts it in a forked child, where
+  // it is gone; what the parent queued is the parent's to send.
+  // REQUIRES: mutex is held.
+  void StartWorkerLocked() {
+    if (worker != nullptr && fork_generation == ForkGeneration()) {
+      return;
+    }
+    if (worker != nullptr) {
+      // Neither joinable nor destructible in the child.
+      static_cast<void>(worker.release());
+      queue.clear();
+      sending = false;
+      done_seq = queued_seq;
+      fork_generation = ForkGeneration();
+    }
+    worker.reset(new std::thread(&Impl::Run, this));
+    worker_id = worker->get_id();
+  }
+
+  void Run() {
+    std::unique_lock<std::mutex> l(mutex);
+    while (true) {
+      not_empty.wait(l, [this] { return stop || !queue.empty(); });
+      if (queue.empty()) {
+        break;  // Stopped, and everything is sent.
+      }
+      Record record = std::move(queue.front());
+      queue.pop_front();
+      sending = true;
+      not_full.notify_one();
+      l.unlock();
+      sink->send(record.severity, record.full_filename.c_str(),
+                 record.base_filename.c_str(), record.line, record.time,
+                 record.message.data(), record.message.size());
+      sink->WaitTillSent();
+      l.lock();
+      sending = false;
+      done_seq = record.seq;
+      sent.notify_all();
+    }
+  }
+
+  // Drops the oldest message that is not FATAL.  Returns false if there is
+  // none.
+  // REQUIRES: mutex is held.
+  bool DropOldestLocked() {
+    for (auto it = queue.begin(); it != queue.end(); ++it) {
+      if (it->severity != GLOG_FATAL) {
+        queue.erase(it);
+        ++dropped;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Waits until the message numbered seq, and those before it, are sent
+  // or dropped.
+  // REQUIRES: mutex is held by l.
+  void WaitForLocked(std::unique_lock<std::mutex>* l, uint64 seq) {
+    if (std::this_thread::get_id() == worker_id) {
+      return;  // The wrapped sink logged: it would wait for itself.
+    }
+    sent.wait(*l, [this, seq] {
+      return done_seq >= seq || (queue.empty() && !sending);
+    });
+  }
+
+  LogSink* const sink;
+  Options options;
+
+  std::mutex mutex;  // Protects everything below.
+  std::condition_variable not_empty;
+  std::condition_variable not_full;
+  std::condition_variable sent;
+  std::deque<Record> queue;
+  bool sending{false};   // The worker is in the wrapped sink.
+  bool stop{false};
+  uint64 queued_seq{0};  // Number of the latest queued message.
+  uint64 done_seq{0};    // Number of the latest sent message.
+  uint64 fatal_seq{0};   // Number of the latest FATAL message.
+  uint64 dropped{0};
+  uint32 fork_generation;
+  std::unique_ptr<std::thread> worker;
+  std::thread::id worker_id;
+};
+
+AsyncLogSink::AsyncLogSink(LogSink* sink)
+    : AsyncLogSink(sink, Options()) {}
+
+AsyncLogSink::AsyncLogSink(LogSink* sink, const Options& options)
+    : impl_(new Impl(sink, options)) {}
+
+AsyncLogSink::~AsyncLogSink() {
+  std::unique_ptr<std::thread> worker;
+  {
+    std::lock_guard<std::mutex> l(impl_->mutex);
+    if (impl_->fork_generation == ForkGeneration()) {
+      worker = std::move(impl_->worker);
+    } else {
+      // Neither joinable nor destructible in the child.
+      static_cast<void>(impl_->worker.release());
+    }
+    impl_->stop = true;
+  }
+  impl_->not_empty.notify_one();
+  if (worker != nullptr) {
+    worker->join();  // The worker sends what is queued on its way out.
+  }
+  delete impl_;
+}
+
+void AsyncLogSink::send(LogSeverity severity, const char* full_filename,
+                        const char* base_filename, int line,
+                        const LogMessageTime& logmsgtime, const char* message,
+                        size_t message_len) {
+  std::unique_lock<std::mutex> l(impl_->mutex);
+  impl_->StartWorkerLocked();
+  const bool on_worker = std::this_thread::get_id() == impl_->worker_id;
+  const size_t max_queued = impl_->options.max_queued_messages;
+  const OverflowPolicy policy = impl_->options.overflow_policy;
+  while (impl_->queue.size() >= max_queued) {
+    if (policy == kDropBelowSeverityWhenFull && severity != GLOG_FATAL &&
+        severity < impl_->options.min_kept_severity) {
+      ++impl_->dropped;
+      return;
+    }
+    if ((policy == kDropOldestWhenFull || on_worker) &&
+        impl_->DropOldestLocked()) {
+      continue;
+    }
+    if (on_worker) {
+      // The wrapped sink logged, and waiting for room would wait for
+      // ourselves.  A FATAL message goes over the limit.
+      if (severity != GLOG_FATAL) {
+        ++impl_->dropped;
+        return;
+      }
+      break;
+    }
+    impl_->not_full.wait(l);
+  }
+  const uint64 seq = ++impl_->queued_seq;
+  impl_->queue.push_back(Impl::Record{
+      seq, severity, full_filename, base_filename, line, logmsgtime,
+      std::string(message, message_len)});
+  if (severity == GLOG_FATAL) {
+    impl_->fatal_seq = seq;
+  }
+  l.unlock();
+  impl_->not_empty.notify_one();
+}
+
+void AsyncLogSink::WaitTillSent() {
+  std::unique_lock<std::mutex> l(impl_->mutex);
+  if (impl_->fatal_seq > impl_->done_seq) {
+    impl_->WaitForLocked(&l, impl_->fatal_seq);
+  }
+}
+
+void AsyncLogSink::Flush() {
+  std::unique_lock<std::mutex> l(impl_->mutex);
+  impl_->WaitForLocked(&l, impl_->queued_seq);
+}
+
+uint64 AsyncLogSink::dropped_messages() const {
+  std::lock_guard<std::mutex> l(impl_->mutex);
+  return impl_->dropped;
+}
+
+#else  // NO_THREADS
+
+// Without threads, the wrapped sink is called right away.
+struct AsyncLogSink::Impl {
+  LogSink* sink;
+};
+
+AsyncLogSink::AsyncLogSink(LogSink* sink) : impl_(new Impl{sink}) {}
+
+AsyncLogSink::AsyncLogSink(LogSink* sink, const Options& /*options*/)
+    : impl_(new Impl{sink}) {}
+
+AsyncLogSink::~AsyncLogSink() { delete impl_; }
+
+void AsyncLogSink::send(LogSeverity severity, const char* full_filename,
+                        const char* base_filename, int line,
+                        const LogMessageTime& logmsgtime, const char* message,
+                        size_t message_len) {
+  impl_->sink->send(severity, full_filename, base_filename, line, logmsgtime,
+                    message, message_len);
+}
+
+void AsyncLogSink::WaitTillSent() { impl_->sink->WaitTillSent(); }
+
+void AsyncLogSink::Flush() {}
+
+uint64 AsyncLogSink::dropped_messages() const { return 0; }
+
+#endif  // NO_THREADS
+
+_END_GOOGLE_NAMESPACE_
@@ -171,6 +171,8 @@ class Mutex {
   inline void Unlock();  // Release a lock acquired via Lock()
 #ifdef GMUTEX_TRYLOCK
   inline bool TryLock(); // If free, Lock() and return true, else return false
+  inline bool ReaderTryLock(); // If free or shared, ReaderLock() and return
+                               // true, else return false
 #endif
   // Note that on systems that don't support read-write locks, these may
   // be implemented as synonyms to Lock() and Unlock().  So you can use
@@ -219,6 +221,8 @@ void Mutex::Lock()         { assert(--mutex_ == -1); }
 void Mutex::Unlock()       { assert(mutex_++ == -1); }
 #ifdef GMUTEX_TRYLOCK
 bool Mutex::TryLock()      { if (mutex_) return false; Lock(); return true; }
+bool Mutex::ReaderTryLock() { if (mutex_ < 0) return false; ReaderLock();
+                              return true; }
 #endif
 void Mutex::ReaderLock()   { assert(++mutex_ > 0); }
 void Mutex::ReaderUnlock() { assert(mutex_-- > 0); }
@@ -232,6 +236,7 @@ void Mutex::Unlock()       { if (is_safe_) LeaveCriticalSection(&mutex_); }
 #ifdef GMUTEX_TRYLOCK
 bool Mutex::TryLock()      { return is_safe_ ?
                                  TryEnterCriticalSection(&mutex_) != 0 : true; }
+bool Mutex::ReaderTryLock() { return TryLock(); }
 #endif
 void Mutex::ReaderLock()   { Lock(); }      // we don't have read-write locks
 void Mutex::ReaderUnlock() { Unlock(); }
@@ -253,6 +258,9 @@ void Mutex::Unlock()       { SAFE_PTHREAD(pthread_rwlock_unlock); }
 bool Mutex::TryLock()      { return is_safe_ ?
                                     pthread_rwlock_trywrlock(&mutex_) == 0 :
                                     true; }
+bool Mutex::ReaderTryLock() { return is_safe_ ?
+                                     pthread_rwlock_tryrdlock(&mutex_) == 0 :
+                                     true; }
 #endif
 void Mutex::ReaderLock()   { SAFE_PTHREAD(pthread_rwlock_rdlock); }
 void Mutex::ReaderUnlock() { SAFE_PTHREAD(pthread_rwlock_unlock); }
@@ -274,6 +282,7 @@ void Mutex::Unlock()       { SAFE_PTHREAD(pthread_mutex_unlock); }
 #ifdef GMUTEX_TRYLOCK
 bool Mutex::TryLock()      { return is_safe_ ?
                                  pthread_mutex_trylock(&mutex_) == 0 : true; }
+bool Mutex::ReaderTryLock() { return TryLock(); }
 #endif
 void Mutex::ReaderLock()   { Lock(); }
 void Mutex::ReaderUnlock() { Unlock(); }
@@ -0,0 +1,668 @@
+// Copyright (c) 2024, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "binary_log.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits>
+#include <set>
+#include <sstream>
+#include <system_error>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+#include "utilities.h"
+
+using std::string;
+
+_START_GOOGLE_NAMESPACE_
+
+void FormatLogfArgs(base_logging::LogStreamBuf* buf, std::ostream* stream,
+                    const char* format, const logf_internal::Arg* args) {
+  using logf_internal::Arg;
+  auto append = [buf](const char* data, size_t size) {
+    buf->Reserve(size);
+    size = std::min(size, buf->available());
+    memcpy(buf->pptr(), data, size);
+    buf->Claim(size);
+  };
+  auto append_number = [buf](auto value, auto... options) {
+    buf->Reserve(32);  // Enough for any number we print.
+    std::to_chars_result result = std::to_chars(
+        buf->pptr(), buf->pptr() + buf->available(), value, options...);
+    if (result.ec == std::errc()) {
+      buf->Claim(static_cast<size_t>(result.ptr - buf->pptr()));
+    }
+  };
+
+  const char* p = format;
+  while (*p != '\0') {
+    const char* brace = strpbrk(p, "{}");
+    if (brace == nullptr) {
+      append(p, strlen(p));
+      break;
+    }
+    append(p, static_cast<size_t>(brace - p));
+    if (brace[0] == '}' || brace[1] != '}') {
+      append(brace, 1);  // "{{" or "}}"
+    } else {
+      const Arg& arg = *args++;
+      switch (arg.type) {
+        case Arg::kSigned:
+          append_number(arg.signed_value);
+          break;
+        case Arg::kUnsigned:
+          append_number(arg.unsigned_value);
+          break;
+        case Arg::kChar:
+          append(&arg.char_value, 1);
+          break;
+        case Arg::kDouble:
+          // std::ostream's default: %g with 6 significant digits.
+#ifdef __cpp_lib_to_chars
+          append_number(arg.double_value, std::chars_format::general, 6);
+#else
+          {
+            char number[32];
+            int n = snprintf(number, sizeof(number), "%g", arg.double_value);
+            append(number, static_cast<size_t>(std::max(n, 0)));
+          }
+#endif
+          break;
+        case Arg::kString:
+          if (arg.string_value.data != nullptr) {
+            append(arg.string_value.data, arg.string_value.size);
+          } else {
+            append("(null)", 6);
+          }
+          break;
+        case Arg::kPointer:
+          if (arg.pointer_value != nullptr) {
+            append("0x", 2);
+            append_number(reinterpret_cast<uintptr_t>(arg.pointer_value), 16);
+          } else {
+            append("0", 1);
+          }
+          break;
+        case Arg::kCustom:
+          arg.custom_value.print(*stream, arg.custom_value.value);
+          break;
+      }
+    }
+    p = brace[1] != '\0' ? brace + 2 : brace + 1;
+  }
+}
+
+namespace {
+
+const char kMagic[8] = {'G', 'L', 'O', 'G', 'B', 'I', 'N', '\0'};
+const uint32 kVersion = 1;
+const uint32 kByteOrderMark = 0x01020304U;
+
+enum RecordKind : std::uint8_t {
+  kSite = 1,
+  kFormatted = 2,
+  kText = 3,
+};
+
+// Bits of the message header flags.
+const std::uint8_t kUtcTime = 1;
+const std::uint8_t kDst = 2;
+
+// A string whose length does not fit; marks a null const char*.
+const uint32 kNullString = 0xffffffffU;
+
+template <typename T>
+void Append(string* out, T value) {
+  out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void AppendString16(string* out, const char* data, size_t size) {
+  size = std::min<size_t>(size, 0xffff);
+  Append(out, static_cast<std::uint16_t>(size));
+  out->append(data, size);
+}
+
+void AppendString32(string* out, const char* data, size_t size) {
+  Append(out, static_cast<uint32>(size));
+  out->append(data, size);
+}
+
+// Reads the payload of a record front to back.
+class PayloadReader {
+ public:
+  explicit PayloadReader(const string& payload)
+      : p_(payload.data()), end_(payload.data() + payload.size()) {}
+
+  template <typename T>
+  bool Read(T* value) {
+    if (static_cast<size_t>(end_ - p_) < sizeof(T)) return false;
+    memcpy(value, p_, sizeof(T));
+    p_ += sizeof(T);
+    return true;
+  }
+
+  bool ReadBytes(size_t size, const char** data) {
+    if (static_cast<size_t>(end_ - p_) < size) return false;
+    *data = p_;
+    p_ += size;
+    return true;
+  }
+
+  template <typename Length>
+  bool ReadString(string* value) {
+    Length size;
+    const char* data;
+    if (!Read(&size) || !ReadBytes(size, &data)) return false;
+    value->assign(data, size);
+    return true;
+  }
+
+ private:
+  const char* p_;
+  const char* end_;
+};
+
+}  // namespace
+
+BinaryLogWriter::BinaryLogWriter(
+    std::vector<string> base_filenames,
+    void (*cleanup)(const string& base_filename))
+    : base_filenames_(std::move(base_filenames)), cleanup_(cleanup) {}
+
+BinaryLogWriter::~BinaryLogWriter() {
+  Close();
+}
+
+size_t BinaryLogWriter::SiteKeyHash::operator()(const SiteKey& key) const {
+  return std::hash<const void*>()(key.format) * 31 +
+         std::hash<const void*>()(key.file) + static_cast<size_t>(key.line);
+}
+
+bool BinaryLogWriter::OpenIfNeeded(time_t timestamp) {
+  if (file_ != nullptr) {
+    if (file_length_ >> 20U < MaxLogSize() && timestamp < roll_time_ &&
+        fork_generation_ == ForkGeneration()) {
+      return true;
+    }
+    if (fork_generation_ != ForkGeneration()) {
+      // The parent writes the records buffered before the fork; drop our
+      // copy of them instead of writing them a second time.
+      int null_fd = open("/dev/null", O_WRONLY);
+      if (null_fd != -1) {
+        dup2(null_fd, fileno(file_));
+        close(null_fd);
+      }
+    }
+    CloseUnlocked();
+    open_attempt_ = kOpenAttemptFrequency - 1;
+  }
+  // Like LogFileObject, try to create the file every 32 records only.
+  if (++open_attempt_ != kOpenAttemptFrequency) return false;
+  open_attempt_ = 0;
+
+  // Every file gets a name of its own, even if the previous one was
+  // created within the same second.
+  const time_t name_time = std::max(timestamp, name_time_ + 1);
+  std::tm tm_time;
+  if (FLAGS_log_utc_time) {
+    gmtime_r(&name_time, &tm_time);
+  } else {
+    localtime_r(&name_time, &tm_time);
+  }
+  char time_pid[64];
+  snprintf(time_pid, sizeof(time_pid), "%04d%02d%02d-%02d%02d%02d.%d",
+           1900 + tm_time.tm_year, 1 + tm_time.tm_mon, tm_time.tm_mday,
+           tm_time.tm_hour, tm_time.tm_min, tm_time.tm_sec,
+           static_cast<int>(GetMainThreadPid()));
+
+  int flags = O_WRONLY | O_CREAT | O_EXCL;
+#ifdef O_BINARY
+  flags |= O_BINARY;
+#endif
+  for (const string& base_filename : base_filenames_) {
+    const string filename = base_filename + time_pid;
+    int fd = open(filename.c_str(), flags,
+                  static_cast<mode_t>(FLAGS_logfile_mode));
+    if (fd == -1) continue;
+    file_ = fdopen(fd, "wb");
+    if (file_ == nullptr) {
+      close(fd);
+      continue;
+    }
+    base_filename_ = base_filename;
+    break;
+  }
+  if (file_ == nullptr) {
+    perror("Could not create binary log file");
+    return false;
+  }
+  name_time_ = name_time;
+  fork_generation_ = ForkGeneration();
+
+  // The day and hour policies roll over at the next local midnight or
+  // full hour, like LogFileObject::CheckNeedRollLogFiles().
+  roll_time_ = std::numeric_limits<time_t>::max();
+  if (FLAGS_log_rolling_policy == "day" ||
+      FLAGS_log_rolling_policy == "hour") {
+    localtime_r(&timestamp, &tm_time);
+    tm_time.tm_sec = tm_time.tm_min = 0;
+    if (FLAGS_log_rolling_policy == "day") {
+      tm_time.tm_hour = 0;
+      ++tm_time.tm_mday;
+    } else {
+      ++tm_time.tm_hour;
+    }
+    tm_time.tm_isdst = -1;
+    roll_time_ = mktime(&tm_time);
+  }
+
+  fwrite(kMagic, 1, sizeof(kMagic), file_);
+  fwrite(&kVersion, sizeof(kVersion), 1, file_);
+  fwrite(&kByteOrderMark, sizeof(kByteOrderMark), 1, file_);
+  file_length_ = sizeof(kMagic) + sizeof(kVersion) + sizeof(kByteOrderMark);
+  // Site IDs are per file.
+  sites_.clear();
+  RemoveOldFiles();
+  return true;
+}
+
+void BinaryLogWriter::RemoveOldFiles() {
+  if (FLAGS_max_logfile_num == 0) return;
+  const size_t slash = base_filename_.find_last_of('/');
+  const string dir =
+      slash != string::npos ? base_filename_.substr(0, slash + 1) : "./";
+  const string prefix = base_filename_.substr(dir.size());
+  DIR* dp = opendir(dir.c_str());
+  if (dp == nullptr) return;
+  // The names only differ in their timestamp: oldest first.
+  std::set<string> files;
+  struct dirent* entry;
+  while ((entry = readdir(dp)) != nullptr) {
+    if (strncmp(entry->d_name, prefix.data(), prefix.size()) == 0) {
+      files.insert(dir + entry->d_name);
+    }
+  }
+  closedir(dp);
+  while (files.size() > FLAGS_max_logfile_num) {
+    unlink(files.begin()->c_str());
+    files.erase(files.begin());
+  }
+}
+
+void BinaryLogWriter::AppendMessageHeader(LogSeverity severity,
+                                          int thread_id,
+                                          const LogMessageTime& time) {
+  std::uint8_t flags = 0;
+  if (FLAGS_log_utc_time) flags |= kUtcTime;
+  if (time.dst() > 0) flags |= kDst;
+  Append(&record_, static_cast<std::int8_t>(severity));
+  Append(&record_, flags);
+  Append(&record_, static_cast<int32>(thread_id));
+  Append(&record_, static_cast<int64>(time.timestamp()));
+  Append(&record_, static_cast<int32>(time.usec()));
+  Append(&record_, static_cast<int32>(time.gmtoff()));
+}
+
+bool BinaryLogWriter::WriteRecord(LogSeverity severity) {
+  if (stop_writing_) {
+    if (CycleClock_Now() < next_flush_time_) return false;
+    stop_writing_ = false;  // See if the disk has free space again.
+  }
+  errno = 0;
+  bool written =
+      fwrite(record_.data(), 1, record_.size(), file_) == record_.size();
+  // See important messages *now*, and everything else at least every
+  // --logbufsecs seconds.
+  bool flush_time = CycleClock_Now() >= next_flush_time_;
+  if (written && (severity > FLAGS_logbuflevel || flush_time)) {
+    written = fflush(file_) == 0;
+  }
+  if (flush_time) {
+    next_flush_time_ =
+        CycleClock_Now() + UsecToCycles(FLAGS_logbufsecs * int64{1000000});
+    if (cleanup_ != nullptr) {
+      cleanup_(base_filename_);
+    }
+  }
+  if (!written) {
+    if (FLAGS_stop_logging_if_full_disk && errno == ENOSPC) {
+      stop_writing_ = true;  // Until the next flush time.
+      next_flush_time_ =
+          CycleClock_Now() + UsecToCycles(FLAGS_logbufsecs * int64{1000000});
+    }
+    // The file may end in part of a record now, which the reader stops
+    // at; start a new one.
+    CloseUnlocked();
+    return false;
+  }
+  file_length_ += record_.size();
+  return true;
+}
+
+bool BinaryLogWriter::WriteFormatted(LogSeverity severity, const char* file,
+                                     int line, int thread_id,
+                                     const LogMessageTime& time,
+                                     const char* format,
+                                     const logf_internal::Arg* args,
+                                     size_t num_args) {
+  using logf_internal::Arg;
+  MutexLock l(&lock_);
+  if (!OpenIfNeeded(time.timestamp())) return false;
+
+  record_.clear();
+  auto site = sites_.find(SiteKey{format, file, line});
+  uint32 site_id;
+  if (site != sites_.end()) {
+    site_id = site->second;
+  } else {
+    site_id = static_cast<uint32>(sites_.size());
+    sites_.emplace(SiteKey{format, file, line}, site_id);
+    string payload;
+    Append(&payload, site_id);
+    Append(&payload, static_cast<int32>(line));
+    const char* basename = const_basename(file);
+    AppendString16(&payload, basename, strlen(basename));
+    AppendString32(&payload, format, strlen(format));
+    Append(&record_, kSite);
+    Append(&record_, static_cast<uint32>(payload.size()));
+    record_ += payload;
+  }
+
+  const size_t kind_offset = record_.size();
+  Append(&record_, kFormatted);
+  Append(&record_, uint32{0});  // payload size, patched below
+  const size_t payload_offset = record_.size();
+  AppendMessageHeader(severity, thread_id, time);
+  Append(&record_, site_id);
+  Append(&record_, static_cast<std::uint8_t>(num_args));
+  for (size_t i = 0; i < num_args; ++i) {
+    const Arg& arg = args[i];
+    // Only the program knows how to print custom types: store them as
+    // the strings they print.
+    const Arg::Type type = arg.type == Arg::kCustom ? Arg::kString : arg.type;
+    Append(&record_, static_cast<std::uint8_t>(type));
+    switch (arg.type) {
+      case Arg::kSigned:
+        Append(&record_, arg.signed_value);
+        break;
+      case Arg::kUnsigned:
+        Append(&record_, arg.unsigned_value);
+        break;
+      case Arg::kChar:
+        Append(&record_, arg.char_value);
+        break;
+      case Arg::kDouble:
+        Append(&record_, arg.double_value);
+        break;
+      case Arg::kString:
+        if (arg.string_value.data != nullptr) {
+          AppendString32(&record_, arg.string_value.data,
+                         arg.string_value.size);
+        } else {
+          Append(&record_, kNullString);
+        }
+        break;
+      case Arg::kPointer:
+        Append(&record_, static_cast<uint64>(
+                             reinterpret_cast<uintptr_t>(arg.pointer_value)));
+        break;
+      case Arg::kCustom: {
+        std::ostringstream stream;
+        arg.custom_value.print(stream, arg.custom_value.value);
+        const string printed = stream.str();
+        AppendString32(&record_, printed.data(), printed.size());
+        break;
+      }
+    }
+  }
+  const auto payload_size =
+      static_cast<uint32>(record_.size() - payload_offset);
+  memcpy(&record_[kind_offset + 1], &payload_size, sizeof(payload_size));
+  return WriteRecord(severity);
+}
+
+bool BinaryLogWriter::WriteText(LogSeverity severity, const char* file,
+                                int line, int thread_id,
+                                const LogMessageTime& time, const char* text,
+                                size_t text_len) {
+  MutexLock l(&lock_);
+  if (!OpenIfNeeded(time.timestamp())) return false;
+
+  record_.clear();
+  Append(&record_, kText);
+  Append(&record_, uint32{0});  // payload size, patched below
+  AppendMessageHeader(severity, thread_id, time);
+  Append(&record_, static_cast<int32>(line));
+  AppendString16(&record_, file, strlen(file));
+  AppendString32(&record_, text, text_len);
+  const auto payload_size = static_cast<uint32>(record_.size() - 5);
+  memcpy(&record_[1], &payload_size, sizeof(payload_size));
+  return WriteRecord(severity);
+}
+
+void BinaryLogWriter::Flush() {
+  MutexLock l(&lock_);
+  if (file_ != nullptr) {
+    fflush(file_);
+  }
+}
+
+void BinaryLogWriter::Close() {
+  MutexLock l(&lock_);
+  CloseUnlocked();
+  // Don't make the next record wait for a retry.
+  open_attempt_ = kOpenAttemptFrequency - 1;
+}
+
+void BinaryLogWriter::CloseUnlocked() {
+  if (file_ != nullptr) {
+    fclose(file_);
+    file_ = nullptr;
+  }
+}
+
+BinaryLogReader::BinaryLogReader(FILE* file)
+    : file_(file), text_buffer_(LogMessage::kMaxLogMessageLen) {}
+
+bool BinaryLogReader::Fail(const char* error) {
+  error_ = error;
+  return false;
+}
+
+bool BinaryLogReader::ReadHeader() {
+  char magic[sizeof(kMagic)];
+  uint32 version;
+  uint32 byte_order_mark;
+  if (fread(magic, 1, sizeof(magic), file_) != sizeof(magic) ||
+      memcmp(magic, kMagic, sizeof(magic)) != 0 ||
+      fread(&version, sizeof(version), 1, file_) != 1 ||
+      fread(&byte_order_mark, sizeof(byte_order_mark), 1, file_) != 1) {
+    return Fail("not a binary log file");
+  }
+  if (byte_order_mark != kByteOrderMark) {
+    return Fail("written by a host with a different byte order");
+  }
+  if (version != kVersion) {
+    return Fail("unsupported binary log version");
+  }
+  header_read_ = true;
+  return true;
+}
+
+bool BinaryLogReader::Next(BinaryLogMessage* message) {
+  using logf_internal::Arg;
+  if (!error_.empty()) return false;
+  if (!header_read_ && !ReadHeader()) return false;
+
+  while (true) {
+    std::uint8_t kind;
+    uint32 size;
+    if (fread(&kind, sizeof(kind), 1, file_) != 1) {
+      // A clean end of the file.
+      return false;
+    }
+    if (fread(&size, sizeof(size), 1, file_) != 1) {
+      return Fail("truncated record");
+    }
+    payload_.resize(size);
+    if (size > 0 && fread(&payload_[0], 1, size, file_) != size) {
+      return Fail("truncated record");
+    }
+    PayloadReader reader(payload_);
+
+    if (kind == kSite) {
+      uint32 site_id;
+      Site site;
+      if (!reader.Read(&site_id) || !reader.Read(&site.line) ||
+          !reader.ReadString<std::uint16_t>(&site.file) ||
+          !reader.ReadString<uint32>(&site.format)) {
+        return Fail("corrupt site record");
+      }
+      if (site_id != sites_.size()) {
+        return Fail("site records out of order");
+      }
+      sites_.push_back(std::move(site));
+      continue;
+    }
+    if (kind != kFormatted && kind != kText) {
+      continue;  // Written by a newer version; skip it.
+    }
+
+    std::int8_t severity;
+    std::uint8_t flags;
+    int32 thread_id;
+    int64 timestamp;
+    int32 usecs;
+    int32 gmtoffset;
+    if (!reader.Read(&severity) || !reader.Read(&flags) ||
+        !reader.Read(&thread_id) || !reader.Read(&timestamp) ||
+        !reader.Read(&usecs) || !reader.Read(&gmtoffset) ||
+        severity < 0 || severity >= NUM_SEVERITIES) {
+      return Fail("corrupt message record");
+    }
+    message->severity = severity;
+    message->thread_id = thread_id;
+    // Restore the broken-down time of the writer, whatever our time zone.
+    auto local = static_cast<time_t>(timestamp);
+    if ((flags & kUtcTime) == 0) local += gmtoffset;
+    std::tm tm_time;
+    gmtime_r(&local, &tm_time);
+    tm_time.tm_isdst = (flags & kDst) != 0 ? 1 : 0;
+    message->time = LogMessageTime(tm_time, static_cast<time_t>(timestamp),
+                                   usecs, gmtoffset);
+
+    if (kind == kText) {
+      if (!reader.Read(&message->line) ||
+          !reader.ReadString<std::uint16_t>(&message->filename) ||
+          !reader.ReadString<uint32>(&message->text)) {
+        return Fail("corrupt message record");
+      }
+      return true;
+    }
+
+    uint32 site_id;
+    std::uint8_t num_args;
+    if (!reader.Read(&site_id) || !reader.Read(&num_args) ||
+        site_id >= sites_.size()) {
+      return Fail("corrupt message record");
+    }
+    const Site& site = sites_[site_id];
+    std::vector<Arg> args(num_args + 1U);
+    for (Arg& arg : args) {
+      arg = Arg();
+    }
+    for (size_t i = 0; i < num_args; ++i) {
+      Arg& arg = args[i];
+      std::uint8_t type;
+      if (!reader.Read(&type)) return Fail("corrupt message record");
+      bool ok = true;
+      switch (type) {
+        case Arg::kSigned:
+          ok = reader.Read(&arg.signed_value);
+          break;
+        case Arg::kUnsigned:
+          ok = reader.Read(&arg.unsigned_value);
+          break;
+        case Arg::kChar:
+          ok = reader.Read(&arg.char_value);
+          break;
+        case Arg::kDouble:
+          ok = reader.Read(&arg.double_value);
+          break;
+        case Arg::kString: {
+          uint32 length;
+          ok = reader.Read(&length);
+          arg.string_value.data = nullptr;
+          arg.string_value.size = 0;
+          if (ok && length != kNullString) {
+            ok = reader.ReadBytes(length, &arg.string_value.data);
+            arg.string_value.size = length;
+          }
+          break;
+        }
+        case Arg::kPointer: {
+          uint64 pointer;
+          ok = reader.Read(&pointer);
+          arg.pointer_value =
+              reinterpret_cast<const void*>(static_cast<uintptr_t>(pointer));
+          break;
+        }
+        default:
+          ok = false;
+      }
+      if (!ok) return Fail("corrupt message record");
+      arg.type = static_cast<Arg::Type>(type);
+    }
+    // A format string with fewer placeholders than arguments only comes
+    // from a corrupt file, but must not make us read past args.
+    size_t placeholders = logf_internal::CountPlaceholders(
+        site.format.c_str());
+    if (placeholders != num_args) {
+      return Fail("corrupt message record");
+    }
+
+    base_logging::LogStreamBuf buf(text_buffer_.data(),
+                                   static_cast<int>(text_buffer_.size()));
+    FormatLogfArgs(&buf, nullptr, site.format.c_str(), args.data());
+    message->text.assign(buf.pbase(), buf.pcount());
+    message->filename = site.file;
+    message->line = site.line;
+    return true;
+  }
+}
+
+_END_GOOGLE_NAMESPACE_
@@ -0,0 +1,197 @@
+// Copyright (c) 2024, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Binary log files, written instead of the text log files with
+// --logbinary and turned back into text by glog_decode.
+//
+// A binary log file starts with a header
+//
+//   "GLOGBIN" '\0'   uint32 version   uint32 byte order mark
+//
+// followed by records
+//
+//   uint8 kind   uint32 payload size   payload
+//
+// A kSite record describes a LOGF() call site (file, line and format
+// string) the first time it logs.  kFormatted records refer to their
+// site by ID and carry the raw LOGF() arguments; they are substituted
+// only when the file is decoded.  Messages that had to be formatted
+// anyway, like LOG() << ..., are stored as kText records, which save
+// nothing over the text log files.  Both kinds of
+// message carry everything LogMessageInfo needs, so that a program's
+// CustomPrefixCallback can be applied when decoding.
+//
+// All numbers are stored in the byte order of the writing host; the
+// reader rejects files written with a different one.
+
+#ifndef GLOG_BINARY_LOG_H_
+#define GLOG_BINARY_LOG_H_
+
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "base/mutex.h"
+#include "glog/logging.h"
+
+_START_GOOGLE_NAMESPACE_
+
+// Substitutes args into a LOGF() format string, appending to buf.  Like
+// std::ostream, drops whatever does not fit.  Arguments without a
+// built-in conversion are printed to stream, which must write to buf.
+void FormatLogfArgs(base_logging::LogStreamBuf* buf, std::ostream* stream,
+                    const char* format, const logf_internal::Arg* args);
+
+class BinaryLogWriter {
+ public:
+  // Records go to "<base_filename><YYYYMMDD-HHMMSS>.<pid>", where the
+  // first of base_filenames that works is used.  Like the text log files,
+  // the files are rolled over according to --log_rolling_policy, and only
+  // the newest --max_logfile_num of them are kept.  cleanup, if not null,
+  // is called with the base filename every --logbufsecs seconds to remove
+  // overdue files.
+  BinaryLogWriter(std::vector<std::string> base_filenames,
+                  void (*cleanup)(const std::string& base_filename));
+  ~BinaryLogWriter();
+
+  // The Write functions return false if the message was dropped, e.g.
+  // because of --stop_logging_if_full_disk.
+
+  // Records a LOGF() message without substituting its arguments.
+  bool WriteFormatted(LogSeverity severity, const char* file, int line,
+                      int thread_id, const LogMessageTime& time,
+                      const char* format, const logf_internal::Arg* args,
+                      size_t num_args);
+
+  // Records a message that was formatted already.  text excludes the
+  // prefix and the trailing newline.
+  bool WriteText(LogSeverity severity, const char* file, int line,
+                 int thread_id, const LogMessageTime& time, const char* text,
+                 size_t text_len);
+
+  void Flush();
+
+  // Closes the file; the next record starts a new one.
+  void Close();
+
+ private:
+  struct SiteKey {
+    const char* format;
+    const char* file;
+    int line;
+    bool operator==(const SiteKey& other) const {
+      return format == other.format && file == other.file &&
+             line == other.line;
+    }
+  };
+  struct SiteKeyHash {
+    size_t operator()(const SiteKey& key) const;
+  };
+
+  // REQUIRES: lock_ is held.
+  bool OpenIfNeeded(time_t timestamp);
+  void CloseUnlocked();
+  void RemoveOldFiles();
+  void AppendMessageHeader(LogSeverity severity, int thread_id,
+                           const LogMessageTime& time);
+  bool WriteRecord(LogSeverity severity);
+
+  static const uint32 kOpenAttemptFrequency = 0x20;
+
+  Mutex lock_;
+  const std::vector<std::string> base_filenames_;
+  void (*const cleanup_)(const std::string& base_filename);
+  FILE* file_{nullptr};
+  std::string base_filename_;  // The one of base_filenames_ that worked.
+  size_t file_length_{0};
+  time_t roll_time_{0};        // When the day or hour policy rolls over.
+  time_t name_time_{0};        // The timestamp in the newest file's name.
+  uint32 fork_generation_{0};  // ForkGeneration() when the file was made.
+  uint32 open_attempt_{kOpenAttemptFrequency - 1};
+  bool stop_writing_{false};   // The disk is full.
+  std::unordered_map<SiteKey, uint32, SiteKeyHash> sites_;
+  std::string record_;  // The record being assembled.
+  int64 next_flush_time_{0};
+
+  BinaryLogWriter(const BinaryLogWriter&) = delete;
+  BinaryLogWriter& operator=(const BinaryLogWriter&) = delete;
+};
+
+// A message read back from a binary log file.
+struct BinaryLogMessage {
+  LogSeverity severity{GLOG_INFO};
+  std::string filename;  // Base name, as in the text log prefix.
+  int line{0};
+  int thread_id{0};
+  LogMessageTime time;
+  std::string text;      // Without prefix and trailing newline.
+
+  LogMessageInfo info() const {
+    return LogMessageInfo(GetLogSeverityName(severity), filename.c_str(),
+                          line, thread_id, time);
+  }
+};
+
+class GOOGLE_GLOG_DLL_DECL BinaryLogReader {
+ public:
+  // Does not take ownership of file.
+  explicit BinaryLogReader(FILE* file);
+
+  // Reads the next message.  Returns false at the end of the file, or if
+  // the file is not a binary log or is corrupt; error() tells which.
+  bool Next(BinaryLogMessage* message);
+
+  // Empty unless Next() failed before the end of the file.
+  const std::string& error() const { return error_; }
+
+ private:
+  struct Site {
+    std::string file;
+    int line;
+    std::string format;
+  };
+
+  bool ReadHeader();
+  bool Fail(const char* error);
+
+  FILE* file_;
+  bool header_read_{false};
+  std::vector<Site> sites_;
+  std::string payload_;
+  std::vector<char> text_buffer_;
+  std::string error_;
+
+  BinaryLogReader(const BinaryLogReader&) = delete;
+  BinaryLogReader& operator=(const BinaryLogReader&) = delete;
+};
+
+_END_GOOGLE_NAMESPACE_
+
+#endif  // GLOG_BINARY_LOG_H_
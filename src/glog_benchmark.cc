@@ -0,0 +1,277 @@
+// Copyright (c) 2024, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Microbenchmarks of the logging macros, each run with 1, 2, 4, ... up to
+// --threads threads:
+//
+//   glog_benchmark [--threads=N] [--iterations=N] [--filter=SUBSTRING]
+//                  [--log_dir=DIR] [--syslog]
+//
+// Every thread performs --iterations operations twice: once untimed, for
+// the throughput, and once timing each operation, for the latency
+// percentiles.  Log files go to --log_dir (default: the first of
+// GetLoggingDirectories()).  SYSLOG() writes to the system log, so it
+// only runs with --syslog.
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "glog/logging.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+  int max_threads{8};
+  int iterations{100000};
+  std::string filter;
+  std::string log_dir;
+  bool syslog{false};
+};
+
+// Counts the messages it receives, and does nothing else.
+class NullSink : public google::LogSink {
+ public:
+  void send(google::LogSeverity /*severity*/, const char* /*full_filename*/,
+            const char* /*base_filename*/, int /*line*/,
+            const google::LogMessageTime& /*time*/, const char* /*message*/,
+            size_t /*message_len*/) override {
+    count_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+ private:
+  std::atomic<long> count_{0};
+};
+
+NullSink null_sink;
+volatile int check_value = 42;
+
+// One operation of each case; i is the iteration.
+void LogInfo(int i) { LOG(INFO) << "benchmark message " << i; }
+
+void VlogDisabled(int i) { VLOG(1) << "benchmark message " << i; }
+
+void LogEveryN(int i) {
+  LOG_EVERY_N(INFO, 1000) << "benchmark message " << i;
+}
+
+void LogFirstN(int i) { LOG_FIRST_N(INFO, 1) << "benchmark message " << i; }
+
+void CheckEq(int /*i*/) { CHECK_EQ(check_value, 42); }
+
+void LogToSink(int i) {
+  LOG_TO_SINK(&null_sink, INFO) << "benchmark message " << i;
+}
+
+void Plog(int i) {
+  errno = ENOENT;
+  PLOG(INFO) << "benchmark message " << i;
+}
+
+void Syslog(int i) { SYSLOG(INFO) << "benchmark message " << i; }
+
+struct Case {
+  const char* name;
+  void (*op)(int);
+};
+
+const Case kCases[] = {
+    {"LOG(INFO) to file", &LogInfo},
+    {"VLOG(1) disabled", &VlogDisabled},
+    {"LOG_EVERY_N(INFO, 1000)", &LogEveryN},
+    {"LOG_FIRST_N(INFO, 1)", &LogFirstN},
+    {"CHECK_EQ success", &CheckEq},
+    {"LOG_TO_SINK(INFO)", &LogToSink},
+    {"PLOG(INFO)", &Plog},
+    {"SYSLOG(INFO)", &Syslog},
+};
+
+struct Result {
+  double ns_per_op;    // Per thread.
+  double ops_per_sec;  // All threads together.
+  double p50_ns, p99_ns, p999_ns;
+};
+
+// Runs op iterations times on each of num_threads threads at once.
+// Returns the wall time; fills latencies_ns, if given, with the time of
+// every single operation.
+double RunThreads(const Case& c, int num_threads, int iterations,
+                  std::vector<float>* latencies_ns) {
+  std::atomic<int> ready{0};
+  std::atomic<bool> go{false};
+  std::vector<std::vector<float>> thread_latencies(num_threads);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&, t] {
+      std::vector<float>& latencies = thread_latencies[t];
+      if (latencies_ns != nullptr) latencies.reserve(iterations);
+      ready.fetch_add(1);
+      while (!go.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+      }
+      for (int i = 0; i < iterations; ++i) {
+        if (latencies_ns != nullptr) {
+          const Clock::time_point start = Clock::now();
+          c.op(i);
+          latencies.push_back(static_cast<float>(
+              std::chrono::duration<double, std::nano>(Clock::now() - start)
+                  .count()));
+        } else {
+          c.op(i);
+        }
+      }
+    });
+  }
+  while (ready.load() < num_threads) {
+    std::this_thread::yield();
+  }
+  const Clock::time_point start = Clock::now();
+  go.store(true, std::memory_order_release);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  const double elapsed_ns =
+      std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+  if (latencies_ns != nullptr) {
+    latencies_ns->clear();
+    for (const auto& latencies : thread_latencies) {
+      latencies_ns->insert(latencies_ns->end(), latencies.begin(),
+                           latencies.end());
+    }
+  }
+  return elapsed_ns;
+}
+
+double Percentile(std::vector<float>* values, double fraction) {
+  if (values->empty()) return 0;
+  const auto index = std::min(
+      values->size() - 1, static_cast<size_t>(fraction * values->size()));
+  std::nth_element(values->begin(), values->begin() + index, values->end());
+  return (*values)[index];
+}
+
+Result Run(const Case& c, int num_threads, int iterations) {
+  Result result;
+  const double elapsed_ns = RunThreads(c, num_threads, iterations, nullptr);
+  result.ns_per_op = elapsed_ns / iterations;
+  result.ops_per_sec = num_threads * iterations / (elapsed_ns * 1e-9);
+
+  std::vector<float> latencies;
+  RunThreads(c, num_threads, iterations, &latencies);
+  result.p50_ns = Percentile(&latencies, 0.5);
+  result.p99_ns = Percentile(&latencies, 0.99);
+  result.p999_ns = Percentile(&latencies, 0.999);
+  return result;
+}
+
+bool ParseFlag(const char* arg, const char* name, std::string* value) {
+  const size_t length = strlen(name);
+  if (strncmp(arg, name, length) != 0 || arg[length] != '=') return false;
+  *value = arg + length + 1;
+  return true;
+}
+
+bool ParseOptions(int argc, char** argv, Options* options) {
+  for (int i = 1; i < argc; ++i) {
+    std::string value;
+    if (ParseFlag(argv[i], "--threads", &value)) {
+      options->max_threads = std::max(1, atoi(value.c_str()));
+    } else if (ParseFlag(argv[i], "--iterations", &value)) {
+      options->iterations = std::max(1, atoi(value.c_str()));
+    } else if (ParseFlag(argv[i], "--filter", &value)) {
+      options->filter = value;
+    } else if (ParseFlag(argv[i], "--log_dir", &value)) {
+      options->log_dir = value;
+    } else if (strcmp(argv[i], "--syslog") == 0) {
+      options->syslog = true;
+    } else {
+      fprintf(stderr,
+              "Usage: %s [--threads=N] [--iterations=N] [--filter=SUBSTRING]"
+              " [--log_dir=DIR] [--syslog]\n",
+              argv[0]);
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options options;
+  if (!ParseOptions(argc, argv, &options)) {
+    return 2;
+  }
+
+  google::InitGoogleLogging(argv[0]);
+  // Only the log files: the cost of writing to a terminal is not ours.
+  FLAGS_logtostderr = false;
+  FLAGS_alsologtostderr = false;
+  FLAGS_stderrthreshold = google::GLOG_FATAL;
+  FLAGS_v = 0;
+  const std::string log_dir = options.log_dir.empty()
+                                  ? google::GetLoggingDirectories()[0]
+                                  : options.log_dir;
+  const std::string base_filename = log_dir + "/glog_benchmark.";
+  google::SetLogDestination(google::GLOG_INFO, base_filename.c_str());
+  for (int severity = google::GLOG_WARNING; severity < google::NUM_SEVERITIES;
+       ++severity) {
+    google::SetLogDestination(severity, "");
+  }
+
+  printf("%-26s %7s %10s %12s %9s %9s %9s\n", "case", "threads", "ns/op",
+         "ops/s", "p50(ns)", "p99(ns)", "p999(ns)");
+  for (const Case& c : kCases) {
+    if (c.op == &Syslog && !options.syslog) continue;
+    if (!options.filter.empty() &&
+        strstr(c.name, options.filter.c_str()) == nullptr) {
+      continue;
+    }
+    for (int num_threads = 1; num_threads <= options.max_threads;
+         num_threads *= 2) {
+      const Result r = Run(c, num_threads, options.iterations);
+      printf("%-26s %7d %10.1f %12.0f %9.0f %9.0f %9.0f\n", c.name,
+             num_threads, r.ns_per_op, r.ops_per_sec, r.p50_ns, r.p99_ns,
+             r.p999_ns);
+      fflush(stdout);
+    }
+  }
+
+  google::ShutdownGoogleLogging();
+  return 0;
+}
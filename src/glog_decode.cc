@@ -0,0 +1,92 @@
+// Copyright (c) 2024, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Turns binary log files written with --logbinary back into text:
+//
+//   glog_decode FILE...
+//
+// The messages are written to stdout with the default log line prefix.
+// As in the program that logged them, GLOG_log_year_in_prefix in the
+// environment controls whether it includes the year.
+
+#include <cstdio>
+#include <cstring>
+
+#include "binary_log.h"
+#include "glog/logging.h"
+
+using GOOGLE_NAMESPACE::BinaryLogMessage;
+using GOOGLE_NAMESPACE::BinaryLogReader;
+using GOOGLE_NAMESPACE::LogMessageInfo;
+
+// The same as the prefix of the text log files.
+static void PrintMessage(const BinaryLogMessage& message) {
+  const LogMessageInfo info = message.info();
+  const std::tm& t = info.time.tm();
+  if (FLAGS_log_year_in_prefix) {
+    printf("%c%04d%02d%02d ", info.severity[0], 1900 + t.tm_year,
+           1 + t.tm_mon, t.tm_mday);
+  } else {
+    printf("%c%02d%02d ", info.severity[0], 1 + t.tm_mon, t.tm_mday);
+  }
+  printf("%02d:%02d:%02d.%06d %5d %s:%d] ", t.tm_hour, t.tm_min, t.tm_sec,
+         static_cast<int>(info.time.usec()), info.thread_id, info.filename,
+         info.line_number);
+  fwrite(message.text.data(), 1, message.text.size(), stdout);
+  putchar('\n');
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s FILE...\n", argv[0]);
+    return 2;
+  }
+  int status = 0;
+  for (int i = 1; i < argc; ++i) {
+    FILE* file = strcmp(argv[i], "-") == 0 ? stdin : fopen(argv[i], "rb");
+    if (file == nullptr) {
+      perror(argv[i]);
+      status = 1;
+      continue;
+    }
+    BinaryLogReader reader(file);
+    BinaryLogMessage message;
+    while (reader.Next(&message)) {
+      PrintMessage(message);
+    }
+    if (!reader.error().empty()) {
+      fprintf(stderr, "%s: %s\n", argv[i], reader.error().c_str());
+      status = 1;
+    }
+    if (file != stdin) {
+      fclose(file);
+    }
+  }
+  return status;
+}
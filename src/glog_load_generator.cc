@@ -0,0 +1,444 @@
+// Copyright (c) 2024, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Simulates a server that logs a lot, to reproduce tail latencies that
+// only show up under load:
+//
+//   glog_load_generator [--threads=N] [--rate=MESSAGES_PER_SEC]
+//       [--duration=SECONDS] [--mix=CLASS:WEIGHT,...]
+//       [--sizes=BYTES:WEIGHT,...] [--sink] [--seed=N]
+//       [--log_dir=DIR] [--max_log_size=MB] [--log_cleaner_days=N]
+//       [--stderrthreshold=N] [--v=N]
+//
+// Every worker thread sends its share of --rate messages per second
+// (--rate=0: as fast as it can) for --duration seconds.  Each message
+// picks its class from --mix, one of info, warning, error, vlog1, vlog2
+// and sink (LOG_TO_SINK), and its payload size from --sizes.  With --sink,
+// a LogSink added with AddLogSink() sees every message as well.
+//
+// Files roll over at --max_log_size, the log cleaner removes files older
+// than --log_cleaner_days (0: all but the open ones), and messages at
+// --stderrthreshold or above are also written to stderr.
+//
+// The results are printed to stdout as CSV, a row per class and one for
+// all messages: the latency of the logging call as the caller sees it,
+// the messages per second achieved, the time by which calls exceeded the
+// interval between two messages of a thread ("blocked_ms"), the messages
+// the threads fell behind to send in time ("missed"), and the process CPU
+// time per message.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "glog/logging.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+enum MessageClass {
+  kInfo,
+  kWarning,
+  kError,
+  kVlog1,
+  kVlog2,
+  kSink,
+  kNumClasses
+};
+
+const char* const kClassNames[kNumClasses] = {"info",  "warning", "error",
+                                              "vlog1", "vlog2",   "sink"};
+
+struct Weighted {
+  int value;
+  int weight;
+};
+
+struct Options {
+  int threads{8};
+  double rate{10000};
+  double duration{10};
+  std::vector<Weighted> mix{{kInfo, 900},  {kWarning, 60}, {kError, 10},
+                            {kVlog1, 10},  {kVlog2, 10},   {kSink, 10}};
+  std::vector<Weighted> sizes{{64, 80}, {512, 18}, {4096, 2}};
+  bool sink{false};
+  unsigned seed{1};
+  std::string log_dir;
+  unsigned max_log_size{1};
+  unsigned log_cleaner_days{0};
+  int stderrthreshold{google::GLOG_ERROR};
+  int v{1};
+};
+
+// Log-linear histogram of nanoseconds: 16 buckets per power of two, so
+// percentiles are within 6.25%.
+class Histogram {
+ public:
+  void Add(uint64_t ns) {
+    ++buckets_[Bucket(ns)];
+    ++count_;
+    max_ = std::max(max_, ns);
+  }
+
+  void Merge(const Histogram& other) {
+    for (size_t i = 0; i < kBuckets; ++i) {
+      buckets_[i] += other.buckets_[i];
+    }
+    count_ += other.count_;
+    max_ = std::max(max_, other.max_);
+  }
+
+  uint64_t count() const { return count_; }
+  uint64_t max() const { return max_; }
+
+  // The lower bound of the bucket that holds the percentile.
+  uint64_t Percentile(double fraction) const {
+    const auto rank = static_cast<uint64_t>(fraction * count_);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kBuckets; ++i) {
+      seen += buckets_[i];
+      if (seen > rank) return LowerBound(i);
+    }
+    return max_;
+  }
+
+ private:
+  static constexpr size_t kSubBits = 4;
+  static constexpr size_t kSub = 1 << kSubBits;
+  static constexpr size_t kBuckets = 48 * kSub;
+
+  static size_t Bucket(uint64_t ns) {
+    if (ns < kSub) return static_cast<size_t>(ns);
+    size_t msb = 0;
+    while ((ns >> msb) > 1) ++msb;
+    const size_t shift = msb - kSubBits;
+    const size_t bucket =
+        (msb - kSubBits + 1) * kSub + ((ns >> shift) & (kSub - 1));
+    return std::min(bucket, kBuckets - 1);
+  }
+
+  static uint64_t LowerBound(size_t bucket) {
+    if (bucket < kSub) return bucket;
+    const size_t shift = bucket / kSub - 1;
+    return (kSub + bucket % kSub) << shift;
+  }
+
+  uint64_t buckets_[kBuckets]{};
+  uint64_t count_{0};
+  uint64_t max_{0};
+};
+
+struct WorkerStats {
+  Histogram latency[kNumClasses];
+  double blocked_ns[kNumClasses]{};
+  uint64_t missed{0};
+};
+
+// Counts the messages it receives, and does nothing else.
+class CountingSink : public google::LogSink {
+ public:
+  void send(google::LogSeverity /*severity*/, const char* /*full_filename*/,
+            const char* /*base_filename*/, int /*line*/,
+            const google::LogMessageTime& /*time*/, const char* /*message*/,
+            size_t /*message_len*/) override {
+    count_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+ private:
+  std::atomic<uint64_t> count_{0};
+};
+
+CountingSink sink;
+
+void Emit(int message_class, uint64_t request, const std::string& payload) {
+  switch (message_class) {
+    case kInfo:
+      LOG(INFO) << "request " << request << " served: " << payload;
+      break;
+    case kWarning:
+      LOG(WARNING) << "request " << request << " slow: " << payload;
+      break;
+    case kError:
+      LOG(ERROR) << "request " << request << " failed: " << payload;
+      break;
+    case kVlog1:
+      VLOG(1) << "request " << request << " detail: " << payload;
+      break;
+    case kVlog2:
+      VLOG(2) << "request " << request << " trace: " << payload;
+      break;
+    case kSink:
+      LOG_TO_SINK(&sink, INFO) << "request " << request << " audit: "
+                               << payload;
+      break;
+  }
+}
+
+std::discrete_distribution<int> MakeDistribution(
+    const std::vector<Weighted>& weighted) {
+  std::vector<int> weights;
+  for (const Weighted& w : weighted) {
+    weights.push_back(w.weight);
+  }
+  return std::discrete_distribution<int>(weights.begin(), weights.end());
+}
+
+void Work(const Options& options, int index, Clock::time_point start,
+          WorkerStats* stats) {
+  std::mt19937 random(options.seed + static_cast<unsigned>(index));
+  std::discrete_distribution<int> pick_class = MakeDistribution(options.mix);
+  std::discrete_distribution<int> pick_size = MakeDistribution(options.sizes);
+  std::vector<std::string> payloads;
+  for (const Weighted& size : options.sizes) {
+    payloads.emplace_back(static_cast<size_t>(size.value), 'x');
+  }
+
+  const Clock::time_point end =
+      start + std::chrono::duration_cast<Clock::duration>(
+                  std::chrono::duration<double>(options.duration));
+  // Zero when unthrottled.
+  const auto interval =
+      options.rate > 0 ? std::chrono::duration_cast<Clock::duration>(
+                             std::chrono::duration<double>(options.threads /
+                                                           options.rate))
+                       : Clock::duration::zero();
+  Clock::time_point scheduled = start;
+  for (uint64_t request = 0;; ++request, scheduled += interval) {
+    Clock::time_point now = Clock::now();
+    if (interval > Clock::duration::zero() && scheduled >= end) break;
+    if (now >= end) {
+      if (interval > Clock::duration::zero()) {
+        stats->missed += static_cast<uint64_t>((end - scheduled) / interval);
+      }
+      break;
+    }
+    if (now < scheduled) {
+      std::this_thread::sleep_until(scheduled);
+    }
+
+    const int message_class = options.mix[pick_class(random)].value;
+    const std::string& payload = payloads[pick_size(random)];
+    const Clock::time_point before = Clock::now();
+    Emit(message_class, request, payload);
+    const auto latency = Clock::now() - before;
+
+    const auto ns = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(latency)
+            .count());
+    stats->latency[message_class].Add(ns);
+    if (interval > Clock::duration::zero() && latency > interval) {
+      stats->blocked_ns[message_class] += static_cast<double>(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(latency -
+                                                               interval)
+              .count());
+    }
+  }
+}
+
+void PrintRow(const char* name, const Options& options, double elapsed,
+              const Histogram& latency, double blocked_ns,
+              const std::string& totals) {
+  printf("%s,%d,%.0f,%.3f,%llu,%.0f,%llu,%llu,%llu,%llu,%llu,%.3f,%s\n",
+         name, options.threads, options.rate, elapsed,
+         static_cast<unsigned long long>(latency.count()),
+         latency.count() / elapsed,
+         static_cast<unsigned long long>(latency.Percentile(0.5)),
+         static_cast<unsigned long long>(latency.Percentile(0.9)),
+         static_cast<unsigned long long>(latency.Percentile(0.99)),
+         static_cast<unsigned long long>(latency.Percentile(0.999)),
+         static_cast<unsigned long long>(latency.max()), blocked_ns / 1e6,
+         totals.c_str());
+}
+
+bool ParseWeighted(const char* text, std::vector<Weighted>* result,
+                   bool classes) {
+  result->clear();
+  std::string list = text;
+  size_t begin = 0;
+  while (begin <= list.size()) {
+    size_t comma = list.find(',', begin);
+    if (comma == std::string::npos) comma = list.size();
+    const std::string item = list.substr(begin, comma - begin);
+    const size_t colon = item.find(':');
+    if (colon == std::string::npos) return false;
+    const std::string key = item.substr(0, colon);
+    Weighted w;
+    w.weight = atoi(item.c_str() + colon + 1);
+    if (classes) {
+      const char* const* name =
+          std::find(kClassNames, kClassNames + kNumClasses, key);
+      if (name == kClassNames + kNumClasses) return false;
+      w.value = static_cast<int>(name - kClassNames);
+    } else {
+      w.value = atoi(key.c_str());
+      if (w.value < 0) return false;
+    }
+    if (w.weight < 0) return false;
+    result->push_back(w);
+    begin = comma + 1;
+  }
+  return !result->empty();
+}
+
+bool ParseFlag(const char* arg, const char* name, const char** value) {
+  const size_t length = strlen(name);
+  if (strncmp(arg, name, length) != 0 || arg[length] != '=') return false;
+  *value = arg + length + 1;
+  return true;
+}
+
+bool ParseOptions(int argc, char** argv, Options* options) {
+  for (int i = 1; i < argc; ++i) {
+    const char* value;
+    bool ok = true;
+    if (ParseFlag(argv[i], "--threads", &value)) {
+      options->threads = std::max(1, atoi(value));
+    } else if (ParseFlag(argv[i], "--rate", &value)) {
+      options->rate = std::max(0.0, atof(value));
+    } else if (ParseFlag(argv[i], "--duration", &value)) {
+      options->duration = atof(value);
+      ok = options->duration > 0;
+    } else if (ParseFlag(argv[i], "--mix", &value)) {
+      ok = ParseWeighted(value, &options->mix, true);
+    } else if (ParseFlag(argv[i], "--sizes", &value)) {
+      ok = ParseWeighted(value, &options->sizes, false);
+    } else if (strcmp(argv[i], "--sink") == 0) {
+      options->sink = true;
+    } else if (ParseFlag(argv[i], "--seed", &value)) {
+      options->seed = static_cast<unsigned>(strtoul(value, nullptr, 10));
+    } else if (ParseFlag(argv[i], "--log_dir", &value)) {
+      options->log_dir = value;
+    } else if (ParseFlag(argv[i], "--max_log_size", &value)) {
+      options->max_log_size =
+          static_cast<unsigned>(strtoul(value, nullptr, 10));
+    } else if (ParseFlag(argv[i], "--log_cleaner_days", &value)) {
+      options->log_cleaner_days =
+          static_cast<unsigned>(strtoul(value, nullptr, 10));
+    } else if (ParseFlag(argv[i], "--stderrthreshold", &value)) {
+      options->stderrthreshold = atoi(value);
+    } else if (ParseFlag(argv[i], "--v", &value)) {
+      options->v = atoi(value);
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      fprintf(stderr,
+              "Usage: %s [--threads=N] [--rate=MESSAGES_PER_SEC]"
+              " [--duration=SECONDS] [--mix=CLASS:WEIGHT,...]"
+              " [--sizes=BYTES:WEIGHT,...] [--sink] [--seed=N]"
+              " [--log_dir=DIR] [--max_log_size=MB] [--log_cleaner_days=N]"
+              " [--stderrthreshold=N] [--v=N]\n"
+              "CLASS is one of info, warning, error, vlog1, vlog2, sink.\n",
+              argv[0]);
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options options;
+  if (!ParseOptions(argc, argv, &options)) {
+    return 2;
+  }
+
+  if (!options.log_dir.empty()) {
+    FLAGS_log_dir = options.log_dir;
+  }
+  FLAGS_logtostderr = false;
+  FLAGS_max_log_size = options.max_log_size;
+  FLAGS_stderrthreshold = options.stderrthreshold;
+  FLAGS_v = options.v;
+  google::InitGoogleLogging(argv[0]);
+  google::EnableLogCleaner(options.log_cleaner_days);
+  if (options.sink) {
+    google::AddLogSink(&sink);
+  }
+
+  std::vector<WorkerStats> stats(static_cast<size_t>(options.threads));
+  std::vector<std::thread> threads;
+  const std::clock_t cpu_start = std::clock();
+  const Clock::time_point start = Clock::now();
+  for (int i = 0; i < options.threads; ++i) {
+    threads.emplace_back(&Work, std::cref(options), i, start, &stats[i]);
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  const double elapsed =
+      std::chrono::duration<double>(Clock::now() - start).count();
+  // Process CPU time on POSIX systems; wall time on Windows.
+  const double cpu_ns =
+      static_cast<double>(std::clock() - cpu_start) * 1e9 / CLOCKS_PER_SEC;
+
+  if (options.sink) {
+    google::RemoveLogSink(&sink);
+  }
+  google::ShutdownGoogleLogging();
+
+  printf(
+      "class,threads,target_rate,seconds,messages,messages_per_sec,p50_ns,"
+      "p90_ns,p99_ns,p999_ns,max_ns,blocked_ms,missed,cpu_ns_per_message\n");
+  Histogram all;
+  double all_blocked_ns = 0;
+  uint64_t missed = 0;
+  for (int c = 0; c < kNumClasses; ++c) {
+    Histogram latency;
+    double blocked_ns = 0;
+    for (const WorkerStats& s : stats) {
+      latency.Merge(s.latency[c]);
+      blocked_ns += s.blocked_ns[c];
+    }
+    if (latency.count() == 0) continue;
+    PrintRow(kClassNames[c], options, elapsed, latency, blocked_ns, ",");
+    all.Merge(latency);
+    all_blocked_ns += blocked_ns;
+  }
+  for (const WorkerStats& s : stats) {
+    missed += s.missed;
+  }
+  char totals[64];
+  snprintf(totals, sizeof(totals), "%llu,%.0f",
+           static_cast<unsigned long long>(missed),
+           all.count() > 0 ? cpu_ns / all.count() : 0.0);
+  PrintRow("all", options, elapsed, all, all_blocked_ns, totals);
+  return 0;
+}
@@ -0,0 +1,568 @@
+// Copyright (c) 2024, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "log_compressor.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "utilities.h"
+
+#ifdef HAVE_LIB_ZLIB
+# include <zlib.h>
+#endif
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#ifdef GLOG_OS_LINUX
+# include <sys/resource.h>
+# include <sys/syscall.h>
+#endif
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+
+namespace fs = std::filesystem;
+
+_START_GOOGLE_NAMESPACE_
+
+const char LogCompressor::kSuffix[] = ".gz";
+
+namespace {
+
+const char kTemporarySuffix[] = ".gz.tmp";
+// How much of the log file is read at a time.
+const size_t kChunkSize = 256U << 10U;
+
+bool EndsWith(const std::string& s, const char* suffix) {
+  const size_t n = strlen(suffix);
+  return s.size() > n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+#ifdef HAVE_LIB_ZLIB
+
+// Writes the gzip stream of the data written to it to out.
+class GzipEncoder {
+ public:
+  explicit GzipEncoder(FILE* out) : out_(out) {
+    // 15 + 16: the largest window, and a gzip header and trailer.
+    ok_ = deflateInit2(&stream_, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16,
+                       8, Z_DEFAULT_STRATEGY) == Z_OK;
+    initialized_ = ok_;
+  }
+  ~GzipEncoder() {
+    if (initialized_) deflateEnd(&stream_);
+  }
+
+  // size must not exceed kChunkSize.
+  bool Write(const char* data, size_t size) {
+    return Deflate(data, size, Z_NO_FLUSH);
+  }
+  bool Finish() { return Deflate(nullptr, 0, Z_FINISH); }
+
+ private:
+  bool Deflate(const char* data, size_t size, int flush) {
+    if (!ok_) return false;
+    stream_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    stream_.avail_in = static_cast<uInt>(size);
+    int ret;
+    do {
+      stream_.next_out = out_buffer_;
+      stream_.avail_out = sizeof(out_buffer_);
+      ret = deflate(&stream_, flush);
+      const size_t n = sizeof(out_buffer_) - stream_.avail_out;
+      if (ret == Z_STREAM_ERROR || fwrite(out_buffer_, 1, n, out_) != n) {
+        return ok_ = false;
+      }
+    } while (stream_.avail_out == 0);
+    return ok_ = flush != Z_FINISH || ret == Z_STREAM_END;
+  }
+
+  FILE* const out_;
+  z_stream stream_{};
+  bool initialized_;
+  bool ok_;
+  Bytef out_buffer_[16U << 10U];
+
+  GzipEncoder(const GzipEncoder&) = delete;
+  GzipEncoder& operator=(const GzipEncoder&) = delete;
+};
+
+#else  // !defined(HAVE_LIB_ZLIB)
+
+uint32 Crc32(uint32 crc, const unsigned char* data, size_t size) {
+  static const struct Table {
+    Table() {
+      for (uint32 i = 0; i < 256; ++i) {
+        uint32 c = i;
+        for (int k = 0; k < 8; ++k) {
+          c = (c & 1U) != 0 ? 0xedb88320U ^ (c >> 1U) : c >> 1U;
+        }
+        entries[i] = c;
+      }
+    }
+    uint32 entries[256];
+  } table;
+  crc = ~crc;
+  for (size_t i = 0; i < size; ++i) {
+    crc = table.entries[(crc ^ data[i]) & 0xffU] ^ (crc >> 8U);
+  }
+  return ~crc;
+}
+
+// Writes the gzip stream of the data written to it to out: one deflate
+// block with the fixed Huffman codes of RFC 1951, and LZ77 matches found
+// through hash chains.  Repeated log lines are what makes logs compress,
+// and matches find those just as well.
+class GzipEncoder {
+ public:
+  explicit GzipEncoder(FILE* out)
+      : out_(out), head_(size_t{1} << kHashBits, -1), prev_(kWindowSize) {
+    static const unsigned char kHeader[] = {
+        0x1f, 0x8b, 8 /* deflate */, 0, 0, 0, 0, 0, 0, 3 /* Unix */};
+    out_buffer_.assign(kHeader, kHeader + sizeof(kHeader));
+    PutBits(0, 1);  // not the final block
+    PutBits(1, 2);  // fixed Huffman codes
+  }
+
+  bool Write(const char* data, size_t size) {
+    const auto* bytes = reinterpret_cast<const unsigned char*>(data);
+    crc_ = Crc32(crc_, bytes, size);
+    size_ += static_cast<uint32>(size);
+    window_.insert(window_.end(), bytes, bytes + size);
+    Encode(false);
+    // Keep what later matches can refer to.
+    const size_t done = static_cast<size_t>(pos_ - base_);
+    if (done > kWindowSize) {
+      window_.erase(window_.begin(),
+                    window_.begin() + static_cast<std::ptrdiff_t>(
+                                          done - kWindowSize));
+      base_ += done - kWindowSize;
+    }
+    return Output(false);
+  }
+
+  bool Finish() {
+    Encode(true);
+    PutSymbol(256);  // end of block
+    PutBits(1, 1);   // an empty final block
+    PutBits(1, 2);
+    PutSymbol(256);
+    PutBits(0, (8 - bit_count_) % 8);
+    for (uint32 v : {crc_, size_}) {
+      for (int i = 0; i < 4; ++i) {
+        out_buffer_.push_back(static_cast<unsigned char>(v >> (8 * i)));
+      }
+    }
+    return Output(true);
+  }
+
+ private:
+  static constexpr size_t kWindowSize = 32768;
+  static constexpr size_t kMinMatch = 3;
+  static constexpr size_t kMaxMatch = 258;
+  static constexpr int kHashBits = 15;
+  static constexpr int kMaxChain = 32;
+
+  size_t Hash(size_t i) const {
+    const uint32 v = static_cast<uint32>(window_[i]) |
+                     static_cast<uint32>(window_[i + 1]) << 8U |
+                     static_cast<uint32>(window_[i + 2]) << 16U;
+    return (v * 2654435761U) >> (32 - kHashBits);
+  }
+
+  // Makes the string at pos findable.
+  void Insert(int64 pos) {
+    const auto i = static_cast<size_t>(pos - base_);
+    if (i + kMinMatch <= window_.size()) {
+      const size_t h = Hash(i);
+      prev_[static_cast<size_t>(pos) % kWindowSize] = head_[h];
+      head_[h] = pos;
+    }
+  }
+
+  // Encodes the window from pos_ on.  Unless final, stops where a match
+  // could run past the data we have.
+  void Encode(bool final) {
+    const int64 end = base_ + static_cast<int64>(window_.size());
+    const int64 limit = final ? end : end - static_cast<int64>(kMaxMatch);
+    while (pos_ < limit) {
+      const auto i = static_cast<size_t>(pos_ - base_);
+      const size_t max_length =
+          std::min(kMaxMatch, static_cast<size_t>(end - pos_));
+      size_t best_length = 0;
+      int64 best_distance = 0;
+      if (max_length >= kMinMatch) {
+        int64 candidate = head_[Hash(i)];
+        for (int chain = kMaxChain;
+             chain > 0 && candidate >= base_ &&
+             pos_ - candidate <= static_cast<int64>(kWindowSize);
+             --chain) {
+          const unsigned char* a = &window_[i];
+          const unsigned char* b =
+              &window_[static_cast<size_t>(candidate - base_)];
+          size_t length = 0;
+          while (length < max_length && a[length] == b[length]) ++length;
+          if (length > best_length) {
+            best_length = length;
+            best_distance = pos_ - candidate;
+            if (length == max_length) break;
+          }
+          const int64 next =
+              prev_[static_cast<size_t>(candidate) % kWindowSize];
+          // The slot was reused by a later string: the chain ends.
+          if (next >= candidate) break;
+          candidate = next;
+        }
+      }
+      if (best_length >= kMinMatch) {
+        PutMatch(best_length, static_cast<size_t>(best_distance));
+        for (size_t k = 0; k < best_length; ++k) Insert(pos_++);
+      } else {
+        PutSymbol(window_[i]);
+        Insert(pos_++);
+      }
+    }
+  }
+
+  void PutBits(uint32 bits, int count) {
+    bit_buffer_ |= static_cast<uint64>(bits) << bit_count_;
+    bit_count_ += count;
+    while (bit_count_ >= 8) {
+      out_buffer_.push_back(static_cast<unsigned char>(bit_buffer_));
+      bit_buffer_ >>= 8U;
+      bit_count_ -= 8;
+    }
+  }
+
+  // Huffman codes are packed starting with their most significant bit.
+  void PutCode(uint32 code, int length) {
+    uint32 reversed = 0;
+    for (int k = 0; k < length; ++k) {
+      reversed = (reversed << 1U) | ((code >> k) & 1U);
+    }
+    PutBits(reversed, length);
+  }
+
+  // A literal byte, the end of block, or a length code.
+  void PutSymbol(uint32 symbol) {
+    if (symbol < 144) {
+      PutCode(0x30 + symbol, 8);
+    } else if (symbol < 256) {
+      PutCode(0x190 + symbol - 144, 9);
+    } else if (symbol < 280) {
+      PutCode(symbol - 256, 7);
+    } else {
+      PutCode(0xc0 + symbol - 280, 8);
+    }
+  }
+
+  void PutMatch(size_t length, size_t distance) {
+    static const uint32 kLengthBase[] = {
+        3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+        31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    static const uint32 kDistanceBase[] = {
+        1,    2,    3,    4,    5,    7,     9,     13,    17,    25,
+        33,   49,   65,   97,   129,  193,   257,   385,   513,   769,
+        1025, 1537, 2049, 3073, 4097, 6145,  8193,  12289, 16385, 24577};
+    int code = 28;
+    while (kLengthBase[code] > length) --code;
+    PutSymbol(static_cast<uint32>(257 + code));
+    // 3 + (code - 4) / 4 extra bits, none for the first eight and 258.
+    if (code >= 8 && code < 28) {
+      PutBits(static_cast<uint32>(length - kLengthBase[code]), code / 4 - 1);
+    }
+    code = 29;
+    while (kDistanceBase[code] > distance) --code;
+    PutCode(static_cast<uint32>(code), 5);
+    if (code >= 4) {
+      PutBits(static_cast<uint32>(distance - kDistanceBase[code]),
+              code / 2 - 1);
+    }
+  }
+
+  bool Output(bool all) {
+    if (!all && out_buffer_.size() < (64U << 10U)) return true;
+    const size_t n = out_buffer_.size();
+    const bool ok = fwrite(out_buffer_.data(), 1, n, out_) == n;
+    out_buffer_.clear();
+    return ok;
+  }
+
+  FILE* const out_;
+  uint32 crc_{0};
+  uint32 size_{0};  // modulo 2^32, as gzip has it
+  // The data from base_ on; pos_ is the next byte to encode.
+  std::vector<unsigned char> window_;
+  int64 base_{0};
+  int64 pos_{0};
+  // The last position of each hash, and the one before each position.
+  std::vector<int64> head_;
+  std::vector<int64> prev_;
+  uint64 bit_buffer_{0};
+  int bit_count_{0};
+  std::vector<unsigned char> out_buffer_;
+
+  GzipEncoder(const GzipEncoder&) = delete;
+  GzipEncoder& operator=(const GzipEncoder&) = delete;
+};
+
+#endif  // defined(HAVE_LIB_ZLIB)
+
+std::mutex compressor_mutex;
+std::condition_variable compressor_cv;
+// Guarded by compressor_mutex.
+std::deque<std::string>* compressor_queue = nullptr;
+std::thread* compressor_thread = nullptr;
+// Set by Shutdown(): the compressor thread exits once the queue is empty.
+bool compressor_draining = false;
+// Set by the compressor thread when it exits.
+bool compressor_exited = false;
+// Bumped by Shutdown(); a compressor thread stops once it no longer
+// matches the generation it was started with.
+std::atomic<uint64> compressor_generation{0};
+
+bool Compress(const std::string& filename, uint64 generation) {
+  const std::string compressed = filename + LogCompressor::kSuffix;
+  const std::string temporary = filename + kTemporarySuffix;
+  std::error_code ec;
+  if (fs::exists(compressed, ec)) {
+    return false;
+  }
+  FILE* in = fopen(filename.c_str(), "rb");
+  if (in == nullptr) {
+    return false;
+  }
+  FILE* out = fopen(temporary.c_str(), "wb");
+  if (out == nullptr) {
+    fclose(in);
+    return false;
+  }
+  bool ok = true;
+  {
+    GzipEncoder encoder(out);
+    std::unique_ptr<char[]> buffer(new char[kChunkSize]);
+    while (ok) {
+      if (compressor_generation.load(std::memory_order_relaxed) !=
+          generation) {
+        ok = false;
+        break;
+      }
+      const size_t n = fread(buffer.get(), 1, kChunkSize, in);
+      if (n == 0) {
+        ok = ferror(in) == 0 && encoder.Finish();
+        break;
+      }
+      ok = encoder.Write(buffer.get(), n);
+    }
+  }
+  fclose(in);
+  ok = fflush(out) == 0 && ok;
+#ifdef HAVE_UNISTD_H
+  // On the disk before the original is removed.
+  ok = ok && fsync(fileno(out)) == 0;
+#endif
+  ok = fclose(out) == 0 && ok;
+  // Fails if the log cleaner removed the original meanwhile.
+  const fs::file_time_type mtime = fs::last_write_time(filename, ec);
+  ok = ok && !ec;
+  if (ok) {
+    fs::permissions(temporary, fs::status(filename, ec).permissions(), ec);
+    fs::last_write_time(temporary, mtime, ec);
+    fs::rename(temporary, compressed, ec);
+    ok = !ec;
+  }
+  if (!ok) {
+    fs::remove(temporary, ec);
+    return false;
+  }
+  fs::remove(filename, ec);
+  return true;
+}
+
+#ifndef NO_THREADS
+
+// Compression competes with the program for neither CPU nor disk.
+void LowerThreadPriority() {
+#ifdef GLOG_OS_LINUX
+  // The nice value of a Linux thread is its own.
+  setpriority(PRIO_PROCESS, static_cast<id_t>(GetTID()), 19);
+# ifdef SYS_ioprio_set
+  const int kIoprioWhoProcess = 1;
+  const int kIoprioClassIdle = 3;
+  const int kIoprioClassShift = 13;
+  syscall(SYS_ioprio_set, kIoprioWhoProcess, GetTID(),
+          kIoprioClassIdle << kIoprioClassShift);
+# endif
+#endif
+}
+
+void RunCompressor(uint64 generation) {
+  LowerThreadPriority();
+  for (;;) {
+    std::string filename;
+    {
+      std::unique_lock<std::mutex> l(compressor_mutex);
+      compressor_cv.wait(l, [generation] {
+        return compressor_generation.load() != generation ||
+               !compressor_queue->empty() || compressor_draining;
+      });
+      if (compressor_generation.load() != generation ||
+          compressor_queue->empty()) {
+        compressor_exited = true;
+        compressor_cv.notify_all();
+        return;
+      }
+      filename = std::move(compressor_queue->front());
+      compressor_queue->pop_front();
+    }
+    Compress(filename, generation);
+  }
+}
+
+#ifdef HAVE_PTHREAD
+// Keeps the compressor thread from holding compressor_mutex while the
+// process forks.
+void BeforeFork() { compressor_mutex.lock(); }
+
+void AfterForkInParent() { compressor_mutex.unlock(); }
+
+// The compressor thread is gone in the child, and the parent compresses
+// what it queued.
+void AfterForkInChild() {
+  // The std::thread object can neither be joined nor destroyed here.
+  compressor_thread = nullptr;
+  compressor_draining = false;
+  compressor_exited = false;
+  ++compressor_generation;
+  if (compressor_queue != nullptr) {
+    compressor_queue->clear();
+  }
+  compressor_mutex.unlock();
+}
+#endif
+
+#endif  // !defined(NO_THREADS)
+
+// Stops the compressor thread before the program exits without calling
+// ShutdownGoogleLogging(): it must not outlive the mutex.
+struct CompressorStopper {
+  ~CompressorStopper() { LogCompressor::Shutdown(); }
+} compressor_stopper;
+
+}  // namespace
+
+void LogCompressor::Enqueue(const std::string& filename) {
+#ifdef NO_THREADS
+  // Never compressed on the logging thread.
+  (void)filename;
+#else
+#ifdef HAVE_PTHREAD
+  static std::once_flag fork_handlers_registered;
+  std::call_once(fork_handlers_registered, [] {
+    pthread_atfork(&BeforeFork, &AfterForkInParent, &AfterForkInChild);
+  });
+#endif
+  {
+    std::lock_guard<std::mutex> l(compressor_mutex);
+    if (compressor_queue == nullptr) {
+      compressor_queue = new std::deque<std::string>;
+    }
+    compressor_queue->push_back(filename);
+    if (compressor_thread == nullptr) {
+      compressor_thread =
+          new std::thread(&RunCompressor, compressor_generation.load());
+    }
+  }
+  compressor_cv.notify_one();
+#endif
+}
+
+bool LogCompressor::CompressFile(const std::string& filename) {
+  return Compress(filename, compressor_generation.load());
+}
+
+void LogCompressor::Shutdown() {
+  std::thread* thread;
+  {
+    std::unique_lock<std::mutex> l(compressor_mutex);
+    thread = compressor_thread;
+    if (thread != nullptr) {
+      // Files left in the queue stay uncompressed until another process
+      // logs to them: give the thread some time to finish them.
+      compressor_draining = true;
+      compressor_cv.notify_all();
+      compressor_cv.wait_for(l, std::chrono::milliseconds(kShutdownTimeoutMs),
+                             [] { return compressor_exited; });
+    }
+    compressor_thread = nullptr;
+    compressor_draining = false;
+    compressor_exited = false;
+    ++compressor_generation;
+    if (compressor_queue != nullptr) {
+      compressor_queue->clear();
+    }
+  }
+  if (thread != nullptr) {
+    compressor_cv.notify_all();
+    thread->join();
+    delete thread;
+  }
+}
+
+void LogCompressor::RemoveStaleTemporary(const std::string& filename) {
+  if (!IsTemporaryName(filename)) return;
+  const std::string original =
+      filename.substr(0, filename.size() - strlen(kTemporarySuffix));
+  std::error_code ec;
+  if (!fs::exists(original, ec) && !ec) {
+    fs::remove(filename, ec);
+  }
+}
+
+bool LogCompressor::IsCompressedName(const std::string& filename) {
+  return EndsWith(filename, kSuffix);
+}
+
+bool LogCompressor::IsTemporaryName(const std::string& filename) {
+  return EndsWith(filename, kTemporarySuffix);
+}
+
+_END_GOOGLE_NAMESPACE_
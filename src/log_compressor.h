@@ -0,0 +1,89 @@
+// Copyright (c) 2024, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Compresses log files in the background once they are rolled over
+// (--log_compress).
+//
+// LogFileObject hands over every file it closes on rollover.  A single
+// thread, at the lowest CPU and I/O priority, gzips it to
+// "<name>.gz.tmp", gives that the modification time of the original, so
+// that the rotated logs keep their order, renames it to "<name>.gz" and
+// removes the original.  Readers see either file, complete.  With zlib
+// this is regular deflate; without, a built-in encoder writes deflate with
+// fixed Huffman codes, which compresses less but reads the same with
+// zcat.
+
+#ifndef GLOG_LOG_COMPRESSOR_H_
+#define GLOG_LOG_COMPRESSOR_H_
+
+#include "config.h"
+
+#include <string>
+
+#include "glog/logging.h"
+
+_START_GOOGLE_NAMESPACE_
+
+class LogCompressor {
+ public:
+  // The suffix of compressed log files.
+  static const char kSuffix[];
+
+  // How long Shutdown() waits for the queue to be compressed.
+  static constexpr int kShutdownTimeoutMs = 10000;
+
+  // Queues filename to be compressed by the background thread, which is
+  // started on demand.  Never waits for a compression.
+  static void Enqueue(const std::string& filename);
+
+  // Compresses filename on the calling thread.  Returns false, leaving
+  // filename alone, if that fails or "<filename>.gz" exists already.
+  static bool CompressFile(const std::string& filename);
+
+  // Stops the background thread once it compressed the files queued, or
+  // after kShutdownTimeoutMs.  Then the file being compressed is abandoned,
+  // and the files still queued stay as they are, until the next process
+  // logging to them queues them again.
+  static void Shutdown();
+
+  // Removes filename, the output of a compression that the process did
+  // not finish, unless the log file it belongs to still exists: compressing
+  // that one again overwrites it.
+  static void RemoveStaleTemporary(const std::string& filename);
+
+  // Whether filename ends in kSuffix.
+  static bool IsCompressedName(const std::string& filename);
+
+  // Whether filename is the output of a compression in progress.
+  static bool IsTemporaryName(const std::string& filename);
+};
+
+_END_GOOGLE_NAMESPACE_
+
+#endif  // GLOG_LOG_COMPRESSOR_H_
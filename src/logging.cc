@@ -28,15 +28,24 @@
 // OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #define _GNU_SOURCE 1 // needed for O_NOFOLLOW and pread()/pwrite()
+#define GMUTEX_TRYLOCK  // to time lock waits only when there are any
 
 #include "utilities.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
 #include <cstddef>
 #include <iomanip>
 #include <iterator>
+#include <limits>
+#include <mutex>
+#include <new>
 #include <string>
+#include <thread>
 
 #ifdef HAVE_UNISTD_H
 # include <unistd.h>  // For _exit.
@@ -77,8 +86,12 @@
 #endif
 #include "base/commandlineflags.h"  // to get the program name
 #include "base/googleinit.h"
+#include "binary_log.h"
 #include "glog/logging.h"
 #include "glog/raw_logging.h"
+#include "log_compressor.h"
+#include "mmap_file_writer.h"
+#include "uring_file_writer.h"
 
 #ifdef HAVE_STACKTRACE
 # include "stacktrace.h"
@@ -260,11 +273,55 @@ GLOG_DEFINE_string(log_backtrace_at, "",
 GLOG_DEFINE_bool(log_utc_time, false,
     "Use UTC time for logging.");
 
+GLOG_DEFINE_bool(log_coarse_clock, false,
+                 "Timestamp messages with a coarse clock where available "
+                 "(CLOCK_REALTIME_COARSE): cheaper to read, but only "
+                 "precise to a few milliseconds.");
+
 GLOG_DEFINE_int32(rolling_file_number, 10,
     "total log files kept on the disk, "
     "named log[0-9]: if files are all over capacity (max_log_size), will "
     "delete the oldest log file. 0 disables this feature.");
 
+GLOG_DEFINE_bool(log_mmap, BoolFromEnv("GOOGLE_LOG_MMAP", false),
+                 "preallocate each log file to --max_log_size and write it "
+                 "through a shared memory mapping (Linux only)");
+GLOG_DEFINE_bool(log_io_uring, BoolFromEnv("GOOGLE_LOG_IO_URING", false),
+                 "write the log files with io_uring where the kernel supports"
+                 " it, so that logging threads never wait for the disk");
+GLOG_DEFINE_bool(log_compress, BoolFromEnv("GOOGLE_LOG_COMPRESS", false),
+                 "gzip log files in a background thread once they are "
+                 "rolled over");
+GLOG_DEFINE_string(log_durability, "none",
+                   "when to fdatasync() the log files: none, error (after "
+                   "ERROR and FATAL messages) or periodic (whenever they are "
+                   "flushed because --logbufsecs passed)");
+
+GLOG_DEFINE_bool(logbinary, BoolFromEnv("GOOGLE_LOGBINARY", false),
+                 "write a single binary log file instead of the text log "
+                 "files; LOGF() arguments are stored unformatted. LOG() "
+                 "messages are stored as formatted text, so they take about "
+                 "as much space as in the text log files. Use glog_decode "
+                 "to read it");
+
+GLOG_DEFINE_bool(logasync, BoolFromEnv("GOOGLE_LOGASYNC", false),
+                 "hand log file writes over to a background thread instead "
+                 "of writing them from the logging thread");
+GLOG_DEFINE_uint32(logasync_buffer_kb, 256,
+                   "size (in KiB) of the per-thread buffer used by --logasync;"
+                   " values below 64 are silently raised to 64.");
+GLOG_DEFINE_uint32(logasync_full_wait_ms, 0,
+                   "if not 0, how long a thread whose --logasync buffer is "
+                   "full waits for the writer thread to make room; the "
+                   "message is dropped (and counted) after that. 0 waits "
+                   "as long as it takes");
+
+GLOG_DEFINE_int32(log_repeat_window_ms, 0,
+                  "collapse identical consecutive messages from the same LOG()"
+                  " statement and thread into one line and a repeat count, "
+                  "reported at least once per this many milliseconds; 0 "
+                  "disables this feature.");
+
 // TODO(hamaji): consider windows
 enum { PATH_SEPARATOR = '/' };
 
@@ -410,23 +467,23 @@ static const char* GetAnsiColorCode(GLogColor color) {
 
 #endif  // GLOG_OS_WINDOWS
 
-// Safely get max_log_size, overriding to 1 if it somehow gets defined as 0
-static uint32 MaxLogSize() {
-  return (FLAGS_max_log_size > 0 && FLAGS_max_log_size < 4096
-              ? FLAGS_max_log_size
-              : 1);
-}
-
 // An arbitrary limit on the length of a single log message.  This
 // is so that streaming can be done more efficiently.
 const size_t LogMessage::kMaxLogMessageLen = 30000;
 
+// Most messages fit in the buffer inside LogMessageData; longer ones move
+// to a buffer from MessageBufferPool.
+static const size_t kInlineMessageLen = 512;
+
 struct LogMessage::LogMessageData  {
   LogMessageData();
+  ~LogMessageData();
 
   int preserved_errno_;      // preserved errno
-  // Buffer space; contains complete message text.
-  char message_text_[LogMessage::kMaxLogMessageLen+1];
+  // The complete message text: inline_text_, or a pooled buffer once the
+  // message has outgrown it.  Set by Flush().
+  char* message_text_;
+  char inline_text_[kInlineMessageLen];
   LogStream stream_;
   char severity_;      // What level is this LogMessage logged at?
   int line_;                 // line number where logging call is.
@@ -442,26 +499,256 @@ struct LogMessage::LogMessageData  {
   size_t num_chars_to_syslog_;  // # of chars of msg to send to syslog
   const char* basename_;        // basename of file that called LOG
   const char* fullname_;        // fullname of file that called LOG
+  LogSite* site_;               // nullptr or the LOG() statement
   bool has_been_flushed_;       // false => data has not been flushed
   bool first_fatal_;            // true => this was first fatal msg
+  bool sent_fatal_to_log_;      // true => SendToLog() got a FATAL msg
 
  private:
   LogMessageData(const LogMessageData&) = delete;
   void operator=(const LogMessageData&) = delete;
 };
 
-// A mutex that allows only one thread to log at a time, to keep things from
-// getting jumbled.  Some other very uncommon logging operations (like
-// changing the destination file for log messages of a given severity) also
-// lock this mutex.  Please be sure that anybody who might possibly need to
-// lock it does so.
+// Buffers for the messages that do not fit in kInlineMessageLen bytes.
+// A growing message moves to a buffer at least twice as large each time,
+// up to kMaxLogMessageLen bytes; released buffers are kept for reuse, a
+// few of each size.
+class MessageBufferPool {
+ public:
+  // A LogStreamBuf::GrowFunction.
+  static bool Grow(base_logging::LogStreamBuf* buf, size_t len);
+  // Gives back the buffer of buf, unless it is the inline one.
+  static void Release(base_logging::LogStreamBuf* buf) {
+    Release(buf->pbase(), Length(buf));
+  }
+
+ private:
+  // kInlineMessageLen * 2, * 4, ..., then kMaxLogMessageLen.
+  static const int kNumSizes = 6;
+  static const size_t kMaxFreeBuffers = 8;
+
+  static size_t BufferSize(int size_index) {
+    return min(kInlineMessageLen << (size_index + 1),
+               LogMessage::kMaxLogMessageLen);
+  }
+  // The buffer length of buf, including the room for '\n' and '\0'.
+  static size_t Length(const base_logging::LogStreamBuf* buf) {
+    return buf->pcount() + buf->available() + 2;
+  }
+  static void Release(char* buffer, size_t length);
+
+  static Mutex mutex_;
+  static char* free_buffers_[kNumSizes][kMaxFreeBuffers];
+  static size_t num_free_buffers_[kNumSizes];
+};
+
+Mutex MessageBufferPool::mutex_;
+char* MessageBufferPool::free_buffers_[kNumSizes][kMaxFreeBuffers];
+size_t MessageBufferPool::num_free_buffers_[kNumSizes];
+
+bool MessageBufferPool::Grow(base_logging::LogStreamBuf* buf, size_t len) {
+  const size_t old_length = Length(buf);
+  // Leave room for '\n' and '\0'.
+  const size_t wanted = std::max(len + 2, 2 * old_length);
+  int size_index = 0;
+  while (size_index < kNumSizes - 1 && BufferSize(size_index) < wanted) {
+    ++size_index;
+  }
+  const size_t new_length = BufferSize(size_index);
+  if (new_length <= old_length) {
+    return false;  // Truncate the message at kMaxLogMessageLen.
+  }
+  char* buffer = nullptr;
+  {
+    MutexLock l(&mutex_);
+    if (num_free_buffers_[size_index] > 0) {
+      buffer = free_buffers_[size_index][--num_free_buffers_[size_index]];
+    }
+  }
+  if (buffer == nullptr) {
+    buffer = new (std::nothrow) char[new_length];
+    if (buffer == nullptr) {
+      return false;
+    }
+  }
+  char* const old_buffer = buf->pbase();
+  buf->MoveTo(buffer, new_length);
+  Release(old_buffer, old_length);
+  return true;
+}
+
+void MessageBufferPool::Release(char* buffer, size_t length) {
+  if (length <= kInlineMessageLen) {
+    return;
+  }
+  int size_index = 0;
+  while (BufferSize(size_index) < length) {
+    ++size_index;
+  }
+  {
+    MutexLock l(&mutex_);
+    if (num_free_buffers_[size_index] < kMaxFreeBuffers) {
+      free_buffers_[size_index][num_free_buffers_[size_index]++] = buffer;
+      return;
+    }
+  }
+  delete[] buffer;
+}
+
+// Protects the logging configuration: the set of log destinations, their
+// loggers and file names, the email settings and so on.  Sending a message
+// only takes a reader lock, so threads logging at the same time only
+// contend on the destinations they actually share (each LogFileObject has
+// its own lock_, console output has console_mutex, sinks are expected to
+// be thread-safe).  Anything that changes the configuration takes the
+// writer lock.  Please be sure that anybody who might possibly need to lock
+// it does so.
 static Mutex log_mutex;
 
-// Number of messages sent at each severity.  Under log_mutex.
-int64 LogMessage::num_messages_[NUM_SEVERITIES] = {0, 0, 0, 0};
+// Serializes colored console output, which takes several writes per message.
+static Mutex console_mutex;
 
 // Globally disable log writing (if disk is full)
-static bool stop_writing = false;
+static std::atomic<bool> stop_writing{false};
+
+namespace {
+
+// The counters behind GetLoggingStats(), in shards.  A thread only adds
+// to the shard picked by its thread ID, so threads logging at the same
+// time rarely write to the same cache lines.
+struct alignas(64) LoggingStatsShard {
+  struct Severity {
+    std::atomic<int64> messages;
+    std::atomic<int64> truncated_messages;
+    std::atomic<int64> log_mutex_wait_ns;
+  } severity[NUM_SEVERITIES];
+  struct File {
+    std::atomic<int64> bytes_written;
+    std::atomic<int64> dropped_messages;
+    std::atomic<int64> lock_wait_ns;
+    std::atomic<int64> flushes;
+    std::atomic<int64> flush_ns;
+    std::atomic<int64> rollovers;
+    std::atomic<int64> rollover_ns;
+  } file[NUM_SEVERITIES];
+  std::atomic<int64> console_bytes_written;
+  std::atomic<int64> sink_sends;
+  std::atomic<int64> sink_send_ns;
+};
+
+const size_t kLoggingStatsShards = 16;
+LoggingStatsShard logging_stats[kLoggingStatsShards];
+
+LoggingStatsShard& LocalLoggingStats() {
+  return logging_stats[static_cast<uint32>(GetTID()) % kLoggingStatsShards];
+}
+
+void AddStat(std::atomic<int64>* counter, int64 n) {
+  counter->fetch_add(n, std::memory_order_relaxed);
+}
+
+int64 LoadStat(const std::atomic<int64>& counter) {
+  return counter.load(std::memory_order_relaxed);
+}
+
+int64 NowNanos() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Like MutexLock and ReaderMutexLock, and add the time spent waiting for
+// the mutex to wait_ns.  The clock is only read if the mutex is busy.
+class TimedMutexLock {
+ public:
+  TimedMutexLock(Mutex* mu, std::atomic<int64>* wait_ns) : mu_(mu) {
+    if (!mu_->TryLock()) {
+      const int64 start = NowNanos();
+      mu_->Lock();
+      AddStat(wait_ns, NowNanos() - start);
+    }
+  }
+  ~TimedMutexLock() { mu_->Unlock(); }
+
+ private:
+  Mutex* const mu_;
+  TimedMutexLock(const TimedMutexLock&) = delete;
+  void operator=(const TimedMutexLock&) = delete;
+};
+
+class TimedReaderMutexLock {
+ public:
+  TimedReaderMutexLock(Mutex* mu, std::atomic<int64>* wait_ns) : mu_(mu) {
+    if (!mu_->ReaderTryLock()) {
+      const int64 start = NowNanos();
+      mu_->ReaderLock();
+      AddStat(wait_ns, NowNanos() - start);
+    }
+  }
+  ~TimedReaderMutexLock() { mu_->ReaderUnlock(); }
+
+ private:
+  Mutex* const mu_;
+  TimedReaderMutexLock(const TimedReaderMutexLock&) = delete;
+  void operator=(const TimedReaderMutexLock&) = delete;
+};
+
+// Read-copy-update of the sink list, so that logging takes no lock on it.
+// The published list is never changed: AddLogSink() and RemoveLogSink()
+// publish a changed copy, and delete the old one after Synchronize().
+//
+// Readers announce themselves in a sharded counter, picked by their thread
+// ID from one of two sets.  The set is the parity of epoch_.  Synchronize()
+// flips the parity and waits for the readers counted in the old set, which
+// no new reader joins.  It does so twice, once for each set, because a
+// reader that read the parity before an earlier flip counts itself in
+// whichever set that parity picked.  A reader that counts itself after a
+// writer has looked at its counter also sees the list that writer published.
+class SinkReaders {
+ public:
+  // Everything read from the published list must be used inside a Section.
+  class Section {
+   public:
+    Section()
+        : readers_(&counters_[epoch_.load() & 1U]
+                             [static_cast<uint32>(GetTID()) % kShards]
+                                 .readers) {
+      readers_->fetch_add(1);
+    }
+    ~Section() { readers_->fetch_sub(1, std::memory_order_release); }
+
+   private:
+    std::atomic<int64>* const readers_;
+    Section(const Section&) = delete;
+    void operator=(const Section&) = delete;
+  };
+
+  // Waits until no reader can still use a list that was replaced before the
+  // call.  Writers must not run it at the same time, nor inside a Section.
+  static void Synchronize() {
+    for (int flip = 0; flip < 2; ++flip) {
+      const uint32 old_parity = epoch_.fetch_add(1) & 1U;
+      for (Counter& counter : counters_[old_parity]) {
+        while (counter.readers.load() != 0) {
+          std::this_thread::yield();
+        }
+      }
+    }
+  }
+
+ private:
+  struct alignas(64) Counter {
+    std::atomic<int64> readers{0};
+  };
+  static const uint32 kShards = 64;
+  static std::atomic<uint32> epoch_;
+  static Counter counters_[2][kShards];
+};
+
+std::atomic<uint32> SinkReaders::epoch_{0};
+SinkReaders::Counter SinkReaders::counters_[2][SinkReaders::kShards];
+
+}  // namespace
 
 const char*const LogSeverityNames[NUM_SEVERITIES] = {
   "INFO", "WARNING", "ERROR", "FATAL"
@@ -509,6 +796,13 @@ class LogFileObject : public base::Logger {
   void SetExtension(const char* ext);
   void SetSymlinkBasename(const char* symlink_basename);
 
+  // Whether Write() writes anything at all; false once the base filename
+  // is "".
+  bool enabled() {
+    MutexLock l(&lock_);
+    return !base_filename_selected_ || !base_filename_.empty();
+  }
+
   // Normal flushing routine
   void Flush() override;
 
@@ -528,6 +822,13 @@ class LogFileObject : public base::Logger {
   // according to FLAGS_max_logfile_num
   void CheckHistoryFileNum();
 
+  // Queues the uncompressed files that CheckHistoryFileNum() found for
+  // --log_compress, but file_ and those that other processes still write,
+  // and removes the temporary files that crashed compressions left.  The
+  // compressor gives up on its queue after a while at exit, so these are
+  // mostly what the previous run rolled over last.
+  void QueueLeftoverLogs();
+
  private:
   static const uint32 kRolloverAttemptFrequency = 0x20;
 
@@ -537,6 +838,18 @@ class LogFileObject : public base::Logger {
   string symlink_basename_;
   string filename_extension_;     // option users can specify (eg to add port#)
   FILE* file_{nullptr};
+  // The name of file_, and the fork generation that created it, for
+  // --log_compress.
+  string filename_;
+  uint32 file_fork_generation_{0};
+  // Whether QueueLeftoverLogs() ran since the base filename was set.
+  bool leftovers_queued_{false};
+  // Write to file_ with --log_mmap and --log_io_uring.
+  std::unique_ptr<MmapFileWriter> mmap_;
+  std::unique_ptr<UringFileWriter> uring_;
+  // A duplicate of file_'s descriptor for GroupCommit() to sync without
+  // holding lock_.
+  std::shared_ptr<int> sync_fd_;
   LogSeverity severity_;
   uint32 bytes_since_flush_{0};
   uint32 dropped_mem_length_{0};
@@ -545,8 +858,21 @@ class LogFileObject : public base::Logger {
   int64 next_flush_time_{0};  // cycle count at which to flush log
   WallTime start_time_;
   std::multiset<Filetime> file_list_;
+  // The compressor's temporary files that CheckHistoryFileNum() found.
+  vector<string> temporary_files_;
   bool initialized_;
   std::tm tm_time_;
+  // CheckNeedRollLogFiles() found no day/hour rollover for the local
+  // minute [no_roll_from_, no_roll_until_).
+  time_t no_roll_from_{0};
+  time_t no_roll_until_{0};
+  // Counts the messages written, to tell which GroupCommit() covered.
+  uint64 write_seq_{0};
+  bool datasync_wanted_{false};
+
+  // Held by GroupCommit(); taken before lock_, never the other way round.
+  Mutex commit_lock_;
+  uint64 committed_seq_{0};  // Guarded by commit_lock_.
 
   // Actually create a logfile using the value of base_filename_ and the
   // optional argument time_pid_string
@@ -558,6 +884,21 @@ class LogFileObject : public base::Logger {
   // Actually create a logfile using full file name and flags
   bool CreateLogfileInternal(const fs::path &filename, int flags);
 
+  // Does the work of Write().  Returns the write_seq_ up to which
+  // GroupCommit() must flush, or 0.
+  // REQUIRES: lock_ is held
+  uint64 WriteUnlocked(bool force_flush, time_t timestamp,
+                       const char* message, size_t message_len);
+
+  // Flushes, and syncs if asked to, everything up to write_seq_ seq.
+  // REQUIRES: lock_ is not held
+  void GroupCommit(uint64 seq);
+
+  // REQUIRES: lock_ is held
+  void CloseLogfile();
+  // Returns the errno of a failed write, if known.
+  int WriteToLogfile(const char* data, size_t size);
+
   // Check if log file is getting too big or match the date time condition, If
   // so, rollover.
   bool CheckNeedRollLogFiles(time_t timestamp);
@@ -594,16 +935,28 @@ class LogCleaner {
 
   bool enabled_{false};
   unsigned int overdue_days_{7};
+  // Log files of different severities are written (and hence call Run())
+  // concurrently; this protects next_cleanup_time_.
+  Mutex lock_;
   int64 next_cleanup_time_{0};  // cycle count at which to clean overdue log
 };
 
 LogCleaner log_cleaner;
 
+// Reports the "Last message repeated N times" that --log_repeat_window_ms
+// holds back, once the window expires, or all of them.
+void ReportPendingRepeats(bool all);
+
+// Reports the messages that the rate limits suppressed, for the limits
+// that no message got through since for a while, or for all of them.
+void ReportRateLimitedMessages(bool all);
+
 }  // namespace
 
 class LogDestination {
  public:
   friend class LogMessage;
+  friend class AsyncLogRing;
   friend void ReprintFatalMessage();
   friend base::Logger* base::GetLogger(LogSeverity);
   friend void base::SetLogger(LogSeverity, base::Logger*);
@@ -635,6 +988,21 @@ class LogDestination {
 
   static void DeleteLogDestinations();
 
+  // Whether a message of this severity sent by LogMessage::SendToLog()
+  // reaches any destination at all.
+  static bool WantsSeverity(LogSeverity severity);
+  // Recomputes consumed_severities_; called whenever the log files, the
+  // loggers, the sinks or the email settings change.
+  static void UpdateConsumedSeverities();
+
+  // --logbinary support.
+  static bool BinaryLogTakesMessages(LogSeverity severity);
+  static void RecordBinary(const char* file, int line, LogSeverity severity,
+                           const char* format, const logf_internal::Arg* args,
+                           size_t num_args);
+  static BinaryLogWriter* binary_log();
+  static void CloseBinaryLog();
+
  private:
   LogDestination(LogSeverity severity, const char* base_filename);
   ~LogDestination();
@@ -679,36 +1047,516 @@ class LogDestination {
   LogFileObject fileobject_;
   base::Logger* logger_;      // Either &fileobject_, or wrapper around it
 
-  static LogDestination* log_destinations_[NUM_SEVERITIES];
-  static LogSeverity email_logging_severity_;
+  // Created on first use.  Readers need not hold log_mutex exclusively,
+  // so creation is serialized by destinations_mutex_ instead.
+  static std::atomic<LogDestination*> log_destinations_[NUM_SEVERITIES];
+  static Mutex destinations_mutex_;
+  // Written under log_mutex; atomic because BinaryLogTakesMessages()
+  // reads it without.
+  static std::atomic<LogSeverity> email_logging_severity_;
   static string addresses_;
   static string hostname_;
   static bool terminal_supports_color_;
 
-  // arbitrary global logging destinations.
-  static vector<LogSink*>* sinks_;
+  // arbitrary global logging destinations; nullptr if there are none.
+  // Read without a lock, see SinkReaders.
+  static std::atomic<const vector<LogSink*>*> sinks_;
 
-  // Protects the vector sinks_,
-  // but not the LogSink objects its elements reference.
+  // Serializes the changes to sinks_.
   static Mutex sink_mutex_;
 
+  // Bit s is set if a log file, a logger, a sink or email takes messages of
+  // severity s.  The flags can be assigned directly at any time, so they
+  // are not part of it; WantsSeverity() checks them when the bit is clear.
+  static std::atomic<uint32> consumed_severities_;
+  // Serializes UpdateConsumedSeverities().
+  static Mutex consumed_severities_mutex_;
+
+  static std::atomic<bool> binary_log_used_;
+
   // Disallow
   LogDestination(const LogDestination&) = delete;
   LogDestination& operator=(const LogDestination&) = delete;
 };
 
 // Errors do not get logged to email by default.
-LogSeverity LogDestination::email_logging_severity_ = 99999;
+std::atomic<LogSeverity> LogDestination::email_logging_severity_{99999};
 
 string LogDestination::addresses_;
 string LogDestination::hostname_;
 
-vector<LogSink*>* LogDestination::sinks_ = nullptr;
+std::atomic<const vector<LogSink*>*> LogDestination::sinks_{nullptr};
 Mutex LogDestination::sink_mutex_;
+// Every log file takes every message until told otherwise.
+std::atomic<uint32> LogDestination::consumed_severities_{
+    (1U << NUM_SEVERITIES) - 1};
+Mutex LogDestination::consumed_severities_mutex_;
+std::atomic<bool> LogDestination::binary_log_used_{false};
 bool LogDestination::terminal_supports_color_ = TerminalSupportsColor();
 
+// --logasync support.
+//
+// Every thread that logs gets its own single-producer/single-consumer ring
+// of formatted messages.  The logging thread only copies its message into
+// its ring; a background writer thread (or anybody that needs the log files
+// to be up to date, like FlushLogFiles(), LOG(FATAL) and
+// ShutdownGoogleLogging()) drains all rings into the base::Logger
+// destinations.  Messages of a single thread are written in order; messages
+// of different threads are only ordered by their timestamps.
+//
+// Lock order: log_mutex, then AsyncLogWriter::drain_mutex_.
+#if defined(GLOG_THREAD_LOCAL_STORAGE) && !defined(NO_THREADS)
+# define HAVE_ASYNC_LOGGING
+#endif
+
+#ifdef HAVE_ASYNC_LOGGING
+
+class AsyncLogRing {
+ public:
+  explicit AsyncLogRing(size_t capacity)
+      : buffer_(new char[capacity]), capacity_(capacity) {}
+  ~AsyncLogRing() { delete[] buffer_; }
+
+  // Producer side.  Returns false if the record does not fit right now.
+  bool TryPush(LogSeverity severity, time_t timestamp, const char* message,
+               size_t len);
+
+  // Consumer side.  Writes every pending record to the log files.
+  // REQUIRES: AsyncLogWriter::drain_mutex_ is held.
+  void Drain();
+
+  // Consumer side.  Drops every pending record.
+  // REQUIRES: AsyncLogWriter::drain_mutex_ is held.
+  void Discard() {
+    tail_.store(head_.load(std::memory_order_acquire),
+                std::memory_order_release);
+  }
+
+  bool empty() const {
+    return head_.load(std::memory_order_acquire) ==
+           tail_.load(std::memory_order_acquire);
+  }
+  size_t used() const {
+    return head_.load(std::memory_order_acquire) -
+           tail_.load(std::memory_order_acquire);
+  }
+  size_t capacity() const { return capacity_; }
+
+  // Number of ring bytes taken by a message of len bytes.
+  static size_t RecordSize(size_t len) {
+    const size_t align = sizeof(RecordHeader);
+    return (sizeof(RecordHeader) + len + align - 1) / align * align;
+  }
+
+  // Set once the owning thread has exited; the ring is deleted by the
+  // consumer as soon as it has been drained.
+  std::atomic<bool> orphaned_{false};
+
+ private:
+  struct RecordHeader {
+    uint32 length;       // message length, or kWrapMarker
+    int32 severity;
+    int64 timestamp;
+  };
+  static const uint32 kWrapMarker = 0xffffffffU;
+
+  char* buffer_;
+  const size_t capacity_;
+  // Total number of bytes ever produced/consumed; the buffer offset is
+  // the counter modulo capacity_.
+  std::atomic<size_t> head_{0};
+  std::atomic<size_t> tail_{0};
+
+  AsyncLogRing(const AsyncLogRing&) = delete;
+  AsyncLogRing& operator=(const AsyncLogRing&) = delete;
+};
+
+bool AsyncLogRing::TryPush(LogSeverity severity, time_t timestamp,
+                           const char* message, size_t len) {
+  const size_t need = RecordSize(len);
+  size_t head = head_.load(std::memory_order_relaxed);
+  const size_t tail = tail_.load(std::memory_order_acquire);
+  size_t offset = head % capacity_;
+  // Records never straddle the end of the buffer: skip the remainder.
+  const size_t pad = (capacity_ - offset < need) ? capacity_ - offset : 0;
+  if (need + pad > capacity_ - (head - tail)) {
+    return false;
+  }
+  if (pad != 0) {
+    reinterpret_cast<RecordHeader*>(buffer_ + offset)->length = kWrapMarker;
+    head += pad;
+    offset = 0;
+  }
+  auto* header = reinterpret_cast<RecordHeader*>(buffer_ + offset);
+  header->length = static_cast<uint32>(len);
+  header->severity = severity;
+  header->timestamp = timestamp;
+  memcpy(buffer_ + offset + sizeof(RecordHeader), message, len);
+  head_.store(head + need, std::memory_order_release);
+  return true;
+}
+
+void AsyncLogRing::Drain() {
+  size_t tail = tail_.load(std::memory_order_relaxed);
+  const size_t head = head_.load(std::memory_order_acquire);
+  while (tail != head) {
+    const size_t offset = tail % capacity_;
+    const auto* header =
+        reinterpret_cast<const RecordHeader*>(buffer_ + offset);
+    if (header->length == kWrapMarker) {
+      tail += capacity_ - offset;
+    } else {
+      LogDestination::LogToAllLogfiles(
+          header->severity, static_cast<time_t>(header->timestamp),
+          buffer_ + offset + sizeof(RecordHeader), header->length);
+      tail += RecordSize(header->length);
+    }
+    // Hand the space back as we go so the producer never waits for a
+    // whole batch.
+    tail_.store(tail, std::memory_order_release);
+  }
+}
+
+class AsyncLogWriter {
+ public:
+  // Queues a message for the log files.  Returns false if the caller has
+  // to write the message itself.
+  // REQUIRES: log_mutex is held (a reader lock is enough).
+  static bool Enqueue(LogSeverity severity, time_t timestamp,
+                      const char* message, size_t len);
+
+  // Writes every queued message to the log files before returning.
+  // REQUIRES: log_mutex is held (a reader lock is enough).
+  static void Drain();
+
+  // Like Drain(), but gives up instead of blocking.  For
+  // FlushLogFilesUnsafe(), which must not wait on other threads.
+  static void TryDrain();
+
+  // Queues the messages that Enqueue() found no room for, waiting for the
+  // writer thread as long as --logasync_full_wait_ms says.
+  // REQUIRES: log_mutex is not held.
+  static void PushPending();
+
+  // Drains the rings and stops the writer thread.  It is restarted on
+  // demand if --logasync is still set afterwards.
+  static void Shutdown();
+
+ private:
+  // A message that waits for room in the ring.
+  struct PendingMessage {
+    LogSeverity severity;
+    time_t timestamp;
+    std::string message;
+  };
+
+  struct RingHolder {
+    AsyncLogRing* ring{nullptr};
+    // Messages for the full ring, in order.  Enqueue() holds log_mutex,
+    // which the writer thread needs, so PushPending() waits instead.
+    std::vector<PendingMessage> pending;
+    ~RingHolder() {
+      if (ring != nullptr) ring->orphaned_.store(true);
+    }
+  };
+
+  static AsyncLogRing* ThreadRing();
+  static void StartThread();
+  static void DrainLocked();
+  static void Wake();
+  // Waits for the writer to make room in the full ring, rather than
+  // writing the log files on this thread.  Returns false if the message
+  // could not be queued within --logasync_full_wait_ms.
+  static bool WaitAndPush(AsyncLogRing* ring, LogSeverity severity,
+                          time_t timestamp, const char* message, size_t len);
+  static void Run(uint64 generation);
+#ifdef HAVE_PTHREAD
+  static void BeforeFork();
+  static void AfterForkInParent();
+  static void AfterForkInChild();
+#endif
+
+  // How long the writer sleeps when nobody wakes it up.
+  static constexpr int kPollIntervalMs = 20;
+
+  static thread_local RingHolder ring_holder_;
+  // Protects rings_ and the consumer side of every ring.
+  static std::mutex drain_mutex_;
+  static std::vector<AsyncLogRing*>* rings_;
+
+  // Protects generation_ and thread_.
+  static std::mutex wake_mutex_;
+  static std::condition_variable wake_cv_;
+  static std::atomic<bool> wake_pending_;
+  // Threads waiting for room in their ring, on space_cv_.
+  static std::condition_variable space_cv_;
+  static std::atomic<int> space_waiters_;
+  static std::atomic<bool> running_;
+  // Bumped by Shutdown(); a writer thread exits once it no longer matches
+  // the generation it was started with.
+  static uint64 generation_;
+  static std::thread* thread_;
+};
+
+thread_local AsyncLogWriter::RingHolder AsyncLogWriter::ring_holder_;
+std::mutex AsyncLogWriter::drain_mutex_;
+std::vector<AsyncLogRing*>* AsyncLogWriter::rings_ = nullptr;
+std::mutex AsyncLogWriter::wake_mutex_;
+std::condition_variable AsyncLogWriter::wake_cv_;
+std::atomic<bool> AsyncLogWriter::wake_pending_{false};
+std::condition_variable AsyncLogWriter::space_cv_;
+std::atomic<int> AsyncLogWriter::space_waiters_{0};
+std::atomic<bool> AsyncLogWriter::running_{false};
+uint64 AsyncLogWriter::generation_ = 0;
+std::thread* AsyncLogWriter::thread_ = nullptr;
+
+AsyncLogRing* AsyncLogWriter::ThreadRing() {
+  if (ring_holder_.ring == nullptr) {
+    size_t capacity =
+        static_cast<size_t>(std::max<uint32>(FLAGS_logasync_buffer_kb, 64))
+        << 10U;
+    auto* ring = new AsyncLogRing(capacity);
+    std::lock_guard<std::mutex> l(drain_mutex_);
+    if (rings_ == nullptr) rings_ = new std::vector<AsyncLogRing*>;
+    rings_->push_back(ring);
+    ring_holder_.ring = ring;
+  }
+  return ring_holder_.ring;
+}
+
+bool AsyncLogWriter::Enqueue(LogSeverity severity, time_t timestamp,
+                             const char* message, size_t len) {
+  log_mutex.AssertHeld();
+  if (!FLAGS_logasync) return false;
+  AsyncLogRing* ring = ThreadRing();
+  if (2 * AsyncLogRing::RecordSize(len) > ring->capacity()) {
+    // Too big to ever be queued; keep it in order with what this thread
+    // queued so far and let the caller write it.
+    std::lock_guard<std::mutex> l(drain_mutex_);
+    ring->Drain();
+    return false;
+  }
+  if (!running_.load(std::memory_order_acquire)) {
+    StartThread();
+  }
+  std::vector<PendingMessage>& pending = ring_holder_.pending;
+  if (!pending.empty() ||
+      !ring->TryPush(severity, timestamp, message, len)) {
+    pending.push_back({severity, timestamp, std::string(message, len)});
+  }
+  if (severity > FLAGS_logbuflevel || 2 * ring->used() >= ring->capacity()) {
+    Wake();
+  }
+  return true;
+}
+
+bool AsyncLogWriter::WaitAndPush(AsyncLogRing* ring, LogSeverity severity,
+                                 time_t timestamp, const char* message,
+                                 size_t len) {
+  const uint32 wait_ms = FLAGS_logasync_full_wait_ms;
+  const auto deadline = std::chrono::steady_clock::now() +
+                        std::chrono::milliseconds(wait_ms);
+  space_waiters_.fetch_add(1);
+  bool pushed = false;
+  for (;;) {
+    // Shutdown() stopped the writer meanwhile.
+    if (!running_.load(std::memory_order_acquire)) {
+      StartThread();
+    }
+    std::unique_lock<std::mutex> l(wake_mutex_);
+    // Pushing under wake_mutex_ makes sure that the writer, which takes
+    // it after draining, cannot free the space unnoticed.
+    if ((pushed = ring->TryPush(severity, timestamp, message, len))) {
+      break;
+    }
+    Wake();
+    if (wait_ms == 0) {
+      space_cv_.wait_for(l, std::chrono::milliseconds(kPollIntervalMs));
+    } else if (space_cv_.wait_until(l, deadline) ==
+               std::cv_status::timeout) {
+      pushed = ring->TryPush(severity, timestamp, message, len);
+      break;
+    }
+  }
+  space_waiters_.fetch_sub(1);
+  return pushed;
+}
+
+void AsyncLogWriter::PushPending() {
+  std::vector<PendingMessage>& pending = ring_holder_.pending;
+  if (pending.empty()) return;
+  for (const PendingMessage& m : pending) {
+    if (!WaitAndPush(ring_holder_.ring, m.severity, m.timestamp,
+                     m.message.data(), m.message.size())) {
+      AddStat(&LocalLoggingStats().file[m.severity].dropped_messages, 1);
+    }
+  }
+  pending.clear();
+}
+
+void AsyncLogWriter::StartThread() {
+#ifdef HAVE_PTHREAD
+  static std::once_flag fork_handlers_registered;
+  std::call_once(fork_handlers_registered, [] {
+    pthread_atfork(&BeforeFork, &AfterForkInParent, &AfterForkInChild);
+  });
+#endif
+  std::lock_guard<std::mutex> l(wake_mutex_);
+  if (thread_ == nullptr) {
+    thread_ = new std::thread(&AsyncLogWriter::Run, generation_);
+    running_.store(true, std::memory_order_release);
+  }
+}
+
+void AsyncLogWriter::Drain() {
+  std::lock_guard<std::mutex> l(drain_mutex_);
+  DrainLocked();
+}
+
+void AsyncLogWriter::TryDrain() {
+  std::unique_lock<std::mutex> l(drain_mutex_, std::try_to_lock);
+  if (l.owns_lock()) {
+    DrainLocked();
+  }
+}
+
+void AsyncLogWriter::DrainLocked() {
+  if (rings_ == nullptr) return;
+  for (size_t i = 0; i < rings_->size();) {
+    AsyncLogRing* ring = (*rings_)[i];
+    // Read orphaned_ first: a ring that is orphaned after draining it
+    // is still empty.
+    const bool orphaned = ring->orphaned_.load();
+    ring->Drain();
+    if (orphaned) {
+      delete ring;
+      (*rings_)[i] = rings_->back();
+      rings_->pop_back();
+    } else {
+      ++i;
+    }
+  }
+}
+
+void AsyncLogWriter::Wake() {
+  // A wakeup lost to a race only delays the writer by kPollIntervalMs.
+  if (!wake_pending_.exchange(true)) {
+    wake_cv_.notify_one();
+  }
+}
+
+void AsyncLogWriter::Run(uint64 generation) {
+  bool stop = false;
+  while (!stop) {
+    {
+      std::unique_lock<std::mutex> l(wake_mutex_);
+      wake_cv_.wait_for(l, std::chrono::milliseconds(kPollIntervalMs),
+                        [generation] {
+                          return generation_ != generation ||
+                                 wake_pending_.load();
+                        });
+      wake_pending_.store(false);
+      stop = generation_ != generation;
+    }
+    {
+      ReaderMutexLock l(&log_mutex);
+      Drain();
+    }
+    ReportPendingRepeats(false);
+    ReportRateLimitedMessages(false);
+    if (space_waiters_.load() > 0) {
+      { std::lock_guard<std::mutex> l(wake_mutex_); }
+      space_cv_.notify_all();
+    }
+  }
+}
+
+void AsyncLogWriter::Shutdown() {
+  std::thread* thread;
+  {
+    std::lock_guard<std::mutex> l(wake_mutex_);
+    thread = thread_;
+    thread_ = nullptr;
+    ++generation_;
+    running_.store(false, std::memory_order_release);
+  }
+  if (thread != nullptr) {
+    wake_cv_.notify_all();
+    thread->join();  // the writer drains once more on its way out
+    delete thread;
+  }
+  ReaderMutexLock l(&log_mutex);
+  Drain();
+}
+
+#ifdef HAVE_PTHREAD
+// Keeps the writer from holding our locks while the process forks.
+void AsyncLogWriter::BeforeFork() {
+  wake_mutex_.lock();
+  drain_mutex_.lock();
+}
+
+void AsyncLogWriter::AfterForkInParent() {
+  drain_mutex_.unlock();
+  wake_mutex_.unlock();
+}
+
+// Only the forking thread survives in the child.  The writer thread is
+// gone, and whatever the other threads queued is written by the parent.
+void AsyncLogWriter::AfterForkInChild() {
+  // The std::thread object can neither be joined nor destroyed here.
+  thread_ = nullptr;
+  ++generation_;
+  running_.store(false, std::memory_order_release);
+  wake_pending_.store(false);
+  if (rings_ != nullptr) {
+    for (AsyncLogRing* ring : *rings_) {
+      ring->Discard();
+      if (ring != ring_holder_.ring) {
+        ring->orphaned_.store(true);
+      }
+    }
+  }
+  drain_mutex_.unlock();
+  wake_mutex_.unlock();
+}
+#endif
+
+// Writes out whatever is still queued when the program exits without
+// calling ShutdownGoogleLogging().
+static struct AsyncLogFlusher {
+  ~AsyncLogFlusher() { AsyncLogWriter::Shutdown(); }
+} async_log_flusher;
+
+#endif  // HAVE_ASYNC_LOGGING
+
+// Hands a message to the --logasync writer.  Returns false if the caller
+// has to write it to the log files itself.
+// L >= log_mutex.
+static bool MaybeLogAsync(LogSeverity severity, time_t timestamp,
+                          const char* message, size_t len) {
+#ifdef HAVE_ASYNC_LOGGING
+  if (severity == GLOG_FATAL) {
+    // FATAL messages are written synchronously, behind everything that
+    // was queued before them.
+    AsyncLogWriter::Drain();
+    return false;
+  }
+  return AsyncLogWriter::Enqueue(severity, timestamp, message, len);
+#else
+  (void)severity;
+  (void)timestamp;
+  (void)message;
+  (void)len;
+  return false;
+#endif
+}
+
 /* static */
 const string& LogDestination::hostname() {
+  // Log files of different severities may be created concurrently.
+  static Mutex hostname_mutex;
+  MutexLock l(&hostname_mutex);
   if (hostname_.empty()) {
     GetHostName(&hostname_);
     if (hostname_.empty()) {
@@ -744,6 +1592,12 @@ void LogDestination::SetLoggerImpl(base::Logger* logger) {
 inline void LogDestination::FlushLogFilesUnsafe(int min_severity) {
   // assume we have the log_mutex or we simply don't care
   // about it
+#ifdef HAVE_ASYNC_LOGGING
+  AsyncLogWriter::TryDrain();
+#endif
+  if (binary_log_used_.load()) {
+    binary_log()->Flush();
+  }
   for (int i = min_severity; i < NUM_SEVERITIES; i++) {
     LogDestination* log = log_destinations_[i];
     if (log != nullptr) {
@@ -755,9 +1609,15 @@ inline void LogDestination::FlushLogFilesUnsafe(int min_severity) {
 }
 
 inline void LogDestination::FlushLogFiles(int min_severity) {
-  // Prevent any subtle race conditions by wrapping a mutex lock around
-  // all this stuff.
-  MutexLock l(&log_mutex);
+  // Keep the destinations from changing under us; the loggers take care
+  // of their own locking.
+  ReaderMutexLock l(&log_mutex);
+#ifdef HAVE_ASYNC_LOGGING
+  AsyncLogWriter::Drain();
+#endif
+  if (binary_log_used_.load()) {
+    binary_log()->Flush();
+  }
   for (int i = min_severity; i < NUM_SEVERITIES; i++) {
     LogDestination* log = log_destination(i);
     if (log != nullptr) {
@@ -771,8 +1631,11 @@ inline void LogDestination::SetLogDestination(LogSeverity severity,
   assert(severity >= 0 && severity < NUM_SEVERITIES);
   // Prevent any subtle race conditions by wrapping a mutex lock around
   // all this stuff.
-  MutexLock l(&log_mutex);
-  log_destination(severity)->fileobject_.SetBasename(base_filename);
+  {
+    MutexLock l(&log_mutex);
+    log_destination(severity)->fileobject_.SetBasename(base_filename);
+  }
+  UpdateConsumedSeverities();
 }
 
 inline void LogDestination::SetLogSymlink(LogSeverity severity,
@@ -784,20 +1647,96 @@ inline void LogDestination::SetLogSymlink(LogSeverity severity,
 }
 
 inline void LogDestination::AddLogSink(LogSink *destination) {
-  // Prevent any subtle race conditions by wrapping a mutex lock around
-  // all this stuff.
-  MutexLock l(&sink_mutex_);
-  if (!sinks_)  sinks_ = new vector<LogSink*>;
-  sinks_->push_back(destination);
+  {
+    MutexLock l(&sink_mutex_);
+    const vector<LogSink*>* old_sinks = sinks_.load();
+    auto* sinks = old_sinks ? new vector<LogSink*>(*old_sinks)
+                            : new vector<LogSink*>;
+    sinks->push_back(destination);
+    sinks_.store(sinks);
+    SinkReaders::Synchronize();
+    delete old_sinks;
+  }
+  UpdateConsumedSeverities();
 }
 
 inline void LogDestination::RemoveLogSink(LogSink *destination) {
-  // Prevent any subtle race conditions by wrapping a mutex lock around
-  // all this stuff.
-  MutexLock l(&sink_mutex_);
-  // This doesn't keep the sinks in order, but who cares?
-  if (sinks_) {
-    sinks_->erase(std::remove(sinks_->begin(), sinks_->end(), destination), sinks_->end());
+  {
+    MutexLock l(&sink_mutex_);
+    const vector<LogSink*>* old_sinks = sinks_.load();
+    if (old_sinks == nullptr) {
+      return;
+    }
+    auto* sinks = new vector<LogSink*>;
+    // This doesn't keep the sinks in order, but who cares?
+    std::remove_copy(old_sinks->begin(), old_sinks->end(),
+                     std::back_inserter(*sinks), destination);
+    if (sinks->empty()) {
+      delete sinks;
+      sinks = nullptr;
+    }
+    sinks_.store(sinks);
+    // Nobody sends to destination anymore once we return.
+    SinkReaders::Synchronize();
+    delete old_sinks;
+  }
+  UpdateConsumedSeverities();
+}
+
+bool LogDestination::BinaryLogTakesMessages(LogSeverity severity) {
+  // Messages for anything but the log files have to be formatted anyway.
+  return IsGoogleLoggingInitialized() && !FLAGS_logtostderr &&
+         !FLAGS_logtostdout && !FLAGS_alsologtostderr &&
+         severity < FLAGS_stderrthreshold &&
+         severity < email_logging_severity_.load(std::memory_order_relaxed) &&
+         severity < FLAGS_logemaillevel &&
+         sinks_.load(std::memory_order_relaxed) == nullptr;
+}
+
+void LogDestination::RecordBinary(const char* file, int line,
+                                  LogSeverity severity, const char* format,
+                                  const logf_internal::Arg* args,
+                                  size_t num_args) {
+  if (severity < FLAGS_minloglevel) {
+    return;
+  }
+  const int saved_errno = errno;
+  WallTime now = WallTime_Now();
+  LogMessageTime time(static_cast<time_t>(now), now);
+  if (!binary_log()->WriteFormatted(severity, file, line, GetTID(), time,
+                                    format, args, num_args)) {
+    AddStat(&LocalLoggingStats().file[severity].dropped_messages, 1);
+  }
+  AddStat(&LocalLoggingStats().severity[severity].messages, 1);
+  errno = saved_errno;
+}
+
+BinaryLogWriter* LogDestination::binary_log() {
+  static BinaryLogWriter* writer = [] {
+    // Named like the text log files, with BINARY for the severity.
+    string uidname = MyUserName();
+    if (uidname.empty()) uidname = "invalid-user";
+    const string filename =
+        string(glog_internal_namespace_::ProgramInvocationShortName()) + '.' +
+        hostname() + '.' + uidname + ".log.BINARY.";
+    vector<string> base_filenames;
+    for (const string& log_dir : GetLoggingDirectories()) {
+      base_filenames.push_back(log_dir + "/" + filename);
+    }
+    return new BinaryLogWriter(std::move(base_filenames),
+                               [](const string& base_filename) {
+                                 if (log_cleaner.enabled()) {
+                                   log_cleaner.Run(true, base_filename, "");
+                                 }
+                               });
+  }();
+  binary_log_used_.store(true, std::memory_order_relaxed);
+  return writer;
+}
+
+void LogDestination::CloseBinaryLog() {
+  if (binary_log_used_.load()) {
+    binary_log()->Close();
   }
 }
 
@@ -825,6 +1764,7 @@ inline void LogDestination::LogToStderr() {
   for ( int i = 0; i < NUM_SEVERITIES; ++i ) {
     SetLogDestination(i, "");     // "" turns off logging to a logfile
   }
+  CloseBinaryLog();
 }
 
 inline void LogDestination::SetEmailLogging(LogSeverity min_severity,
@@ -832,13 +1772,19 @@ inline void LogDestination::SetEmailLogging(LogSeverity min_severity,
   assert(min_severity >= 0 && min_severity < NUM_SEVERITIES);
   // Prevent any subtle race conditions by wrapping a mutex lock around
   // all this stuff.
-  MutexLock l(&log_mutex);
-  LogDestination::email_logging_severity_ = min_severity;
-  LogDestination::addresses_ = addresses;
+  {
+    MutexLock l(&log_mutex);
+    LogDestination::email_logging_severity_.store(min_severity,
+                                                  std::memory_order_relaxed);
+    LogDestination::addresses_ = addresses;
+  }
+  UpdateConsumedSeverities();
 }
 
 static void ColoredWriteToStderrOrStdout(FILE* output, LogSeverity severity,
                                          const char* message, size_t len) {
+  AddStat(&LocalLoggingStats().console_bytes_written,
+          static_cast<int64>(len));
   bool is_stdout = (output == stdout);
   const GLogColor color = (LogDestination::terminal_supports_color() &&
                            ((!is_stdout && FLAGS_colorlogtostderr) ||
@@ -852,6 +1798,9 @@ static void ColoredWriteToStderrOrStdout(FILE* output, LogSeverity severity,
     fwrite(message, len, 1, output);
     return;
   }
+  // A single fwrite() is atomic with respect to other threads, but the
+  // color escapes around it are not.
+  MutexLock l(&console_mutex);
 #ifdef GLOG_OS_WINDOWS
   const HANDLE output_handle =
       GetStdHandle(is_stdout ? STD_OUTPUT_HANDLE : STD_ERROR_HANDLE);
@@ -982,20 +1931,30 @@ inline void LogDestination::LogToSinks(LogSeverity severity,
                                        const LogMessageTime& logmsgtime,
                                        const char* message,
                                        size_t message_len) {
-  ReaderMutexLock l(&sink_mutex_);
-  if (sinks_) {
-    for (size_t i = sinks_->size(); i-- > 0; ) {
-      (*sinks_)[i]->send(severity, full_filename, base_filename,
-                         line, logmsgtime, message, message_len);
+  if (sinks_.load(std::memory_order_relaxed) == nullptr) {
+    return;
+  }
+  SinkReaders::Section section;
+  const vector<LogSink*>* sinks = sinks_.load();
+  if (sinks != nullptr) {
+    const int64 start = NowNanos();
+    for (size_t i = sinks->size(); i-- > 0; ) {
+      (*sinks)[i]->send(severity, full_filename, base_filename,
+                        line, logmsgtime, message, message_len);
     }
+    LoggingStatsShard& stats = LocalLoggingStats();
+    AddStat(&stats.sink_sends, static_cast<int64>(sinks->size()));
+    AddStat(&stats.sink_send_ns, NowNanos() - start);
   }
 }
 
 inline void LogDestination::WaitForSinks(LogMessage::LogMessageData* data) {
-  ReaderMutexLock l(&sink_mutex_);
-  if (sinks_) {
-    for (size_t i = sinks_->size(); i-- > 0; ) {
-      (*sinks_)[i]->WaitTillSent();
+  if (sinks_.load(std::memory_order_relaxed) != nullptr) {
+    SinkReaders::Section section;
+    if (const vector<LogSink*>* sinks = sinks_.load()) {
+      for (size_t i = sinks->size(); i-- > 0; ) {
+        (*sinks)[i]->WaitTillSent();
+      }
     }
   }
   const bool send_to_sink =
@@ -1006,24 +1965,78 @@ inline void LogDestination::WaitForSinks(LogMessage::LogMessageData* data) {
   }
 }
 
-LogDestination* LogDestination::log_destinations_[NUM_SEVERITIES];
+std::atomic<LogDestination*> LogDestination::log_destinations_[NUM_SEVERITIES];
+Mutex LogDestination::destinations_mutex_;
 
 inline LogDestination* LogDestination::log_destination(LogSeverity severity) {
   assert(severity >=0 && severity < NUM_SEVERITIES);
-  if (!log_destinations_[severity]) {
-    log_destinations_[severity] = new LogDestination(severity, nullptr);
+  LogDestination* destination =
+      log_destinations_[severity].load(std::memory_order_acquire);
+  if (destination == nullptr) {
+    MutexLock l(&destinations_mutex_);
+    destination = log_destinations_[severity].load(std::memory_order_relaxed);
+    if (destination == nullptr) {
+      destination = new LogDestination(severity, nullptr);
+      log_destinations_[severity].store(destination,
+                                        std::memory_order_release);
+    }
   }
-  return log_destinations_[severity];
+  return destination;
 }
 
 void LogDestination::DeleteLogDestinations() {
-  for (auto& log_destination : log_destinations_) {
-    delete log_destination;
-    log_destination = nullptr;
+  {
+    MutexLock l(&log_mutex);
+    for (auto& log_destination : log_destinations_) {
+      delete log_destination.exchange(nullptr);
+    }
+  }
+  {
+    MutexLock l(&sink_mutex_);
+    const vector<LogSink*>* sinks = sinks_.exchange(nullptr);
+    SinkReaders::Synchronize();
+    delete sinks;
   }
-  MutexLock l(&sink_mutex_);
-  delete sinks_;
-  sinks_ = nullptr;
+  UpdateConsumedSeverities();
+}
+
+bool LogDestination::WantsSeverity(LogSeverity severity) {
+  if (severity < FLAGS_minloglevel) {
+    return false;
+  }
+  if (consumed_severities_.load(std::memory_order_relaxed) &
+      (1U << severity)) {
+    return true;
+  }
+  // Only reached when the files, sinks and email are all turned off for
+  // this severity, e.g. after LogToStderr().
+  return !IsGoogleLoggingInitialized() || FLAGS_logtostderr ||
+         FLAGS_logtostdout || FLAGS_alsologtostderr || FLAGS_logbinary ||
+         severity >= FLAGS_stderrthreshold ||
+         severity >= FLAGS_logemaillevel;
+}
+
+void LogDestination::UpdateConsumedSeverities() {
+  MutexLock l(&consumed_severities_mutex_);
+  // Keep the destinations from being deleted under us.
+  ReaderMutexLock destinations_lock(&log_mutex);
+  uint32 consumed = 0;
+  bool files = false;
+  for (int i = 0; i < NUM_SEVERITIES; ++i) {
+    // Messages are written to the files of their own and all lower
+    // severities.  A destination that is not created yet logs to the
+    // default file.
+    LogDestination* destination =
+        log_destinations_[i].load(std::memory_order_acquire);
+    files = files || destination == nullptr ||
+            destination->logger_ != &destination->fileobject_ ||
+            destination->fileobject_.enabled();
+    if (files || i >= email_logging_severity_ ||
+        sinks_.load(std::memory_order_relaxed) != nullptr) {
+      consumed |= 1U << i;
+    }
+  }
+  consumed_severities_.store(consumed, std::memory_order_relaxed);
 }
 
 namespace {
@@ -1045,6 +2058,26 @@ const char possible_dir_delim[] = {'\\', '/'};
 const char possible_dir_delim[] = {'/'};
 #endif
 
+// Writes the data of fd back to the disk, if the platform can.
+static void SyncFile(int fd) {
+#if defined(GLOG_OS_WINDOWS)
+  _commit(fd);
+#elif defined(GLOG_OS_LINUX)
+  fdatasync(fd);
+#else
+  fsync(fd);
+#endif
+}
+
+// Removes an old log file, which --log_compress may have compressed since
+// it was listed.
+void RemoveLogFile(const string& name) {
+  unlink(name.c_str());
+  if (!LogCompressor::IsCompressedName(name)) {
+    unlink((name + LogCompressor::kSuffix).c_str());
+  }
+}
+
 string PrettyDuration(int secs) {
   std::stringstream result;
   int mins = secs / 60;
@@ -1074,10 +2107,7 @@ LogFileObject::LogFileObject(LogSeverity severity, const char* base_filename)
 
 LogFileObject::~LogFileObject() {
   MutexLock l(&lock_);
-  if (file_ != nullptr) {
-    fclose(file_);
-    file_ = nullptr;
-  }
+  CloseLogfile();
 }
 
 void LogFileObject::SetBasename(const char* basename) {
@@ -1086,11 +2116,11 @@ void LogFileObject::SetBasename(const char* basename) {
   if (base_filename_ != basename) {
     // Get rid of old log file since we are changing names
     if (file_ != nullptr) {
-      fclose(file_);
-      file_ = nullptr;
+      CloseLogfile();
       rollover_attempt_ = kRolloverAttemptFrequency-1;
     }
     base_filename_ = basename;
+    leftovers_queued_ = false;
   }
 }
 
@@ -1099,8 +2129,7 @@ void LogFileObject::SetExtension(const char* ext) {
   if (filename_extension_ != ext) {
     // Get rid of old log file since we are changing names
     if (file_ != nullptr) {
-      fclose(file_);
-      file_ = nullptr;
+      CloseLogfile();
       rollover_attempt_ = kRolloverAttemptFrequency-1;
     }
     filename_extension_ = ext;
@@ -1118,9 +2147,24 @@ void LogFileObject::Flush() {
 }
 
 void LogFileObject::FlushUnlocked(){
-  if (file_ != nullptr) {
+  const int64 start = NowNanos();
+  bool flushed = true;
+  if (mmap_ != nullptr && !mmap_->forked()) {
+    mmap_->Flush();
+    bytes_since_flush_ = 0;
+  } else if (uring_ != nullptr && !uring_->forked()) {
+    uring_->Flush(false);
+    bytes_since_flush_ = 0;
+  } else if (file_ != nullptr) {
     fflush(file_);
     bytes_since_flush_ = 0;
+  } else {
+    flushed = false;
+  }
+  if (flushed) {
+    LoggingStatsShard::File& stats = LocalLoggingStats().file[severity_];
+    AddStat(&stats.flushes, 1);
+    AddStat(&stats.flush_ns, NowNanos() - start);
   }
   // Figure out when we are due for another flush.
   const int64 next = (FLAGS_logbufsecs
@@ -1143,6 +2187,10 @@ std::wstring toNativeFilename(const std::string& str) {
 #endif
 
 bool LogFileObject::CreateLogfileInternal(const fs::path &filename, int flags) {
+  if (FLAGS_log_mmap) {
+    // A shared mapping needs read access.
+    flags = (flags & ~O_WRONLY) | O_RDWR;
+  }
   int fd = open(reinterpret_cast<const char *>(filename.u8string().c_str()), flags, static_cast<mode_t>(FLAGS_logfile_mode));
   if (fd == -1) return false;
 #ifdef HAVE_FCNTL
@@ -1192,9 +2240,61 @@ bool LogFileObject::CreateLogfileInternal(const fs::path &filename, int flags) {
     }
   }
 #endif
+  const int sync_fd = dup(fd);
+  if (sync_fd != -1) {
+    sync_fd_.reset(new int(sync_fd), [](int* sync_fd) {
+      close(*sync_fd);
+      delete sync_fd;
+    });
+  }
+  filename_ = filename.string();
+  file_fork_generation_ = ForkGeneration();
+  // Stays on stdio if neither is available.
+  if (FLAGS_log_mmap) {
+    mmap_ = MmapFileWriter::Create(fd,
+                                   static_cast<size_t>(MaxLogSize()) << 20U);
+  }
+  if (mmap_ == nullptr && FLAGS_log_io_uring) {
+    uring_ = UringFileWriter::Create(fd);
+  }
   return true;
 }
 
+void LogFileObject::CloseLogfile() {
+  // Truncates the preallocated space, and waits for the writes in flight,
+  // which must not outlive the file.
+  mmap_.reset();
+  uring_.reset();
+  sync_fd_.reset();
+  if (file_ != nullptr) {
+    fclose(file_);
+    file_ = nullptr;
+  }
+}
+
+int LogFileObject::WriteToLogfile(const char* data, size_t size) {
+  if (mmap_ != nullptr) {
+    return mmap_->Write(data, size);
+  }
+  if (uring_ != nullptr && uring_->forked()) {
+    // The ring belongs to the parent; the child goes on with stdio.
+    uring_.reset();
+  }
+  if (uring_ != nullptr) {
+    uring_->Write(data, size);
+    // Errors of the writes that have completed meanwhile.
+    return uring_->TakeError();
+  }
+  // fwrite() doesn't return an error when the disk is full, for
+  // messages that are less than 4096 bytes. When the disk is full,
+  // it returns the message length for messages that are less than
+  // 4096 bytes. fwrite() returns 4096 for message lengths that are
+  // greater than 4096, thereby indicating an error.
+  errno = 0;
+  fwrite(data, 1, size, file_);
+  return errno;
+}
+
 bool LogFileObject::CreateLogfile(const string& time_pid_string) {
   string string_filename = base_filename_;
   if (FLAGS_timestamp_in_logfile_name) {
@@ -1272,6 +2372,7 @@ void LogFileObject::CheckHistoryFileNum() {
   }
 
   file_list_.clear();
+  temporary_files_.clear();
   while ((entry = readdir(dp)) != nullptr) {
     if (DT_DIR == entry->d_type || DT_LNK == entry->d_type) {
       continue;
@@ -1281,6 +2382,10 @@ void LogFileObject::CheckHistoryFileNum() {
     if (filename.find(symlink_basename_ + '.' + LogSeverityNames[severity_]) ==
         0) {
       std::string filepath = log_dirs[0] + "/" + filename;
+      if (LogCompressor::IsTemporaryName(filename)) {
+        temporary_files_.push_back(filepath);
+        continue;
+      }
 
       struct stat fstat;
       if (::stat(filepath.c_str(), &fstat) < 0) {
@@ -1299,14 +2404,54 @@ void LogFileObject::CheckHistoryFileNum() {
 
   while (FLAGS_max_logfile_num > 0 &&
          file_list_.size() >= FLAGS_max_logfile_num) {
-    unlink(file_list_.begin()->name.c_str());
+    RemoveLogFile(file_list_.begin()->name);
     file_list_.erase(file_list_.begin());
   }
 }
 
+void LogFileObject::QueueLeftoverLogs() {
+  leftovers_queued_ = true;
+  for (const string& temporary : temporary_files_) {
+    LogCompressor::RemoveStaleTemporary(temporary);
+  }
+  struct stat current;
+  if (fstat(fileno(file_), &current) != 0) return;
+  for (const Filetime& file : file_list_) {
+    if (LogCompressor::IsCompressedName(file.name)) continue;
+    struct stat leftover;
+    if (::stat(file.name.c_str(), &leftover) != 0 ||
+        (leftover.st_dev == current.st_dev &&
+         leftover.st_ino == current.st_ino)) {
+      continue;
+    }
+#ifdef HAVE_FCNTL
+    // Still written by another process, which holds the lock that
+    // CreateLogfileInternal() takes.  Closing fd releases no lock of ours:
+    // we hold none on this file.
+    const int fd = open(file.name.c_str(), O_RDONLY);
+    if (fd == -1) continue;
+    struct flock lock = {};
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    const bool locked = fcntl(fd, F_GETLK, &lock) == 0 &&
+                        lock.l_type != F_UNLCK;
+    close(fd);
+    if (locked) continue;
+#endif
+    LogCompressor::Enqueue(file.name);
+  }
+}
+
 bool LogFileObject::CheckNeedRollLogFiles(time_t timestamp) {
   bool roll_needed = false;
   struct ::tm tm_time;
+  const bool time_based = FLAGS_log_rolling_policy == "day" ||
+                          FLAGS_log_rolling_policy == "hour";
+  if (time_based && timestamp >= no_roll_from_ && timestamp < no_roll_until_) {
+    // Neither the day nor the hour can change within the minute we
+    // already checked.
+    return false;
+  }
   if (FLAGS_log_rolling_policy == "day") {
     localtime_r(&timestamp, &tm_time);
     if (tm_time.tm_year != tm_time_.tm_year ||
@@ -1326,6 +2471,12 @@ bool LogFileObject::CheckNeedRollLogFiles(time_t timestamp) {
     roll_needed = true;
   }
 
+  if (time_based && !roll_needed) {
+    no_roll_from_ = timestamp - tm_time.tm_sec;
+    no_roll_until_ = no_roll_from_ + 60;
+  } else {
+    no_roll_from_ = no_roll_until_ = 0;
+  }
   return roll_needed;
 }
 
@@ -1333,23 +2484,49 @@ void LogFileObject::Write(bool force_flush,
                           time_t timestamp,
                           const char* message,
                           size_t message_len) {
-  MutexLock l(&lock_);
+  uint64 commit_seq;
+  {
+    TimedMutexLock l(&lock_, &LocalLoggingStats().file[severity_].lock_wait_ns);
+    commit_seq = WriteUnlocked(force_flush, timestamp, message, message_len);
+  }
+  if (commit_seq != 0) {
+    GroupCommit(commit_seq);
+  }
+}
 
+uint64 LogFileObject::WriteUnlocked(bool force_flush, time_t timestamp,
+                                    const char* message, size_t message_len) {
   // We don't log if the base_name_ is "" (which means "don't write")
   if (base_filename_selected_ && base_filename_.empty()) {
-    return;
+    return 0;
   }
   bool roll_needed = CheckNeedRollLogFiles(timestamp);
+  if (mmap_ != nullptr && mmap_->forked()) {
+    // The parent writes to the rest of the mapped file; start our own,
+    // named after our pid.
+    PidHasChanged();
+    roll_needed = true;
+  }
+  // Set while rolling over, to time it.
+  int64 rollover_start = 0;
   if (roll_needed) {
-    if (file_ != nullptr) fclose(file_);
-    file_ = nullptr;
+    rollover_start = NowNanos();
+    CloseLogfile();
+    // Not a file that the parent process still writes to.
+    if (FLAGS_log_compress && !filename_.empty() &&
+        file_fork_generation_ == ForkGeneration()) {
+      LogCompressor::Enqueue(filename_);
+    }
+    filename_.clear();
     file_length_ = bytes_since_flush_ = dropped_mem_length_ = 0;
     rollover_attempt_ = kRolloverAttemptFrequency - 1;
   }
   if ((file_ == nullptr) && (!initialized_) &&
       (FLAGS_log_rolling_policy == "size")) {
     CheckHistoryFileNum();
-    if (!file_list_.empty()) {
+    // Goes on with the newest log file, unless that is compressed.
+    if (!file_list_.empty() &&
+        !LogCompressor::IsCompressedName(file_list_.rbegin()->name)) {
       std::multiset<Filetime>::iterator it = file_list_.end();
       it--;
       const char* filename = it->name.c_str();
@@ -1357,6 +2534,9 @@ void LogFileObject::Write(bool force_flush,
       bool success = CreateLogfileInternal(filename, flags);
       if (success) {
         initialized_ = true;
+        if (FLAGS_log_compress) {
+          QueueLeftoverLogs();
+        }
       }
     }
   }
@@ -1366,16 +2546,16 @@ void LogFileObject::Write(bool force_flush,
     // Try to rollover the log file every 32 log messages.  The only time
     // this could matter would be when we have trouble creating the log
     // file.  If that happens, we'll lose lots of log messages, of course!
-    if (++rollover_attempt_ != kRolloverAttemptFrequency) return;
+    if (++rollover_attempt_ != kRolloverAttemptFrequency) return 0;
     rollover_attempt_ = 0;
 
-    if (!initialized_) {
+    if (!initialized_ || (FLAGS_log_compress && !leftovers_queued_)) {
       CheckHistoryFileNum();
       initialized_ = true;
     } else {
       while (FLAGS_max_logfile_num > 0 &&
              file_list_.size() >= FLAGS_max_logfile_num) {
-        unlink(file_list_.begin()->name.c_str());
+        RemoveLogFile(file_list_.begin()->name);
         file_list_.erase(file_list_.begin());
       }
     }
@@ -1410,7 +2590,7 @@ void LogFileObject::Write(bool force_flush,
         perror("Could not create log file");
         fprintf(stderr, "COULD NOT CREATE LOGFILE '%s'!\n",
                 time_pid_string.c_str());
-        return;
+        return 0;
       }
     } else {
       // If no base filename for logs of this severity has been set, use a
@@ -1457,9 +2637,12 @@ void LogFileObject::Write(bool force_flush,
         perror("Could not create logging file");
         fprintf(stderr, "COULD NOT CREATE A LOGGINGFILE %s!",
                 time_pid_string.c_str());
-        return;
+        return 0;
       }
     }
+    if (FLAGS_log_compress && !leftovers_queued_) {
+      QueueLeftoverLogs();
+    }
 
     // Write a header message into the log file
     if (FLAGS_log_file_header) {
@@ -1494,49 +2677,58 @@ void LogFileObject::Write(bool force_flush,
       const string& file_header_string = file_header_stream.str();
 
       const size_t header_len = file_header_string.size();
-      fwrite(file_header_string.data(), 1, header_len, file_);
+      WriteToLogfile(file_header_string.data(), header_len);
       file_length_ += header_len;
       bytes_since_flush_ += header_len;
+      AddStat(&LocalLoggingStats().file[severity_].bytes_written,
+              static_cast<int64>(header_len));
     }
   }
+  LoggingStatsShard::File& stats = LocalLoggingStats().file[severity_];
+  if (rollover_start != 0) {
+    AddStat(&stats.rollovers, 1);
+    AddStat(&stats.rollover_ns, NowNanos() - rollover_start);
+  }
 
   // Write to LOG file
   if ( !stop_writing ) {
-    // fwrite() doesn't return an error when the disk is full, for
-    // messages that are less than 4096 bytes. When the disk is full,
-    // it returns the message length for messages that are less than
-    // 4096 bytes. fwrite() returns 4096 for message lengths that are
-    // greater than 4096, thereby indicating an error.
-    errno = 0;
-    fwrite(message, 1, message_len, file_);
+    const int error = WriteToLogfile(message, message_len);
     if ( FLAGS_stop_logging_if_full_disk &&
-         errno == ENOSPC ) {  // disk full, stop writing to disk
+         error == ENOSPC ) {  // disk full, stop writing to disk
       stop_writing = true;  // until the disk is
-      return;
+      AddStat(&stats.dropped_messages, 1);
+      return 0;
     } else {
       file_length_ += message_len;
       bytes_since_flush_ += message_len;
+      ++write_seq_;
+      AddStat(&stats.bytes_written, static_cast<int64>(message_len));
     }
   } else {
+    AddStat(&stats.dropped_messages, 1);
     if (CycleClock_Now() >= next_flush_time_) {
       stop_writing = false;  // check to see if disk has free space.
     }
-    return;  // no need to flush
+    return 0;  // no need to flush
   }
 
-  // See important msgs *now*.  Also, flush logs at least every 10^6 chars,
-  // or every "FLAGS_logbufsecs" seconds.
-  if ( force_flush ||
-       (bytes_since_flush_ >= 1000000) ||
+  // Flush logs at least every 10^6 chars, or every "FLAGS_logbufsecs"
+  // seconds.
+  bool datasync = false;
+  if ( (bytes_since_flush_ >= 1000000) ||
        (CycleClock_Now() >= next_flush_time_) ) {
     FlushUnlocked();
+    datasync = FLAGS_log_durability == "periodic";
 #ifdef GLOG_OS_LINUX
+    // Pages still being written by io_uring stay.
+    const size_t written_length =
+        uring_ != nullptr ? uring_->completed_bytes() : file_length_;
     // Only consider files >= 3MiB
-    if (FLAGS_drop_log_memory && file_length_ >= (3U << 20U)) {
+    if (FLAGS_drop_log_memory && written_length >= (3U << 20U)) {
       // Don't evict the most recent 1-2MiB so as not to impact a tailer
       // of the log file and to avoid page rounding issue on linux < 4.7
       uint32 total_drop_length =
-          (file_length_ & ~((1U << 20U) - 1U)) - (1U << 20U);
+          (written_length & ~((1U << 20U) - 1U)) - (1U << 20U);
       uint32 this_drop_length = total_drop_length - dropped_mem_length_;
       if (this_drop_length >= (2U << 20U)) {
         // Only advise when >= 2MiB to drop
@@ -1548,6 +2740,9 @@ void LogFileObject::Write(bool force_flush,
                       static_cast<off_t>(this_drop_length),
                       POSIX_FADV_DONTNEED);
 # endif
+        if (mmap_ != nullptr) {
+          mmap_->DropPages(dropped_mem_length_, this_drop_length);
+        }
         dropped_mem_length_ = total_drop_length;
       }
     }
@@ -1560,6 +2755,58 @@ void LogFileObject::Write(bool force_flush,
                       filename_extension_);
     }
   }
+
+  // See important msgs *now*: GroupCommit() flushes them, together with
+  // those of the other threads that log at the same time.
+  if (force_flush) {
+    datasync = datasync || (FLAGS_log_durability == "error" &&
+                            severity_ >= GLOG_ERROR);
+  } else if (!datasync) {
+    return 0;
+  }
+  datasync_wanted_ = datasync_wanted_ || datasync;
+  return write_seq_;
+}
+
+void LogFileObject::GroupCommit(uint64 seq) {
+  // While one thread flushes and syncs, the others keep writing and then
+  // line up here.  The first of them commits everything written in the
+  // meantime in one go, and the rest find that they are done.
+  MutexLock c(&commit_lock_);
+  if (committed_seq_ >= seq) {
+    return;
+  }
+  uint64 target;
+  std::shared_ptr<int> sync_fd;
+  {
+    MutexLock l(&lock_);
+    target = write_seq_;
+    FlushUnlocked();
+    if (datasync_wanted_) {
+      datasync_wanted_ = false;
+      if (uring_ != nullptr && !uring_->forked() &&
+          FLAGS_log_durability != "error") {
+        // Linked behind the writes; does not wait.
+        uring_->Flush(true);
+      } else {
+        // The message must be on disk before LOG(ERROR) returns: wait
+        // for the writes, then sync like without io_uring.
+        if (uring_ != nullptr && !uring_->forked()) {
+          uring_->Wait();
+        }
+        sync_fd = sync_fd_;
+      }
+    }
+  }
+  // Outside lock_, so that other threads can log meanwhile; sync_fd_
+  // keeps the file open even if it is rolled over.
+  if (sync_fd != nullptr) {
+    const int64 start = NowNanos();
+    SyncFile(*sync_fd);
+    AddStat(&LocalLoggingStats().file[severity_].flush_ns,
+            NowNanos() - start);
+  }
+  committed_seq_ = target;
 }
 
 LogCleaner::LogCleaner() = default;
@@ -1586,10 +2833,13 @@ void LogCleaner::Run(bool base_filename_selected,
   assert(!base_filename_selected || !base_filename.empty());
 
   // avoid scanning logs too frequently
-  if (CycleClock_Now() < next_cleanup_time_) {
-    return;
+  {
+    MutexLock l(&lock_);
+    if (CycleClock_Now() < next_cleanup_time_) {
+      return;
+    }
+    UpdateCleanUpTime();
   }
-  UpdateCleanUpTime();
 
   vector<string> dirs;
 
@@ -1652,9 +2902,15 @@ vector<string> LogCleaner::GetOverdueLogNames(
   return overdue_log_names;
 }
 
-bool LogCleaner::IsLogFromCurrentProject(const string& filepath,
+bool LogCleaner::IsLogFromCurrentProject(const string& path,
                                          const string& base_filename,
                                          const string& filename_extension) const {
+  // Logs compressed by --log_compress are cleaned up, too.
+  const string filepath =
+      LogCompressor::IsCompressedName(path)
+          ? path.substr(0, path.size() - strlen(LogCompressor::kSuffix))
+          : path;
+
   // We should remove duplicated delimiters from `base_filename`, e.g.,
   // before: "/tmp//<base_filename>.<create_time>.<pid>"
   // after:  "/tmp/<base_filename>.<create_time>.<pid>"
@@ -1709,77 +2965,397 @@ bool LogCleaner::IsLogFromCurrentProject(const string& filepath,
   for (size_t i = cleaned_base_filename.size(); i < real_filepath_size; i++) {
     const char& c = filepath[i];
 
-    if (i <= cleaned_base_filename.size() + 7) { // 0 ~ 7 : YYYYMMDD
-      if (c < '0' || c > '9') { return false; }
+    if (i <= cleaned_base_filename.size() + 7) { // 0 ~ 7 : YYYYMMDD
+      if (c < '0' || c > '9') { return false; }
+
+    } else if (i == cleaned_base_filename.size() + 8) { // 8: -
+      if (c != '-') { return false; }
+
+    } else if (i <= cleaned_base_filename.size() + 14) { // 9 ~ 14: HHMMSS
+      if (c < '0' || c > '9') { return false; }
+
+    } else if (i == cleaned_base_filename.size() + 15) { // 15: .
+      if (c != '.') { return false; }
+
+    } else if (i >= cleaned_base_filename.size() + 16) { // 16+: pid
+      if (c < '0' || c > '9') { return false; }
+    }
+  }
+
+  return true;
+}
+
+bool LogCleaner::IsLogLastModifiedOver(const string& filepath,
+                                       unsigned int days) const {
+  // Try to get the last modified time of this file.
+  struct stat file_stat;
+
+  if (stat(filepath.c_str(), &file_stat) == 0) {
+    const time_t seconds_in_a_day = 60 * 60 * 24;
+    time_t last_modified_time = file_stat.st_mtime;
+    time_t current_time = time(nullptr);
+    return difftime(current_time, last_modified_time) > days * seconds_in_a_day;
+  }
+
+  // If failed to get file stat, don't return true!
+  return false;
+}
+
+}  // namespace
+
+// Static log data space to avoid alloc failures in a LOG(FATAL)
+//
+// Since multiple threads may call LOG(FATAL), and we want to preserve
+// the data from the first call, we allocate two sets of space.  One
+// for exclusive use by the first thread, and one for shared use by
+// all other threads.
+static Mutex fatal_msg_lock;
+static CrashReason crash_reason;
+static bool fatal_msg_exclusive = true;
+static LogMessage::LogMessageData fatal_msg_data_exclusive;
+static LogMessage::LogMessageData fatal_msg_data_shared;
+
+#ifdef GLOG_THREAD_LOCAL_STORAGE
+// Static thread-local log data space to use, because typically at most one
+// LogMessageData object exists (in this case glog makes zero heap memory
+// allocations).
+static thread_local bool thread_data_available = true;
+
+#if defined(__cpp_lib_byte) && __cpp_lib_byte >= 201603L
+// std::aligned_storage is deprecated in C++23
+alignas(LogMessage::LogMessageData) static thread_local std::byte
+    thread_msg_data[sizeof(LogMessage::LogMessageData)];
+#else   // !(defined(__cpp_lib_byte) && __cpp_lib_byte >= 201603L)
+static thread_local std::aligned_storage<
+    sizeof(LogMessage::LogMessageData),
+    alignof(LogMessage::LogMessageData)>::type thread_msg_data;
+#endif  // defined(__cpp_lib_byte) && __cpp_lib_byte >= 201603L
+#endif  // defined(GLOG_THREAD_LOCAL_STORAGE)
+
+// Formatting of the default log line prefix.  This used to be a chain of
+// stream() << setw(2) << ... calls, which made the prefix cost more than
+// many messages themselves.  The output is exactly the same.
+namespace {
+
+// "00", "01", ..., "99": lets us write two digits at a time.
+const char kTwoDigits[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+inline char* AppendTwoDigits(char* p, unsigned v) {
+  memcpy(p, kTwoDigits + 2 * v, 2);
+  return p + 2;
+}
+
+// Writes v in decimal, right-aligned in a field of at least width
+// characters padded with pad, like "<< setfill(pad) << setw(width) << v".
+char* AppendDecimal(char* p, uint64 v, size_t width, char pad) {
+  char digits[20];
+  char* const end = digits + sizeof(digits);
+  char* q = end;
+  while (v >= 100) {
+    q -= 2;
+    memcpy(q, kTwoDigits + 2 * (v % 100), 2);
+    v /= 100;
+  }
+  if (v >= 10) {
+    q -= 2;
+    memcpy(q, kTwoDigits + 2 * v, 2);
+  } else {
+    *--q = static_cast<char>('0' + v);
+  }
+  const auto len = static_cast<size_t>(end - q);
+  for (size_t i = len; i < width; ++i) {
+    *p++ = pad;
+  }
+  memcpy(p, q, len);
+  return p + len;
+}
+
+// Writes "[yyyy]mmdd hh:mm:ss" for the given time.
+char* AppendPrefixDateTime(char* p, const LogMessageTime& time,
+                           bool with_year) {
+  if (with_year) {
+    p = AppendDecimal(p, static_cast<uint64>(1900 + time.year()), 4, '0');
+  }
+  p = AppendTwoDigits(p, static_cast<unsigned>(1 + time.month()));
+  p = AppendTwoDigits(p, static_cast<unsigned>(time.day()));
+  *p++ = ' ';
+  p = AppendTwoDigits(p, static_cast<unsigned>(time.hour()));
+  *p++ = ':';
+  p = AppendTwoDigits(p, static_cast<unsigned>(time.minute()));
+  *p++ = ':';
+  p = AppendTwoDigits(p, static_cast<unsigned>(time.sec()));
+  return p;
+}
+
+#ifdef GLOG_THREAD_LOCAL_STORAGE
+// The date and time part of the prefix only changes once a second, so
+// each thread keeps the text of the last second it logged in.
+struct PrefixDateTimeCache {
+  time_t timestamp{-1};
+  bool with_year{false};
+  bool utc{false};
+  size_t len{0};
+  char text[24];
+};
+thread_local PrefixDateTimeCache prefix_date_time_cache;
+#endif
+
+}  // namespace
+
+namespace glog_internal_namespace_ {
+
+// Appends the default prefix
+//   "Lyyyymmdd hh:mm:ss.uuuuuu ttttt file:line] "
+// for a message to buf.
+// Used by logging_unittest.cc so can't make it static here.
+GOOGLE_GLOG_DLL_DECL void AppendDefaultPrefix(std::streambuf* buf,
+                                              LogSeverity severity,
+                                              const LogMessageTime& time,
+                                              unsigned int tid,
+                                              const char* basename, int line) {
+  char head[64];
+  char* p = head;
+  *p++ = LogSeverityNames[severity][0];
+#ifdef GLOG_THREAD_LOCAL_STORAGE
+  PrefixDateTimeCache& cache = prefix_date_time_cache;
+  if (cache.timestamp != time.timestamp() ||
+      cache.with_year != FLAGS_log_year_in_prefix ||
+      cache.utc != FLAGS_log_utc_time) {
+    cache.len = static_cast<size_t>(
+        AppendPrefixDateTime(cache.text, time, FLAGS_log_year_in_prefix) -
+        cache.text);
+    cache.timestamp = time.timestamp();
+    cache.with_year = FLAGS_log_year_in_prefix;
+    cache.utc = FLAGS_log_utc_time;
+  }
+  memcpy(p, cache.text, cache.len);
+  p += cache.len;
+#else
+  p = AppendPrefixDateTime(p, time, FLAGS_log_year_in_prefix);
+#endif
+  *p++ = '.';
+  p = AppendDecimal(p, static_cast<uint64>(time.usec()), 6, '0');
+  *p++ = ' ';
+  p = AppendDecimal(p, tid, 5, ' ');
+  *p++ = ' ';
+  buf->sputn(head, p - head);
+
+  buf->sputn(basename, static_cast<std::streamsize>(strlen(basename)));
+
+  p = head;
+  *p++ = ':';
+  if (line < 0) {
+    *p++ = '-';
+    p = AppendDecimal(p, static_cast<uint64>(-static_cast<int64>(line)), 0,
+                      ' ');
+  } else {
+    p = AppendDecimal(p, static_cast<uint64>(line), 0, ' ');
+  }
+  *p++ = ']';
+  *p++ = ' ';
+  buf->sputn(head, p - head);
+}
+
+}  // namespace glog_internal_namespace_
+
+LogMessage::LogMessageData::LogMessageData()
+  : message_text_(inline_text_),
+    stream_(inline_text_, static_cast<int>(kInlineMessageLen), 0) {
+  static_cast<base_logging::LogStreamBuf*>(stream_.rdbuf())
+      ->set_grow_function(&MessageBufferPool::Grow);
+}
+
+LogMessage::LogMessageData::~LogMessageData() {
+  MessageBufferPool::Release(
+      static_cast<base_logging::LogStreamBuf*>(stream_.rdbuf()));
+}
+
+// The LogSites that have registered, most recent first.  Sites are pushed
+// without a lock and never removed.
+class LogSiteList {
+ public:
+  static void Push(LogSite* site) {
+    LogSite* head = head_.load(std::memory_order_relaxed);
+    do {
+      site->next_ = head;
+    } while (!head_.compare_exchange_weak(head, site,
+                                          std::memory_order_release,
+                                          std::memory_order_relaxed));
+  }
+
+  static LogSite* Head() { return head_.load(std::memory_order_acquire); }
+  static LogSite* Next(const LogSite* site) { return site->next_; }
+
+ private:
+  static std::atomic<LogSite*> head_;
+};
+
+std::atomic<LogSite*> LogSiteList::head_{nullptr};
+
+void LogSite::Hit() {
+  // Only one thread gets to count the first hit.
+  if (hits_.fetch_add(1, std::memory_order_relaxed) == 0) {
+    LogSiteList::Push(this);
+  }
+}
+
+uint64 ShardedLogCounter::Tick(int n) {
+  const uint64 period = static_cast<uint64>(std::max(n, 1));
+  Shard& shard = shards_[static_cast<uint32>(GetTID()) % kShards];
+  const uint64 quantum = std::max<uint64>(period / kShards, 1);
+  // The very first hit is logged right away, like with LOG_EVERY_N.
+  if (shard.pending.fetch_add(1, std::memory_order_relaxed) + 1 < quantum &&
+      total_.load(std::memory_order_relaxed) != 0) {
+    return 0;
+  }
+  const uint64 pending = shard.pending.exchange(0, std::memory_order_relaxed);
+  if (pending == 0) {
+    return 0;  // Another thread of this shard has added them.
+  }
+  const uint64 before = total_.fetch_add(pending, std::memory_order_relaxed);
+  const uint64 after = before + pending;
+  // Hits 1, period + 1, 2 * period + 1, ... log.
+  if (before == 0 || (after - 1) / period != (before - 1) / period) {
+    return after;
+  }
+  return 0;
+}
+
+bool LogRateLimiter::Allow(double per_second, int burst) {
+  if (per_second <= 0) {
+    return true;
+  }
+  // At least one message every eleven days or so, to stay far from
+  // overflowing.
+  const int64 interval =
+      static_cast<int64>(std::max(std::min(1e9 / per_second, 1e15), 1.0));
+  const double tolerance = static_cast<double>(interval) * std::max(burst, 1);
+  const int64 now = NowNanos();
+  int64 full_at = full_at_.load(std::memory_order_relaxed);
+  for (;;) {
+    const int64 start = std::max(full_at, now);
+    if (static_cast<double>(start + interval - now) > tolerance) {
+      suppressed_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    if (full_at_.compare_exchange_weak(full_at, start + interval,
+                                       std::memory_order_relaxed)) {
+      return true;
+    }
+  }
+}
+
+namespace {
 
-    } else if (i == cleaned_base_filename.size() + 8) { // 8: -
-      if (c != '-') { return false; }
+// The LOG_RATE_LIMITED() statements that suppressed messages, most recent
+// first.  Never shrinks: the limiters are static.
+std::atomic<LogRateLimiter*> rate_limited_sites{nullptr};
 
-    } else if (i <= cleaned_base_filename.size() + 14) { // 9 ~ 14: HHMMSS
-      if (c < '0' || c > '9') { return false; }
+}  // namespace
 
-    } else if (i == cleaned_base_filename.size() + 15) { // 15: .
-      if (c != '.') { return false; }
+bool LogRateLimiter::Idle() const {
+  return full_at_.load(std::memory_order_relaxed) <= NowNanos();
+}
 
-    } else if (i >= cleaned_base_filename.size() + 16) { // 16+: pid
-      if (c < '0' || c > '9') { return false; }
+void LogRateLimiter::ReportSuppressed(bool all) {
+  for (LogRateLimiter* site =
+           rate_limited_sites.load(std::memory_order_acquire);
+       site != nullptr; site = site->next_) {
+    if (!all && !site->Idle()) continue;
+    if (const uint64 suppressed = site->TakeSuppressed()) {
+      LogMessage(site->file_, site->line_, site->severity_).stream()
+          << "Suppressed " << suppressed << " messages from "
+          << const_basename(site->file_) << ':' << site->line_;
     }
   }
+}
 
+bool LogRateLimiter::Allow(double per_second, int burst, const char* file,
+                           int line, LogSeverity severity) {
+  if (severity >= GLOG_FATAL) {
+    return true;
+  }
+  if (!Allow(per_second, burst)) {
+    if (!registered_.exchange(true, std::memory_order_relaxed)) {
+      // For ReportSuppressed(), in case the statement goes quiet.
+      file_ = file;
+      line_ = line;
+      severity_ = severity;
+      next_ = rate_limited_sites.load(std::memory_order_relaxed);
+      while (!rate_limited_sites.compare_exchange_weak(
+          next_, this, std::memory_order_release,
+          std::memory_order_relaxed)) {
+      }
+    }
+    return false;
+  }
+  if (const uint64 suppressed = TakeSuppressed()) {
+    LogMessage(file, line, severity).stream()
+        << "Suppressed " << suppressed << " messages from "
+        << const_basename(file) << ':' << line;
+  }
   return true;
 }
 
-bool LogCleaner::IsLogLastModifiedOver(const string& filepath,
-                                       unsigned int days) const {
-  // Try to get the last modified time of this file.
-  struct stat file_stat;
+namespace {
 
-  if (stat(filepath.c_str(), &file_stat) == 0) {
-    const time_t seconds_in_a_day = 60 * 60 * 24;
-    time_t last_modified_time = file_stat.st_mtime;
-    time_t current_time = time(nullptr);
-    return difftime(current_time, last_modified_time) > days * seconds_in_a_day;
+// The limits of SetLogRateLimit(), per severity: per_second as a float in
+// the upper half, so that both change at once, and burst in the lower one.
+std::atomic<uint64> log_rate_limits[NUM_SEVERITIES];
+LogRateLimiter log_rate_limiters[NUM_SEVERITIES];
+
+uint64 PackLogRateLimit(double per_second, int burst) {
+  const auto rate = static_cast<float>(per_second);
+  uint32 rate_bits;
+  memcpy(&rate_bits, &rate, sizeof(rate_bits));
+  return uint64{rate_bits} << 32U | static_cast<uint32>(burst);
+}
+
+bool AllowedByLogRateLimit(LogSeverity severity) {
+  const uint64 limit =
+      log_rate_limits[severity].load(std::memory_order_relaxed);
+  const auto rate_bits = static_cast<uint32>(limit >> 32U);
+  float per_second;
+  memcpy(&per_second, &rate_bits, sizeof(per_second));
+  return per_second <= 0 ||
+         log_rate_limiters[severity].Allow(per_second,
+                                           static_cast<int32>(limit));
+}
+
+// Once the limit lets a message through again, says how many it dropped.
+void ReportSuppressedMessages(const char* file, int line,
+                              LogSeverity severity) {
+  if (const uint64 suppressed =
+          log_rate_limiters[severity].TakeSuppressed()) {
+    // Not sent with SendToLog(), so that the limit does not apply.
+    LogMessage(file, line, severity, static_cast<LogSink*>(nullptr), true)
+            .stream()
+        << "Suppressed " << suppressed << ' ' << LogSeverityNames[severity]
+        << " messages over the rate limit";
   }
+}
 
-  // If failed to get file stat, don't return true!
-  return false;
+void ReportRateLimitedMessages(bool all) {
+  for (LogSeverity severity = 0; severity < NUM_SEVERITIES; ++severity) {
+    if (all || log_rate_limiters[severity].Idle()) {
+      ReportSuppressedMessages(__FILE__, __LINE__, severity);
+    }
+  }
+  LogRateLimiter::ReportSuppressed(all);
 }
 
 }  // namespace
 
-// Static log data space to avoid alloc failures in a LOG(FATAL)
-//
-// Since multiple threads may call LOG(FATAL), and we want to preserve
-// the data from the first call, we allocate two sets of space.  One
-// for exclusive use by the first thread, and one for shared use by
-// all other threads.
-static Mutex fatal_msg_lock;
-static CrashReason crash_reason;
-static bool fatal_msg_exclusive = true;
-static LogMessage::LogMessageData fatal_msg_data_exclusive;
-static LogMessage::LogMessageData fatal_msg_data_shared;
-
-#ifdef GLOG_THREAD_LOCAL_STORAGE
-// Static thread-local log data space to use, because typically at most one
-// LogMessageData object exists (in this case glog makes zero heap memory
-// allocations).
-static thread_local bool thread_data_available = true;
-
-#if defined(__cpp_lib_byte) && __cpp_lib_byte >= 201603L
-// std::aligned_storage is deprecated in C++23
-alignas(LogMessage::LogMessageData) static thread_local std::byte
-    thread_msg_data[sizeof(LogMessage::LogMessageData)];
-#else   // !(defined(__cpp_lib_byte) && __cpp_lib_byte >= 201603L)
-static thread_local std::aligned_storage<
-    sizeof(LogMessage::LogMessageData),
-    alignof(LogMessage::LogMessageData)>::type thread_msg_data;
-#endif  // defined(__cpp_lib_byte) && __cpp_lib_byte >= 201603L
-#endif  // defined(GLOG_THREAD_LOCAL_STORAGE)
-
-LogMessage::LogMessageData::LogMessageData()
-  : stream_(message_text_, LogMessage::kMaxLogMessageLen, 0) {
-}
-
 LogMessage::LogMessage(const char* file, int line, LogSeverity severity,
                        uint64 ctr, void (LogMessage::*send_method)())
     : allocated_(nullptr) {
@@ -1802,6 +3378,12 @@ LogMessage::LogMessage(const char* file, int line, LogSeverity severity)
   Init(file, line, severity, &LogMessage::SendToLog);
 }
 
+LogMessage::LogMessage(const char* file, int line, LogSeverity severity,
+                       LogSite* site)
+    : allocated_(nullptr) {
+  Init(file, line, severity, &LogMessage::SendToLog, site);
+}
+
 LogMessage::LogMessage(const char* file, int line, LogSeverity severity,
                        LogSink* sink, bool also_send_to_log)
     : allocated_(nullptr) {
@@ -1827,7 +3409,8 @@ LogMessage::LogMessage(const char* file, int line, LogSeverity severity,
 void LogMessage::Init(const char* file,
                       int line,
                       LogSeverity severity,
-                      void (LogMessage::*send_method)()) {
+                      void (LogMessage::*send_method)(),
+                      LogSite* site) {
   allocated_ = nullptr;
   if (severity != GLOG_FATAL || !exit_on_dfatal) {
 #ifdef GLOG_THREAD_LOCAL_STORAGE
@@ -1862,45 +3445,60 @@ void LogMessage::Init(const char* file,
   data_->send_method_ = send_method;
   data_->sink_ = nullptr;
   data_->outvec_ = nullptr;
-  WallTime now = WallTime_Now();
-  auto timestamp_now = static_cast<time_t>(now);
-  logmsgtime_ = LogMessageTime(timestamp_now, now);
-
   data_->num_chars_to_log_ = 0;
   data_->num_chars_to_syslog_ = 0;
   data_->basename_ = const_basename(file);
   data_->fullname_ = file;
+  data_->site_ = site;
   data_->has_been_flushed_ = false;
+  data_->sent_fatal_to_log_ = false;
+
+  if (site != nullptr) {
+    site->Hit();
+  }
+  // Drop messages that are turned off at their site, or that no destination
+  // would take, before any work is done for them: nothing gets formatted
+  // into a bad stream, and Flush() does nothing once it is flushed.  The
+  // other send methods always consume their message.
+  if (severity != GLOG_FATAL &&
+      ((site != nullptr && !site->enabled()) ||
+       (send_method == &LogMessage::SendToLog &&
+        (!LogDestination::WantsSeverity(severity) ||
+         !AllowedByLogRateLimit(severity))))) {
+    data_->num_prefix_chars_ = 0;
+    data_->has_been_flushed_ = true;
+    data_->stream_.setstate(std::ios_base::badbit);
+    return;
+  }
+  if (send_method == &LogMessage::SendToLog && severity != GLOG_FATAL) {
+    ReportSuppressedMessages(file, line, severity);
+  }
+
+  WallTime now = WallTime_Now();
+  auto timestamp_now = static_cast<time_t>(now);
+  logmsgtime_ = LogMessageTime(timestamp_now, now);
 
   // If specified, prepend a prefix to each line.  For example:
   //    I20201018 160715 f5d4fbb0 logging.cc:1153]
   //    (log level, GMT year, month, date, time, thread_id, file basename, line)
   // We exclude the thread_id for the default thread.
   if (FLAGS_log_prefix && (line != kNoLogPrefix)) {
-    std::ios saved_fmt(nullptr);
-    saved_fmt.copyfmt(stream());
-    FillSaver saver(stream(), '0');
     if (custom_prefix_callback == nullptr) {
-      stream() << LogSeverityNames[severity][0];
-      if (FLAGS_log_year_in_prefix) {
-        stream() << setw(4) << 1900 + logmsgtime_.year();
-      }
-      stream() << setw(2) << 1 + logmsgtime_.month() << setw(2)
-               << logmsgtime_.day() << ' ' << setw(2) << logmsgtime_.hour()
-               << ':' << setw(2) << logmsgtime_.minute() << ':' << setw(2)
-               << logmsgtime_.sec() << "." << setw(6) << logmsgtime_.usec()
-               << ' ' << setfill(' ') << setw(5)
-               << static_cast<unsigned int>(GetTID()) << setfill('0') << ' '
-               << data_->basename_ << ':' << data_->line_ << "] ";
+      AppendDefaultPrefix(stream().rdbuf(), severity, logmsgtime_,
+                          static_cast<unsigned int>(GetTID()),
+                          data_->basename_, data_->line_);
     } else {
+      std::ios saved_fmt(nullptr);
+      saved_fmt.copyfmt(stream());
+      FillSaver saver(stream(), '0');
       custom_prefix_callback(
           stream(),
           LogMessageInfo(LogSeverityNames[severity], data_->basename_,
                          data_->line_, GetTID(), logmsgtime_),
           custom_prefix_callback_data);
       stream() << " ";
-    }
       stream().copyfmt(saved_fmt);
+    }
   }
   data_->num_prefix_chars_ = data_->stream_.pcount();
 
@@ -1969,10 +3567,258 @@ int LogMessage::preserved_errno() const {
   return data_->preserved_errno_;
 }
 
-ostream& LogMessage::stream() {
+LogMessage::LogStream& LogMessage::stream() {
   return data_->stream_;
 }
 
+void LogMessage::LogStream::Append(long long value) {
+  char number[32];
+  const std::to_chars_result result =
+      std::to_chars(number, number + sizeof(number), value);
+  Append(number, static_cast<size_t>(result.ptr - number));
+}
+
+void LogMessage::LogStream::Append(unsigned long long value) {
+  char number[32];
+  const std::to_chars_result result =
+      std::to_chars(number, number + sizeof(number), value);
+  Append(number, static_cast<size_t>(result.ptr - number));
+}
+
+void LogMessage::LogStream::Append(double value) {
+  // std::ostream's default: %g with 6 significant digits.
+  if (precision() != 6) {
+    std::ostream::operator<<(value);
+    return;
+  }
+  char number[32];
+#ifdef __cpp_lib_to_chars
+  const std::to_chars_result result = std::to_chars(
+      number, number + sizeof(number), value, std::chars_format::general, 6);
+  Append(number, static_cast<size_t>(result.ptr - number));
+#else
+  const int n = snprintf(number, sizeof(number), "%g", value);
+  Append(number, static_cast<size_t>(std::max(n, 0)));
+#endif
+}
+
+void LogMessage::LogStream::Append(const char* value) {
+  if (value == nullptr) {
+    // Like LOGF(); std::ostream would set badbit instead.
+    Append("(null)", 6);
+    return;
+  }
+  Append(value, strlen(value));
+}
+
+void LogMessage::LogStream::Append(const void* value) {
+  if (value == nullptr) {
+    Append('0');
+    return;
+  }
+  char number[2 + 2 * sizeof(value)] = {'0', 'x'};
+  const std::to_chars_result result =
+      std::to_chars(number + 2, number + sizeof(number),
+                    reinterpret_cast<uintptr_t>(value), 16);
+  Append(number, static_cast<size_t>(result.ptr - number));
+}
+
+void LogMessage::LogStream::Append(const char* data, size_t size) {
+  streambuf_.Reserve(size);
+  size = min(size, streambuf_.available());
+  memcpy(streambuf_.pptr(), data, size);
+  streambuf_.Claim(size);
+}
+
+void LogMessage::AppendFormatted(const char* format,
+                                 const logf_internal::Arg* args) {
+  // Dropped by Init(): don't format arguments only to throw them away.
+  if (data_->has_been_flushed_ || !data_->stream_.good()) {
+    return;
+  }
+  // The stream's buffer is message_text_; write into it directly rather
+  // than through std::ostream.
+  FormatLogfArgs(
+      static_cast<base_logging::LogStreamBuf*>(data_->stream_.rdbuf()),
+      &data_->stream_, format, args);
+}
+
+namespace logf_internal {
+
+bool BinaryLogTakesMessages(LogSeverity severity) {
+  return LogDestination::BinaryLogTakesMessages(severity);
+}
+
+void RecordBinary(const char* file, int line, LogSeverity severity,
+                  const char* format, const Arg* args, size_t num_args) {
+  // Dropped like a LOG() message of the same severity would be.
+  if (!LogDestination::WantsSeverity(severity) ||
+      !AllowedByLogRateLimit(severity)) {
+    return;
+  }
+  ReportSuppressedMessages(file, line, severity);
+  LogDestination::RecordBinary(file, line, severity, format, args, num_args);
+}
+
+}  // namespace logf_internal
+
+namespace {
+
+#ifdef GLOG_THREAD_LOCAL_STORAGE
+// The last message a thread sent, and how often it was repeated since, for
+// --log_repeat_window_ms.  Registered in repeated_messages, so that other
+// threads can report the repeats once the window expires, and all of them
+// at shutdown.
+struct RepeatedMessage {
+  RepeatedMessage();
+  // Reports the repeats of a thread that exits.
+  ~RepeatedMessage();
+
+  Mutex lock;
+  const char* file{nullptr};
+  int line{0};
+  LogSeverity severity{GLOG_INFO};
+  string text;  // The message body, without the prefix.
+  int64 first_ns{0};
+  uint64 repeats{0};
+  RepeatedMessage* next{nullptr};  // In repeated_messages.
+};
+
+Mutex repeated_messages_lock;
+RepeatedMessage* repeated_messages = nullptr;
+// When the window of the oldest streak with repeats expires.
+std::atomic<int64> repeats_due_ns{std::numeric_limits<int64>::max()};
+thread_local RepeatedMessage last_message;
+
+void RepeatsDueAt(int64 due_ns) {
+  int64 next = repeats_due_ns.load(std::memory_order_relaxed);
+  while (due_ns < next && !repeats_due_ns.compare_exchange_weak(
+                              next, due_ns, std::memory_order_relaxed)) {
+  }
+}
+
+void ReportRepeats(const char* file, int line, LogSeverity severity,
+                   uint64 repeats) {
+  if (repeats > 0) {
+    // Not sent with SendToLog(), so that it is not coalesced itself.
+    LogMessage(file, line, severity, static_cast<LogSink*>(nullptr), true)
+            .stream()
+        << "Last message repeated " << repeats
+        << (repeats == 1 ? " time" : " times");
+  }
+}
+
+RepeatedMessage::RepeatedMessage() {
+  MutexLock l(&repeated_messages_lock);
+  next = repeated_messages;
+  repeated_messages = this;
+}
+
+RepeatedMessage::~RepeatedMessage() {
+  {
+    MutexLock l(&repeated_messages_lock);
+    RepeatedMessage** link = &repeated_messages;
+    while (*link != this) {
+      link = &(*link)->next;
+    }
+    *link = next;
+  }
+  // No other thread sees this one any more.
+  ReportRepeats(file, line, severity, repeats);
+}
+#endif
+
+// Reports the repeats of the streaks whose window expired, or of all of
+// them, on behalf of threads that may not log again for a while.
+void ReportPendingRepeats(bool all) {
+#ifdef GLOG_THREAD_LOCAL_STORAGE
+  const int64 now = NowNanos();
+  if (!all && now < repeats_due_ns.load(std::memory_order_relaxed)) {
+    return;
+  }
+  struct Pending {
+    const char* file;
+    int line;
+    LogSeverity severity;
+    uint64 repeats;
+  };
+  vector<Pending> pending;
+  const int64 window = int64{FLAGS_log_repeat_window_ms} * 1000000;
+  {
+    MutexLock l(&repeated_messages_lock);
+    repeats_due_ns.store(std::numeric_limits<int64>::max(),
+                         std::memory_order_relaxed);
+    for (RepeatedMessage* m = repeated_messages; m != nullptr; m = m->next) {
+      MutexLock m_lock(&m->lock);
+      if (m->repeats == 0) continue;
+      if (all || now - m->first_ns >= window) {
+        pending.push_back({m->file, m->line, m->severity, m->repeats});
+        // Later repeats start a new window.
+        m->repeats = 0;
+        m->first_ns = now;
+      } else {
+        RepeatsDueAt(m->first_ns + window);
+      }
+    }
+  }
+  // Outside the locks: a LogSink may log.
+  for (const Pending& p : pending) {
+    ReportRepeats(p.file, p.line, p.severity, p.repeats);
+  }
+#else
+  (void)all;
+#endif
+}
+
+// Returns true if the message body text[0, len) from file:line repeats the
+// last message of this thread, and the streak started less than
+// --log_repeat_window_ms ago; it is counted then.  Otherwise, reports the
+// repeats of the streak it ends, if any.
+bool IsRepeatedMessage(const char* file, int line, LogSeverity severity,
+                       const char* text, size_t len) {
+#ifdef GLOG_THREAD_LOCAL_STORAGE
+  ReportPendingRepeats(false);
+  const int64 now = NowNanos();
+  const int64 window = int64{FLAGS_log_repeat_window_ms} * 1000000;
+  RepeatedMessage& last = last_message;
+  const char* ended_file;
+  int ended_line;
+  LogSeverity ended_severity;
+  uint64 ended_repeats;
+  {
+    MutexLock l(&last.lock);
+    if (last.file == file && last.line == line && last.severity == severity &&
+        last.text.size() == len && memcmp(last.text.data(), text, len) == 0 &&
+        now - last.first_ns < window) {
+      if (++last.repeats == 1) {
+        RepeatsDueAt(last.first_ns + window);
+      }
+      return true;
+    }
+    ended_file = last.file;
+    ended_line = last.line;
+    ended_severity = last.severity;
+    ended_repeats = last.repeats;
+    last.file = file;
+    last.line = line;
+    last.severity = severity;
+    last.text.assign(text, len);
+    last.first_ns = now;
+    last.repeats = 0;
+  }
+  ReportRepeats(ended_file, ended_line, ended_severity, ended_repeats);
+#else
+  (void)file, (void)line, (void)severity, (void)text, (void)len;
+#endif
+  return false;
+}
+
+}  // namespace
+
+// How many messages this thread is sending under log_mutex: more than one
+// when a LogSink logs.
+static thread_local int sends_in_progress = 0;
+
 // Flush buffered message, called by the destructor, or any other function
 // that needs to synchronize the log.
 void LogMessage::Flush() {
@@ -1980,10 +3826,33 @@ void LogMessage::Flush() {
     return;
   }
 
+  data_->message_text_ = data_->stream_.pbase();
   data_->num_chars_to_log_ = data_->stream_.pcount();
   data_->num_chars_to_syslog_ =
     data_->num_chars_to_log_ - data_->num_prefix_chars_;
 
+  if (FLAGS_log_repeat_window_ms > 0 &&
+      data_->send_method_ == &LogMessage::SendToLog &&
+      data_->severity_ != GLOG_FATAL &&
+      IsRepeatedMessage(data_->fullname_, data_->line_, data_->severity_,
+                        data_->message_text_ + data_->num_prefix_chars_,
+                        data_->num_chars_to_syslog_)) {
+    if (data_->preserved_errno_ != 0) {
+      errno = data_->preserved_errno_;
+    }
+    data_->has_been_flushed_ = true;
+    data_->stream_.clear();
+    return;
+  }
+
+  LoggingStatsShard::Severity& stats =
+      LocalLoggingStats().severity[static_cast<int>(data_->severity_)];
+  // The stream leaves room for the '\n' and '\0', and drops what does not
+  // fit.  A message that fills it exactly counts as truncated, too.
+  if (data_->num_chars_to_log_ == LogMessage::kMaxLogMessageLen - 2) {
+    AddStat(&stats.truncated_messages, 1);
+  }
+
   // Do we need to add a \n to the end of this message?
   bool append_newline =
       (data_->message_text_[data_->num_chars_to_log_-1] != '\n');
@@ -2000,10 +3869,12 @@ void LogMessage::Flush() {
   }
   data_->message_text_[data_->num_chars_to_log_] = '\0';
 
-  // Prevent any subtle race conditions by wrapping a mutex lock around
-  // the actual logging action per se.
+  // Keep the log destinations from being changed while we are sending to
+  // them.  This is only a reader lock: the destinations themselves are
+  // locked individually, so independent messages are written concurrently.
   {
-    MutexLock l(&log_mutex);
+    TimedReaderMutexLock l(&log_mutex, &stats.log_mutex_wait_ns);
+    ++sends_in_progress;
 	try
 	{
 		(this->*(data_->send_method_))();
@@ -2012,10 +3883,37 @@ void LogMessage::Flush() {
 	{
 		// nada
 	}
-	++num_messages_[static_cast<int>(data_->severity_)];
+    --sends_in_progress;
+	AddStat(&stats.messages, 1);
+  }
+#ifdef HAVE_ASYNC_LOGGING
+  // A message that a LogSink logs leaves this to the outer one, which
+  // still holds log_mutex.
+  if (sends_in_progress == 0) {
+    AsyncLogWriter::PushPending();
+  }
+#endif
+  if (data_->site_ != nullptr) {
+    data_->site_->bytes_.fetch_add(data_->num_chars_to_log_,
+                                   std::memory_order_relaxed);
   }
+  // Not under log_mutex: a sink that never finishes must not keep
+  // AddLogSink() and the like waiting, also for a FATAL message.
   LogDestination::WaitForSinks(data_);
 
+  if (data_->sent_fatal_to_log_) {
+    const char* message = "*** Check failure stack trace: ***\n";
+	fputs(message, stderr);  	// Ignore errors.
+	fflush(stderr);
+#if defined(__ANDROID__)
+    // ANDROID_LOG_FATAL as this message is of FATAL severity.
+    __android_log_write(ANDROID_LOG_FATAL,
+                        glog_internal_namespace_::ProgramInvocationShortName(),
+                        message);
+#endif
+    //Fail();  -- do NOT call that one here: other loggers may be active and we want to flush them all. FlushAndFail will take care of the Fail after all that's been done.
+  }
+
   if (append_newline) {
     // Fix the ostrstream back how it was before we screwed with it.
     // It's 99.44% certain that we don't need to worry about doing this.
@@ -2057,7 +3955,7 @@ void ReprintFatalMessage() {
 
 // L >= log_mutex (callers must hold the log_mutex).
 void LogMessage::SendToLog() EXCLUSIVE_LOCKS_REQUIRED(log_mutex) {
-  static bool already_warned_before_initgoogle = false;
+  static std::atomic<bool> already_warned_before_initgoogle{false};
 
   log_mutex.AssertHeld();
 
@@ -2066,11 +3964,12 @@ void LogMessage::SendToLog() EXCLUSIVE_LOCKS_REQUIRED(log_mutex) {
 
   // Messages of a given severity get logged to lower severity logs, too
 
-  if (!already_warned_before_initgoogle && !IsGoogleLoggingInitialized()) {
+  if (!already_warned_before_initgoogle.load(std::memory_order_relaxed) &&
+      !IsGoogleLoggingInitialized() &&
+      !already_warned_before_initgoogle.exchange(true)) {
     const char w[] = "WARNING: Logging before InitGoogleLogging() is "
                      "written to STDERR\n";
     WriteToStderr(w, strlen(w));
-    already_warned_before_initgoogle = true;
   }
 
   // global flag: never log to file if set.  Also -- don't log to a
@@ -2094,9 +3993,24 @@ void LogMessage::SendToLog() EXCLUSIVE_LOCKS_REQUIRED(log_mutex) {
                                 data_->num_prefix_chars_ - 1) );
   } else {
     // log this message to all log files of severity <= severity_
-    LogDestination::LogToAllLogfiles(data_->severity_, logmsgtime_.timestamp(),
-                                     data_->message_text_,
-                                     data_->num_chars_to_log_);
+    if (FLAGS_logbinary) {
+      if (!LogDestination::binary_log()->WriteText(
+              data_->severity_, data_->basename_, data_->line_, GetTID(),
+              logmsgtime_, data_->message_text_ + data_->num_prefix_chars_,
+              data_->num_chars_to_log_ - data_->num_prefix_chars_ - 1)) {
+        AddStat(&LocalLoggingStats()
+                     .file[static_cast<size_t>(data_->severity_)]
+                     .dropped_messages,
+                1);
+      }
+    } else if (!MaybeLogAsync(data_->severity_, logmsgtime_.timestamp(),
+                              data_->message_text_,
+                              data_->num_chars_to_log_)) {
+      LogDestination::LogToAllLogfiles(data_->severity_,
+                                       logmsgtime_.timestamp(),
+                                       data_->message_text_,
+                                       data_->num_chars_to_log_);
+    }
 
     LogDestination::MaybeLogToStderr(data_->severity_, data_->message_text_,
                                      data_->num_chars_to_log_,
@@ -2132,30 +4046,16 @@ void LogMessage::SendToLog() EXCLUSIVE_LOCKS_REQUIRED(log_mutex) {
 
     if (!FLAGS_logtostderr && !FLAGS_logtostdout) {
       for (auto& log_destination : LogDestination::log_destinations_) {
-        if (log_destination) {
-          log_destination->logger_->Write(true, 0, "", 0);
+        LogDestination* destination = log_destination.load();
+        if (destination) {
+          destination->logger_->Write(true, 0, "", 0);
         }
       }
     }
 
-    // release the lock that our caller (directly or indirectly)
-    // LogMessage::~LogMessage() grabbed so that signal handlers
-    // can use the logging facility. Alternately, we could add
-    // an entire unsafe logging interface to bypass locking
-    // for signal handlers but this seems simpler.
-    log_mutex.Unlock();
-    LogDestination::WaitForSinks(data_);
-
-    const char* message = "*** Check failure stack trace: ***\n";
-	fputs(message, stderr);  	// Ignore errors.
-	fflush(stderr);
-#if defined(__ANDROID__)
-    // ANDROID_LOG_FATAL as this message is of FATAL severity.
-    __android_log_write(ANDROID_LOG_FATAL,
-                        glog_internal_namespace_::ProgramInvocationShortName(),
-                        message);
-#endif
-    //Fail();  -- do NOT call that one here: other loggers may be active and we want to flush them all. FlushAndFail will take care of the Fail after all that's been done.
+    // Flush() waits for the sinks and prints the stack trace header once
+    // it has released log_mutex.
+    data_->sent_fatal_to_log_ = true;
   }
 }
 
@@ -2245,11 +4145,15 @@ void LogMessage::SendToSink() EXCLUSIVE_LOCKS_REQUIRED(log_mutex) {
   if (data_->sink_ != nullptr) {
     RAW_DCHECK(data_->num_chars_to_log_ > 0 &&
                data_->message_text_[data_->num_chars_to_log_-1] == '\n', "");
+    const int64 start = NowNanos();
     data_->sink_->send(data_->severity_, data_->fullname_, data_->basename_,
                        data_->line_, logmsgtime_,
                        data_->message_text_ + data_->num_prefix_chars_,
                        (data_->num_chars_to_log_ -
                         data_->num_prefix_chars_ - 1) );
+    LoggingStatsShard& stats = LocalLoggingStats();
+    AddStat(&stats.sink_sends, 1);
+    AddStat(&stats.sink_send_ns, NowNanos() - start);
   }
 }
 
@@ -2288,14 +4192,16 @@ void LogMessage::WriteToStringAndLog() EXCLUSIVE_LOCKS_REQUIRED(log_mutex) {
 // L >= log_mutex (callers must hold the log_mutex).
 void LogMessage::SendToSyslogAndLog() {
 #ifdef HAVE_SYSLOG_H
-  // Before any calls to syslog(), make a single call to openlog()
-  static bool openlog_already_called = false;
-  if (!openlog_already_called) {
+  // Before any calls to syslog(), make a single call to openlog().
+  // Several threads may get here at once: let the static initializer
+  // serialize them.
+  static const bool openlog_already_called = [] {
     openlog(glog_internal_namespace_::ProgramInvocationShortName(),
             LOG_CONS | LOG_NDELAY | LOG_PID,
             LOG_USER);
-    openlog_already_called = true;
-  }
+    return true;
+  }();
+  (void)openlog_already_called;
 
   // This array maps Google severity levels to syslog levels
   const int SEVERITY_TO_LEVEL[] = { LOG_INFO, LOG_WARNING, LOG_ERR, LOG_EMERG };
@@ -2309,19 +4215,91 @@ void LogMessage::SendToSyslogAndLog() {
 }
 
 base::Logger* base::GetLogger(LogSeverity severity) {
-  MutexLock l(&log_mutex);
+  ReaderMutexLock l(&log_mutex);
   return LogDestination::log_destination(severity)->GetLoggerImpl();
 }
 
 void base::SetLogger(LogSeverity severity, base::Logger* logger) {
-  MutexLock l(&log_mutex);
-  LogDestination::log_destination(severity)->SetLoggerImpl(logger);
+  {
+    MutexLock l(&log_mutex);
+    LogDestination::log_destination(severity)->SetLoggerImpl(logger);
+  }
+  LogDestination::UpdateConsumedSeverities();
 }
 
-// L < log_mutex.  Acquires and releases mutex_.
 int64 LogMessage::num_messages(int severity) {
-  MutexLock l(&log_mutex);
-  return num_messages_[severity];
+  int64 messages = 0;
+  for (const LoggingStatsShard& shard : logging_stats) {
+    messages += LoadStat(shard.severity[severity].messages);
+  }
+  return messages;
+}
+
+LoggingStats GetLoggingStats() {
+  LoggingStats stats = {};
+  for (const LoggingStatsShard& shard : logging_stats) {
+    for (int i = 0; i < NUM_SEVERITIES; ++i) {
+      const LoggingStatsShard::Severity& from = shard.severity[i];
+      LoggingStats::Severity& severity = stats.severity[i];
+      severity.messages += LoadStat(from.messages);
+      severity.truncated_messages += LoadStat(from.truncated_messages);
+      severity.log_mutex_wait_ns += LoadStat(from.log_mutex_wait_ns);
+    }
+    for (int i = 0; i < NUM_SEVERITIES; ++i) {
+      const LoggingStatsShard::File& from = shard.file[i];
+      LoggingStats::File& file = stats.file[i];
+      file.bytes_written += LoadStat(from.bytes_written);
+      file.dropped_messages += LoadStat(from.dropped_messages);
+      file.lock_wait_ns += LoadStat(from.lock_wait_ns);
+      file.flushes += LoadStat(from.flushes);
+      file.flush_ns += LoadStat(from.flush_ns);
+      file.rollovers += LoadStat(from.rollovers);
+      file.rollover_ns += LoadStat(from.rollover_ns);
+    }
+    stats.console_bytes_written += LoadStat(shard.console_bytes_written);
+    stats.sink_sends += LoadStat(shard.sink_sends);
+    stats.sink_send_ns += LoadStat(shard.sink_send_ns);
+  }
+  return stats;
+}
+
+void GetLogSites(vector<LogSite*>* sites) {
+  sites->clear();
+  for (LogSite* site = LogSiteList::Head(); site != nullptr;
+       site = LogSiteList::Next(site)) {
+    sites->push_back(site);
+  }
+}
+
+// Whether path is file, or ends with "/" followed by file.
+static bool LogSiteFileMatches(const char* path, const char* file) {
+  const size_t path_length = strlen(path);
+  const size_t file_length = strlen(file);
+  if (file_length > path_length) {
+    return false;
+  }
+  const char* tail = path + path_length - file_length;
+  if (strcmp(tail, file) != 0) {
+    return false;
+  }
+  return tail == path || tail[-1] == '/'
+#ifdef GLOG_OS_WINDOWS
+         || tail[-1] == '\\'
+#endif
+      ;
+}
+
+int SetLogSitesEnabled(const char* file, int line, bool enabled) {
+  int found = 0;
+  for (LogSite* site = LogSiteList::Head(); site != nullptr;
+       site = LogSiteList::Next(site)) {
+    if ((line == 0 || site->line() == line) &&
+        LogSiteFileMatches(site->file(), file)) {
+      site->set_enabled(enabled);
+      ++found;
+    }
+  }
+  return found;
 }
 
 // Output the COUNTER value. This is only valid if ostream is a
@@ -2352,6 +4330,8 @@ ErrnoLogMessage::~ErrnoLogMessage() {
 }
 
 void FlushLogFiles(LogSeverity min_severity) {
+  ReportPendingRepeats(false);
+  ReportRateLimitedMessages(false);
   LogDestination::FlushLogFiles(min_severity);
 }
 
@@ -2438,12 +4418,19 @@ void LogToStderr() {
   LogDestination::LogToStderr();
 }
 
+void SetLogRateLimit(LogSeverity severity, double per_second, int burst) {
+  CHECK_GE(severity, 0);
+  CHECK_LT(severity, NUM_SEVERITIES);
+  log_rate_limits[severity].store(PackLogRateLimit(per_second, burst),
+                                  std::memory_order_relaxed);
+}
+
 namespace base {
 namespace internal {
 
 bool GetExitOnDFatal();
 bool GetExitOnDFatal() {
-  MutexLock l(&log_mutex);
+  ReaderMutexLock l(&log_mutex);
   return exit_on_dfatal;
 }
 
@@ -2579,7 +4566,9 @@ static void GetTempDirectories(vector<string>* list) {
 static vector<string>* logging_directories_list;
 
 const vector<string>& GetLoggingDirectories() {
-  // Not strictly thread-safe but we're called early in InitGoogle().
+  // Log files of different severities may be created concurrently.
+  static Mutex logging_directories_mutex;
+  MutexLock l(&logging_directories_mutex);
   if (logging_directories_list == nullptr) {
     logging_directories_list = new vector<string>;
 
@@ -2808,6 +4797,9 @@ string StrError(int err) {
 LogMessageFatal::LogMessageFatal(const char* file, int line) :
     LogMessage(file, line, GLOG_FATAL) {}
 
+LogMessageFatal::LogMessageFatal(const char* file, int line, LogSite* site) :
+    LogMessage(file, line, GLOG_FATAL, site) {}
+
 LogMessageFatal::LogMessageFatal(const char* file, int line,
                                  const CheckOpString& result) :
     LogMessage(file, line, result) {}
@@ -2890,7 +4882,14 @@ void InitGoogleLogging(const char* argv0,
 }
 
 void ShutdownGoogleLogging() {
+  ReportPendingRepeats(true);
+  ReportRateLimitedMessages(true);
+#ifdef HAVE_ASYNC_LOGGING
+  AsyncLogWriter::Shutdown();
+#endif
+  LogCompressor::Shutdown();
   glog_internal_namespace_::ShutdownGoogleLoggingUtilities();
+  LogDestination::CloseBinaryLog();
   LogDestination::DeleteLogDestinations();
   delete logging_directories_list;
   logging_directories_list = nullptr;
@@ -2912,7 +4911,73 @@ LogMessageTime::LogMessageTime(std::tm t) {
   init(t, timestamp, 0);
 }
 
+LogMessageTime::LogMessageTime(std::tm t, std::time_t timestamp,
+                               int32_t usecs, long int gmtoffset)
+    : time_struct_(t),
+      timestamp_(timestamp),
+      usecs_(usecs),
+      gmtoffset_(gmtoffset) {}
+
+namespace {
+
+// Fingerprint of the time zone settings, so that cached local times are
+// dropped once the program calls tzset() with a different TZ.
+struct TimeZoneState {
+#ifndef GLOG_OS_WINDOWS
+  // tzset() points these at the names of the new zone.
+  const char* std_name{nullptr};
+  const char* dst_name{nullptr};
+
+  static TimeZoneState Current() {
+    TimeZoneState state;
+    state.std_name = tzname[0];
+    state.dst_name = tzname[1];
+    return state;
+  }
+  bool operator==(const TimeZoneState& o) const {
+    return std_name == o.std_name && dst_name == o.dst_name;
+  }
+#else
+  // Time zone changes are picked up when the next minute starts.
+  static TimeZoneState Current() { return TimeZoneState(); }
+  bool operator==(const TimeZoneState&) const { return true; }
+#endif
+};
+
+#ifdef GLOG_THREAD_LOCAL_STORAGE
+// localtime_r() and mktime() take the global time zone lock in most C
+// libraries, and CalcGmtOffset() needs several of them per message.
+// Neither the broken-down time nor the GMT offset can change within a
+// minute except for tm_sec, so each thread remembers the minute it last
+// logged in and only recomputes everything once that minute is over (or
+// the time zone was changed).
+struct BrokenDownTimeCache {
+  std::time_t minute_start{0};
+  std::time_t minute_end{0};  // exclusive; empty while equal to minute_start
+  bool utc{false};
+  TimeZoneState zone;
+  std::tm time_struct{};      // with tm_sec == 0
+  long gmtoffset{0};
+};
+thread_local BrokenDownTimeCache broken_down_time_cache;
+#endif
+
+}  // namespace
+
 LogMessageTime::LogMessageTime(std::time_t timestamp, WallTime now) {
+#ifdef GLOG_THREAD_LOCAL_STORAGE
+  BrokenDownTimeCache& cache = broken_down_time_cache;
+  if (timestamp >= cache.minute_start && timestamp < cache.minute_end &&
+      cache.utc == FLAGS_log_utc_time &&
+      cache.zone == TimeZoneState::Current()) {
+    time_struct_ = cache.time_struct;
+    time_struct_.tm_sec = static_cast<int>(timestamp - cache.minute_start);
+    timestamp_ = timestamp;
+    usecs_ = static_cast<int32>((now - timestamp) * 1000000);
+    gmtoffset_ = cache.gmtoffset;
+    return;
+  }
+#endif
   std::tm t;
   if (FLAGS_log_utc_time) {
     gmtime_r(&timestamp, &t);
@@ -2920,6 +4985,15 @@ LogMessageTime::LogMessageTime(std::time_t timestamp, WallTime now) {
     localtime_r(&timestamp, &t);
   }
   init(t, timestamp, now);
+#ifdef GLOG_THREAD_LOCAL_STORAGE
+  cache.minute_start = timestamp - t.tm_sec;
+  cache.minute_end = cache.minute_start + 60;
+  cache.utc = FLAGS_log_utc_time;
+  cache.zone = TimeZoneState::Current();
+  cache.time_struct = t;
+  cache.time_struct.tm_sec = 0;
+  cache.gmtoffset = gmtoffset_;
+#endif
 }
 
 void LogMessageTime::init(const std::tm& t, std::time_t timestamp,
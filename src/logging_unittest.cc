@@ -44,23 +44,30 @@
 # include <sys/wait.h>
 #endif
 
+#include <atomic>
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
 #include <memory>
 #include <queue>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "base/commandlineflags.h"
+#include "binary_log.h"
 #include "glog/logging.h"
 #include "glog/raw_logging.h"
 #include "googletest.h"
+#include "log_compressor.h"
 
 #include "testing.h"
+#include "uring_file_writer.h"
 
 DECLARE_string(log_backtrace_at);  // logging.cc
 
@@ -112,6 +119,20 @@ static void TestBasenameAppendWhenNoTimestamp();
 static void TestTwoProcessesWrite();
 static void TestSymlink();
 static void TestExtension();
+static void TestAsyncLogging();
+static void TestAsyncLoggingFullBuffer();
+static void TestBinaryLogging();
+static void TestBinaryLogRolling();
+static void TestIoUringLogging();
+static void TestIoUringShortSubmit();
+static void TestMmapLogging();
+static void TestMmapReopenAfterCrash();
+static void TestLogCompression();
+static void TestLeftoverLogCompression();
+static void TestGroupCommit();
+static void TestLoggingStats();
+static void TestLogSites();
+static void TestSeverityMask();
 static void TestWrapper();
 static void TestErrno();
 static void TestTruncate();
@@ -176,6 +197,114 @@ static void BM_logspeed(int n) {
 }
 BENCHMARK(BM_logspeed)
 
+static void BM_logspeed_args(int n) {
+  while (n-- > 0) {
+    LOG(INFO) << "test message " << n << ' ' << 2.5 << ' ' << "text";
+  }
+}
+BENCHMARK(BM_logspeed_args)
+
+static void BM_logf(int n) {
+  while (n-- > 0) {
+    LOGF(INFO, "test message {} {} {}", n, 2.5, "text");
+  }
+}
+BENCHMARK(BM_logf)
+
+// Logs its share of the messages of BM_logspeed_threads.
+class LogSpeedThread : public Thread {
+ public:
+  explicit LogSpeedThread(int n) : n_(n) { SetJoinable(true); }
+
+ protected:
+  void Run() override {
+    for (int i = n_; i > 0; --i) {
+      LOG(INFO) << "test message";
+    }
+  }
+
+ private:
+  int n_;
+};
+
+// Spreads n messages over 1, 2, 4 and 8 threads.  The harness times
+// benchmarks with clock(), which adds up the CPU time of all threads, so
+// report the wall-clock throughput for each thread count here.
+static void BM_logspeed_threads(int n) {
+  for (int num_threads = 1; num_threads <= 8; num_threads *= 2) {
+    vector<LogSpeedThread*> threads;
+    const auto start = std::chrono::steady_clock::now();
+    for (int t = 0; t < num_threads; ++t) {
+      threads.push_back(new LogSpeedThread(n / num_threads));
+      threads.back()->Start();
+    }
+    for (auto* thread : threads) {
+      thread->Join();
+      delete thread;
+    }
+    const double elapsed_ns = std::chrono::duration<double, std::nano>(
+        std::chrono::steady_clock::now() - start).count();
+    printf("BM_logspeed_threads/%d\t%8.2lf ns/msg\t%10.0lf msgs/s\n",
+           num_threads, elapsed_ns / n, n * 1e9 / elapsed_ns);
+  }
+}
+BENCHMARK(BM_logspeed_threads)
+
+static void HitLogEveryN() {
+  LOG_EVERY_N(INFO, 10000) << "every n " << COUNTER;
+}
+
+static void HitLogEveryNApprox() {
+  LOG_EVERY_N_APPROX(INFO, 10000) << "every n approx " << COUNTER;
+}
+
+// Hits a LOG_EVERY_N statement for BM_log_every_n_threads.
+class LogEveryNThread : public Thread {
+ public:
+  LogEveryNThread(void (*hit)(), int n) : hit_(hit), n_(n) {
+    SetJoinable(true);
+  }
+
+ protected:
+  void Run() override {
+    for (int i = n_; i > 0; --i) {
+      hit_();
+    }
+  }
+
+ private:
+  void (*hit_)();
+  int n_;
+};
+
+// Compares LOG_EVERY_N and LOG_EVERY_N_APPROX, with every thread hitting
+// the same statement.
+static void BM_log_every_n_threads(int n) {
+  const struct {
+    const char* name;
+    void (*hit)();
+  } kinds[] = {{"exact", &HitLogEveryN}, {"approx", &HitLogEveryNApprox}};
+  for (const auto& kind : kinds) {
+    for (int num_threads = 1; num_threads <= 8; num_threads *= 2) {
+      vector<LogEveryNThread*> threads;
+      const auto start = std::chrono::steady_clock::now();
+      for (int t = 0; t < num_threads; ++t) {
+        threads.push_back(new LogEveryNThread(kind.hit, n));
+        threads.back()->Start();
+      }
+      for (auto* thread : threads) {
+        thread->Join();
+        delete thread;
+      }
+      const double elapsed_ns = std::chrono::duration<double, std::nano>(
+          std::chrono::steady_clock::now() - start).count();
+      printf("BM_log_every_n_threads/%s/%d\t%8.2lf ns/hit\n", kind.name,
+             num_threads, elapsed_ns / (static_cast<double>(n) * num_threads));
+    }
+  }
+}
+BENCHMARK(BM_log_every_n_threads)
+
 static void BM_vlog(int n) {
   while (n-- > 0) {
     VLOG(1) << "test message";
@@ -300,6 +429,20 @@ int main(int argc, const char** argv) {
   TestTwoProcessesWrite();
   TestSymlink();
   TestExtension();
+  TestAsyncLogging();
+  TestAsyncLoggingFullBuffer();
+  TestBinaryLogging();
+  TestBinaryLogRolling();
+  TestIoUringLogging();
+  TestIoUringShortSubmit();
+  TestMmapLogging();
+  TestMmapReopenAfterCrash();
+  TestLogCompression();
+  TestLeftoverLogCompression();
+  TestGroupCommit();
+  TestLoggingStats();
+  TestLogSites();
+  TestSeverityMask();
   TestWrapper();
   TestErrno();
   TestTruncate();
@@ -526,6 +669,14 @@ void TestVLogModule() {
   EXPECT_EQ(0, SetVLOGLevel("logging_unittest", 1));
   c = TestVlogHelper();
   EXPECT_EQ(1, c);
+
+  // A new pattern takes over the site already bound to "logging_unittest".
+  EXPECT_EQ(0, SetVLOGLevel("logging_unit*", 0));
+  c = TestVlogHelper();
+  EXPECT_EQ(0, c);
+  EXPECT_EQ(0, SetVLOGLevel("logging_unit*", 1));
+  c = TestVlogHelper();
+  EXPECT_EQ(1, c);
 #endif
 }
 
@@ -889,6 +1040,654 @@ static void TestExtension() {
   DeleteFiles(dest + "*");
 }
 
+static const int kAsyncLogThreads = 4;
+static const int kAsyncLogMessagesPerThread = 2000;
+
+// Logs kAsyncLogMessagesPerThread numbered messages.
+class AsyncLogTestThread : public Thread {
+ public:
+  explicit AsyncLogTestThread(int id) : id_(id) {
+    SetJoinable(true);
+    Start();
+  }
+
+ protected:
+  void Run() override {
+    for (int i = 0; i < kAsyncLogMessagesPerThread; ++i) {
+      LOG(INFO) << "async message " << id_ << ' ' << i;
+    }
+  }
+
+ private:
+  int id_;
+};
+
+static void TestAsyncLogging() {
+  fprintf(stderr, "==== Test asynchronous logging\n");
+  const string dest = FLAGS_test_tmpdir + "/logging_test_async";
+  DeleteFiles(dest + "*");
+
+  FLAGS_logasync = true;
+  SetLogDestination(GLOG_INFO, dest.c_str());
+  vector<AsyncLogTestThread*> threads;
+  for (int t = 0; t < kAsyncLogThreads; ++t) {
+    threads.push_back(new AsyncLogTestThread(t));
+  }
+  for (auto* thread : threads) {
+    thread->Join();
+    delete thread;
+  }
+  LOG(INFO) << "async message done";
+  // Must wait for everything queued above, including the rings of the
+  // threads that are gone by now.
+  FlushLogFiles(GLOG_INFO);
+  FLAGS_logasync = false;
+
+  CheckFile(dest, "async message done");
+
+  // Every message made it, and the messages of each thread are in order.
+  vector<string> files;
+  GetFiles(dest + "*", &files);
+  CHECK_EQ(files.size(), 1UL);
+  ifstream in(files[0].c_str());
+  vector<int> next(kAsyncLogThreads, 0);
+  string line;
+  while (getline(in, line)) {
+    const size_t pos = line.find("async message ");
+    int id, i;
+    if (pos != string::npos &&
+        sscanf(line.c_str() + pos, "async message %d %d", &id, &i) == 2) {
+      CHECK_EQ(i, next[id]);
+      ++next[id];
+    }
+  }
+  for (int t = 0; t < kAsyncLogThreads; ++t) {
+    CHECK_EQ(next[t], kAsyncLogMessagesPerThread);
+  }
+
+  // Release file handle for the destination file to unlock the file in Windows.
+  LogToStderr();
+  DeleteFiles(dest + "*");
+}
+
+// By default, a thread whose buffer is full waits for the writer.  With a
+// --logasync_full_wait_ms, it drops its messages after that rather than
+// writing the log files itself.  Every message is either written, in
+// order, or counted.
+static void TestAsyncLoggingFullBuffer() {
+  fprintf(stderr, "==== Test asynchronous logging with a full buffer\n");
+  const string dest = FLAGS_test_tmpdir + "/logging_test_async_full";
+  DeleteFiles(dest + "*");
+
+  const int64 dropped_before =
+      GetLoggingStats().file[GLOG_INFO].dropped_messages;
+  FLAGS_logasync = true;
+  FLAGS_logasync_buffer_kb = 64;
+  SetLogDestination(GLOG_INFO, dest.c_str());
+  {
+    // New threads, for rings of the size set above.
+    AsyncLogTestThread waiting_thread(1);
+    waiting_thread.Join();
+    FlushLogFiles(GLOG_INFO);
+    CHECK_EQ(GetLoggingStats().file[GLOG_INFO].dropped_messages,
+             dropped_before);
+    FLAGS_logasync_full_wait_ms = 1;
+    AsyncLogTestThread thread(0);
+    thread.Join();
+  }
+  FlushLogFiles(GLOG_INFO);
+  FLAGS_logasync = false;
+  FLAGS_logasync_buffer_kb = 256;
+  FLAGS_logasync_full_wait_ms = 0;
+  const int64 dropped =
+      GetLoggingStats().file[GLOG_INFO].dropped_messages - dropped_before;
+
+  vector<string> files;
+  GetFiles(dest + "*", &files);
+  CHECK_EQ(files.size(), 1UL);
+  ifstream in(files[0].c_str());
+  int written[2] = {0, 0};
+  int last[2] = {-1, -1};
+  string line;
+  while (getline(in, line)) {
+    const size_t pos = line.find("async message ");
+    int id, i;
+    if (pos != string::npos &&
+        sscanf(line.c_str() + pos, "async message %d %d", &id, &i) == 2) {
+      CHECK_GT(i, last[id]);
+      last[id] = i;
+      ++written[id];
+    }
+  }
+  CHECK_EQ(written[1], kAsyncLogMessagesPerThread);
+  CHECK_EQ(written[0] + dropped, kAsyncLogMessagesPerThread);
+
+  LogToStderr();
+  DeleteFiles(dest + "*");
+}
+
+static void TestBinaryLogging() {
+  fprintf(stderr, "==== Test binary logging\n");
+  const string dest = GetLoggingDirectories()[0] + "/" +
+                      ProgramInvocationShortName() + ".*.log.BINARY.*";
+  DeleteFiles(dest);
+
+  // Messages that would also go to stderr are formatted right away.
+  const int32 saved_stderrthreshold = FLAGS_stderrthreshold;
+  FLAGS_stderrthreshold = GLOG_FATAL;
+  FLAGS_logbinary = true;
+  const int logf_line = __LINE__ + 1;
+  LOGF(INFO, "binary {} {} {}", 42, 2.5, "text");
+  LOGF(WARNING, "binary {}", string(3, 'w'));
+  const int log_line = __LINE__ + 1;
+  LOG(ERROR) << "binary " << 7;
+  // Unformatted messages are rate limited like the others.
+  SetLogRateLimit(GLOG_INFO, 0.001, 1);
+  for (int i = 0; i < 3; ++i) {
+    LOGF(INFO, "limited {}", i);
+  }
+  SetLogRateLimit(GLOG_INFO, 0, 0);
+  LOGF(INFO, "no limit");
+  FlushLogFiles(GLOG_INFO);
+  FLAGS_logbinary = false;
+  FLAGS_stderrthreshold = saved_stderrthreshold;
+
+  vector<string> files;
+  GetFiles(dest, &files);
+  CHECK_EQ(files.size(), 1UL);
+  FILE* file = fopen(files[0].c_str(), "rb");
+  CHECK(file != nullptr) << ": could not open " << files[0];
+  BinaryLogReader reader(file);
+  vector<BinaryLogMessage> messages;
+  BinaryLogMessage message;
+  while (reader.Next(&message)) {
+    messages.push_back(message);
+  }
+  fclose(file);
+  CHECK_EQ(reader.error(), "");
+
+  CHECK_EQ(messages.size(), 6UL);
+  CHECK_EQ(messages[0].severity, GLOG_INFO);
+  CHECK_EQ(messages[0].text, "binary 42 2.5 text");
+  CHECK_EQ(messages[0].filename, "logging_unittest.cc");
+  CHECK_EQ(messages[0].line, logf_line);
+  CHECK_EQ(messages[0].thread_id, GetTID());
+  CHECK_EQ(messages[1].severity, GLOG_WARNING);
+  CHECK_EQ(messages[1].text, "binary www");
+  CHECK_EQ(messages[2].severity, GLOG_ERROR);
+  CHECK_EQ(messages[2].text, "binary 7");
+  CHECK_EQ(messages[2].line, log_line);
+  CHECK_LE(messages[0].time.timestamp(), messages[2].time.timestamp());
+  CHECK_EQ(messages[3].text, "limited 0");
+  CHECK_EQ(messages[4].text, "Suppressed 2 INFO messages over the rate limit");
+  CHECK_EQ(messages[5].text, "no limit");
+
+  // Releases the binary log file too.
+  LogToStderr();
+  DeleteFiles(dest);
+}
+
+static void TestBinaryLogRolling() {
+  fprintf(stderr, "==== Test binary log rolling\n");
+  const string dest = GetLoggingDirectories()[0] + "/" +
+                      ProgramInvocationShortName() + ".*.log.BINARY.*";
+  DeleteFiles(dest);
+
+  const uint32 saved_max_log_size = FLAGS_max_log_size;
+  const uint32 saved_max_logfile_num = FLAGS_max_logfile_num;
+  const int32 saved_stderrthreshold = FLAGS_stderrthreshold;
+  FLAGS_max_log_size = 1;
+  FLAGS_max_logfile_num = 2;
+  FLAGS_stderrthreshold = GLOG_FATAL;
+  FLAGS_logbinary = true;
+  const string payload(1000, 'x');
+  const int kMessages = 3500;  // Four files' worth.
+  for (int i = 0; i < kMessages; ++i) {
+    LOGF(INFO, "roll {} {}", i, payload);
+  }
+  FlushLogFiles(GLOG_INFO);
+  FLAGS_logbinary = false;
+  FLAGS_stderrthreshold = saved_stderrthreshold;
+  FLAGS_max_logfile_num = saved_max_logfile_num;
+  FLAGS_max_log_size = saved_max_log_size;
+  LogToStderr();
+
+  // Only the newest files are left, each starting with its own header.
+  vector<string> files;
+  GetFiles(dest, &files);
+  CHECK_EQ(files.size(), 2UL);
+  int next = -1;
+  for (const string& filename : files) {
+    FILE* file = fopen(filename.c_str(), "rb");
+    CHECK(file != nullptr) << ": could not open " << filename;
+    BinaryLogReader reader(file);
+    BinaryLogMessage message;
+    while (reader.Next(&message)) {
+      int i;
+      CHECK_EQ(sscanf(message.text.c_str(), "roll %d", &i), 1);
+      if (next != -1) {
+        CHECK_EQ(i, next);
+      }
+      next = i + 1;
+    }
+    fclose(file);
+    CHECK_EQ(reader.error(), "");
+  }
+  CHECK_EQ(next, kMessages);
+  DeleteFiles(dest);
+}
+
+// Writes a log file with *flag set.  The backends fall back to stdio where
+// they are not available; the file must come out the same either way.
+static void TestLogFileBackend(const char* name, bool* flag) {
+  fprintf(stderr, "==== Test %s logging\n", name);
+  const string dest = FLAGS_test_tmpdir + "/logging_test_" + name;
+  DeleteFiles(dest + "*");
+
+  *flag = true;
+  FLAGS_stderrthreshold = GLOG_FATAL;  // LogToStderr() below resets it.
+  SetLogDestination(GLOG_INFO, dest.c_str());
+  const int kMessages = 20000;  // Several buffers' worth.
+  for (int i = 0; i < kMessages; ++i) {
+    LOG(INFO) << "backend message " << i;
+  }
+  FlushLogFiles(GLOG_INFO);
+  // Closing the file waits for pending writes and truncates preallocated
+  // space.
+  LogToStderr();
+  *flag = false;
+
+  vector<string> files;
+  GetFiles(dest + "*", &files);
+  CHECK_EQ(files.size(), 1UL);
+  ifstream in(files[0].c_str());
+  int next = 0;
+  string line;
+  while (getline(in, line)) {
+    CHECK_EQ(line.find('\0'), string::npos);
+    const size_t pos = line.find("backend message ");
+    int i;
+    if (pos != string::npos &&
+        sscanf(line.c_str() + pos, "backend message %d", &i) == 1) {
+      CHECK_EQ(i, next);
+      ++next;
+    }
+  }
+  CHECK_EQ(next, kMessages);
+  DeleteFiles(dest + "*");
+}
+
+static void TestIoUringLogging() {
+  TestLogFileBackend("io_uring", &FLAGS_log_io_uring);
+}
+
+// The kernel may take only part of a chain of writes, or none of it; the
+// rest must still reach the file, in order.
+static void TestIoUringShortSubmit() {
+  fprintf(stderr, "==== Test io_uring short submissions\n");
+  const string path = FLAGS_test_tmpdir + "/logging_test_io_uring_submit";
+  const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  CHECK_NE(fd, -1);
+  std::unique_ptr<UringFileWriter> writer = UringFileWriter::Create(fd);
+  if (writer == nullptr) {
+    fprintf(stderr, "io_uring is not available\n");
+    close(fd);
+    unlink(path.c_str());
+    return;
+  }
+  string expected;
+  auto write_lines = [&writer, &expected](int from, int to) {
+    for (int i = from; i < to; ++i) {
+      const string line = "line " + std::to_string(i) + "\n";
+      expected += line;
+      writer->Write(line.data(), line.size());
+      if (i % 5000 == 0) writer->Flush(i % 10000 == 0);
+    }
+  };
+  auto file_size = [fd]() {
+    struct stat st;
+    CHECK_EQ(fstat(fd, &st), 0);
+    return static_cast<size_t>(st.st_size);
+  };
+
+  UringFileWriter::SetSubmitLimitForTesting(1);
+  write_lines(0, 100000);
+  UringFileWriter::SetSubmitLimitForTesting(0);  // EAGAIN
+  write_lines(100000, 200000);
+  writer->Flush(true);
+  // Flushing again submits what the kernel refused; no more data needed.
+  UringFileWriter::SetSubmitLimitForTesting(-1);
+  for (int i = 0; i < 5000 && file_size() != expected.size(); ++i) {
+    writer->Flush(false);
+    SleepForMilliseconds(1);
+  }
+  CHECK_EQ(file_size(), expected.size());
+  CHECK_EQ(writer->TakeError(), 0);
+
+  // Once every chunk is refused, they are written with write(2).
+  UringFileWriter::SetSubmitLimitForTesting(0);
+  write_lines(200000, 1000000);
+  UringFileWriter::SetSubmitLimitForTesting(-1);
+  // What --log_durability=error waits for before its fdatasync().
+  write_lines(1000000, 1000100);
+  writer->Wait();
+  CHECK_EQ(file_size(), expected.size());
+  writer.reset();
+  close(fd);
+
+  FILE* file = fopen(path.c_str(), "r");
+  CHECK(file != nullptr);
+  CHECK(ReadEntireFile(file) == expected);
+  fclose(file);
+  unlink(path.c_str());
+}
+
+static void TestMmapLogging() {
+  TestLogFileBackend("mmap", &FLAGS_log_mmap);
+}
+
+// A process killed while writing a log file through the mapping leaves
+// little padding, and the next one appends right after its messages.
+static void TestMmapReopenAfterCrash() {
+#if defined(HAVE_SYS_WAIT_H) && defined(HAVE_UNISTD_H) && defined(HAVE_FCNTL)
+  fprintf(stderr, "==== Test mmap logging after an unclean exit\n");
+  const string dest = FLAGS_test_tmpdir + "/logging_test_mmap_crash";
+  DeleteFiles(dest + "*");
+
+  FLAGS_timestamp_in_logfile_name = false;
+  FLAGS_log_mmap = true;
+  FLAGS_stderrthreshold = GLOG_FATAL;  // LogToStderr() below resets it.
+  SetLogDestination(GLOG_INFO, dest.c_str());
+  pid_t pid = fork();
+  CHECK_ERR(pid);
+  if (pid == 0) {
+    LOG(INFO) << "message before the crash";
+    FlushLogFiles(GLOG_INFO);
+    _exit(EXIT_SUCCESS);  // Like kill -9: no destructors.
+  }
+  wait(nullptr);
+  struct stat st;
+  CHECK_ERR(stat(dest.c_str(), &st));
+  CHECK_LE(st.st_size, 64 * 1024);
+
+  LOG(INFO) << "message after the crash";
+  FlushLogFiles(GLOG_INFO);
+  LogToStderr();
+  FLAGS_log_mmap = false;
+  FLAGS_timestamp_in_logfile_name = true;
+
+  FILE* file = fopen(dest.c_str(), "r");
+  CHECK(file != nullptr);
+  const string contents = ReadEntireFile(file);
+  fclose(file);
+  CHECK_EQ(contents.find('\0'), string::npos);
+  const size_t before = contents.find("message before the crash\n");
+  CHECK_NE(before, string::npos);
+  CHECK_LT(before, contents.find("message after the crash\n"));
+  DeleteFiles(dest + "*");
+#endif
+}
+
+static void TestLogCompression() {
+  fprintf(stderr, "==== Test log compression\n");
+  const string dest = FLAGS_test_tmpdir + "/logging_test_compression";
+  DeleteFiles(dest + "*");
+
+  size_t size = 0;
+  {
+    ofstream out(dest.c_str());
+    for (int i = 0; i < 10000; ++i) {
+      out << "I20240101 00:00:00.000000 1234 logging_unittest.cc:42] "
+          << "compressed message " << i << '\n';
+    }
+    size = static_cast<size_t>(out.tellp());
+  }
+  CHECK(LogCompressor::CompressFile(dest));
+
+  vector<string> files;
+  GetFiles(dest + "*", &files);
+  CHECK_EQ(files.size(), 1UL);
+  CHECK_EQ(files[0], dest + LogCompressor::kSuffix);
+  CHECK(LogCompressor::IsCompressedName(files[0]));
+  ifstream in(files[0].c_str(), std::ios::binary);
+  string compressed((std::istreambuf_iterator<char>(in)),
+                    std::istreambuf_iterator<char>());
+  CHECK_GE(compressed.size(), 2UL);
+  CHECK_EQ(compressed.substr(0, 2), "\x1f\x8b");
+  CHECK_LT(compressed.size() * 4, size);
+
+  // An existing compressed file is never replaced.
+  ofstream(dest.c_str()) << "newer message\n";
+  CHECK(!LogCompressor::CompressFile(dest));
+  GetFiles(dest + "*", &files);
+  CHECK_EQ(files.size(), 2UL);
+  DeleteFiles(dest + "*");
+}
+
+// Files rolled over by an earlier process are compressed, too.
+static void TestLeftoverLogCompression() {
+  fprintf(stderr, "==== Test compression of leftover log files\n");
+  const string base = GetLoggingDirectories()[0] + "/logging_test_leftovers";
+  const string dest = base + ".INFO.";
+  DeleteFiles(base + "*");
+
+  // Listed by the symlink name.
+  SetLogSymlink(GLOG_INFO, "logging_test_leftovers");
+  for (int i = 0; i < 2; ++i) {
+    ofstream(dest + std::to_string(i)) << "leftover message " << i << '\n';
+  }
+  // Left by compressions that a crash interrupted.
+  ofstream(dest + "0.gz.tmp") << "partial";
+  ofstream(dest + "removed.gz.tmp") << "partial";
+  FLAGS_log_compress = true;
+  SetLogDestination(GLOG_INFO, dest.c_str());
+  LOG(INFO) << "message after the restart";
+  FlushLogFiles(GLOG_INFO);
+  FLAGS_log_compress = false;
+  // Finishes the queue.
+  LogCompressor::Shutdown();
+
+  vector<string> files;
+  GetFiles(dest + "*" + LogCompressor::kSuffix, &files);
+  CHECK_EQ(files.size(), 2UL);
+  CHECK_EQ(files[0], dest + "0" + LogCompressor::kSuffix);
+  CHECK_EQ(files[1], dest + "1" + LogCompressor::kSuffix);
+  // The current file is not, and no temporary file is left.
+  GetFiles(dest + "*", &files);
+  CHECK_EQ(files.size(), 3UL);
+
+  LogToStderr();
+  SetLogSymlink(GLOG_INFO, ProgramInvocationShortName());
+  DeleteFiles(base + "*");
+}
+
+static const int kGroupCommitThreads = 4;
+static const int kGroupCommitMessagesPerThread = 200;
+
+// Logs numbered errors, each of which asks for an fdatasync().
+class GroupCommitTestThread : public Thread {
+ public:
+  explicit GroupCommitTestThread(int id) : id_(id) {
+    SetJoinable(true);
+    Start();
+  }
+
+ protected:
+  void Run() override {
+    for (int i = 0; i < kGroupCommitMessagesPerThread; ++i) {
+      LOG(ERROR) << "synced message " << id_ << ' ' << i;
+    }
+  }
+
+ private:
+  int id_;
+};
+
+static void TestGroupCommit() {
+  fprintf(stderr, "==== Test group commit\n");
+  const string dest = FLAGS_test_tmpdir + "/logging_test_group_commit";
+  DeleteFiles(dest + "*");
+
+  FLAGS_log_durability = "error";
+  FLAGS_stderrthreshold = GLOG_FATAL;  // LogToStderr() below resets it.
+  SetLogDestination(GLOG_ERROR, dest.c_str());
+  vector<GroupCommitTestThread*> threads;
+  for (int t = 0; t < kGroupCommitThreads; ++t) {
+    threads.push_back(new GroupCommitTestThread(t));
+  }
+  for (auto* thread : threads) {
+    thread->Join();
+    delete thread;
+  }
+  FLAGS_log_durability = "none";
+  LogToStderr();
+
+  // Committed together, but still every message in order.
+  vector<string> files;
+  GetFiles(dest + "*", &files);
+  CHECK_EQ(files.size(), 1UL);
+  ifstream in(files[0].c_str());
+  vector<int> next(kGroupCommitThreads, 0);
+  string line;
+  while (getline(in, line)) {
+    const size_t pos = line.find("synced message ");
+    int id, i;
+    if (pos != string::npos &&
+        sscanf(line.c_str() + pos, "synced message %d %d", &id, &i) == 2) {
+      CHECK_EQ(i, next[id]);
+      ++next[id];
+    }
+  }
+  for (int t = 0; t < kGroupCommitThreads; ++t) {
+    CHECK_EQ(next[t], kGroupCommitMessagesPerThread);
+  }
+  DeleteFiles(dest + "*");
+}
+
+static void TestLoggingStats() {
+  fprintf(stderr, "==== Test logging stats\n");
+  const string dest = FLAGS_test_tmpdir + "/logging_test_stats";
+  DeleteFiles(dest + "*");
+
+  FLAGS_stderrthreshold = GLOG_FATAL;  // LogToStderr() below resets it.
+  SetLogDestination(GLOG_WARNING, dest.c_str());
+  TestLogSinkImpl sink;
+  const LoggingStats before = GetLoggingStats();
+  LOG(WARNING) << "counted";
+  LOG(WARNING) << string(LogMessage::kMaxLogMessageLen, 'x');
+  LOG_TO_SINK_BUT_NOT_TO_LOGFILE(&sink, WARNING) << "sent";
+  const LoggingStats after = GetLoggingStats();
+  LogToStderr();
+
+  const LoggingStats::Severity& severity = after.severity[GLOG_WARNING];
+  const LoggingStats::Severity& severity_before =
+      before.severity[GLOG_WARNING];
+  CHECK_EQ(severity.messages - severity_before.messages, 3);
+  CHECK_EQ(severity.truncated_messages - severity_before.truncated_messages,
+           1);
+  CHECK_EQ(severity.messages, LogMessage::num_messages(GLOG_WARNING));
+  // Both messages, and the file header.
+  const LoggingStats::File& file = after.file[GLOG_WARNING];
+  const LoggingStats::File& file_before = before.file[GLOG_WARNING];
+  CHECK_GT(file.bytes_written - file_before.bytes_written,
+           static_cast<int64>(LogMessage::kMaxLogMessageLen));
+  // WARNING is above --logbuflevel: flushed right away.
+  CHECK_GE(file.flushes - file_before.flushes, 2);
+  CHECK_EQ(file.dropped_messages, file_before.dropped_messages);
+  CHECK_GE(after.sink_sends - before.sink_sends, 1);
+  CHECK_EQ(sink.errors.size(), 1UL);
+  DeleteFiles(dest + "*");
+}
+
+// Returns the line of its LOG() statement.
+static int LogFromSite(int i) {
+  LOG(INFO) << "log site " << i;
+  return __LINE__ - 1;
+}
+
+// Sites need no local static in the expression LOG() and CHECK() expand
+// to: both stay usable in constexpr functions and at namespace scope.
+static constexpr int CheckedIncrement(int i) {
+  CHECK(i >= 0);
+  return i + 1;
+}
+static_assert(CheckedIncrement(1) == 2, "CHECK() in a constexpr function");
+static int log_at_namespace_scope = 0;
+static const int kLoggedAtNamespaceScope =
+    log_at_namespace_scope != 0 ? (LOG(INFO) << "not logged", 1) : 0;
+
+static void TestLogSites() {
+  fprintf(stderr, "==== Test log sites\n");
+  CHECK_EQ(kLoggedAtNamespaceScope, 0);
+  TestLogSinkImpl sink;
+  AddLogSink(&sink);
+  const int line = LogFromSite(0);
+  LogFromSite(1);
+
+  vector<LogSite*> sites;
+  GetLogSites(&sites);
+  const LogSite* site = nullptr;
+  for (const LogSite* s : sites) {
+    if (s->line() == line && strstr(s->file(), "logging_unittest") != nullptr) {
+      CHECK(site == nullptr);
+      site = s;
+    }
+  }
+  CHECK(site != nullptr);
+  CHECK_EQ(site->severity(), GLOG_INFO);
+  CHECK_EQ(site->hits(), 2U);
+  CHECK(site->enabled());
+  const uint64 bytes = site->bytes();
+  CHECK_GT(bytes, 2 * strlen("log site 0\n"));
+
+  CHECK_EQ(SetLogSitesEnabled("unittest.cc", line, false), 0);
+  CHECK_EQ(SetLogSitesEnabled("logging_unittest.cc", line, false), 1);
+  CHECK(!site->enabled());
+  LogFromSite(2);
+  CHECK_EQ(site->hits(), 3U);
+  CHECK_EQ(site->bytes(), bytes);
+
+  CHECK_EQ(SetLogSitesEnabled("logging_unittest.cc", line, true), 1);
+  LogFromSite(3);
+  CHECK_EQ(site->hits(), 4U);
+  CHECK_GT(site->bytes(), bytes);
+  RemoveLogSink(&sink);
+
+  CHECK_EQ(sink.errors.size(), 3UL);
+  CHECK(sink.errors[2].find("log site 3") != string::npos);
+}
+
+// Whether a message of this severity is formatted at all.
+static bool IsLogFormatted(LogSeverity severity) {
+  LogMessage message(__FILE__, __LINE__, severity);
+  const bool formatted = message.stream().good();
+  message.stream() << "severity mask";
+  return formatted;
+}
+
+static void TestSeverityMask() {
+  fprintf(stderr, "==== Test severity mask\n");
+  // LogToStderr() turned off the log files; only stderr is left.
+  const int32 saved_stderrthreshold = FLAGS_stderrthreshold;
+  FLAGS_stderrthreshold = GLOG_ERROR;
+  CHECK(!IsLogFormatted(GLOG_INFO));
+  CHECK(IsLogFormatted(GLOG_ERROR));
+
+  TestLogSinkImpl sink;
+  AddLogSink(&sink);
+  CHECK(IsLogFormatted(GLOG_INFO));
+  RemoveLogSink(&sink);
+  CHECK(!IsLogFormatted(GLOG_INFO));
+  CHECK_EQ(sink.errors.size(), 1UL);
+
+  FLAGS_stderrthreshold = saved_stderrthreshold;
+  CHECK(IsLogFormatted(GLOG_INFO));
+  FLAGS_minloglevel = GLOG_WARNING;
+  CHECK(!IsLogFormatted(GLOG_INFO));
+  CHECK(IsLogFormatted(GLOG_WARNING));
+  FLAGS_minloglevel = GLOG_INFO;
+}
+
 struct MyLogger : public base::Logger {
   string data;
 
@@ -1148,6 +1947,14 @@ TEST(SafeFNMatch, logging) {
   CHECK(WrapSafeFNMatch("ba?/*", "bar/"));
   CHECK(!WrapSafeFNMatch("ba?/?", "bar/"));
   CHECK(!WrapSafeFNMatch("ba?/*", "bar"));
+  CHECK(WrapSafeFNMatch("ba?/**", "bar/"));
+  CHECK(WrapSafeFNMatch("*", ""));
+  CHECK(WrapSafeFNMatch("**", ""));
+  // Exponential for a recursive matcher.
+  CHECK(!WrapSafeFNMatch("*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*b",
+                         string(100, 'a')));
+  CHECK(WrapSafeFNMatch("*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*b",
+                        string(100, 'a') + "b"));
 }
 
 // TestWaitingLogSink will save messages here
@@ -1312,6 +2119,76 @@ static void TestLogSinkWaitTillSent() {
 #endif
 }
 
+// Holds up send() until Open() is called.
+class GatedLogSink : public LogSink {
+ public:
+  void send(LogSeverity /* severity */, const char* /* full_filename */,
+            const char* /* base_filename */, int /* line */,
+            const LogMessageTime& /* logmsgtime */, const char* message,
+            size_t message_len) override {
+    mutex_.Lock();
+    ++entered_;
+    while (!open_) {
+      mutex_.Unlock();
+      SleepForMilliseconds(1);
+      mutex_.Lock();
+    }
+    messages_.emplace_back(message, message_len);
+    mutex_.Unlock();
+  }
+
+  void Open() {
+    MutexLock l(&mutex_);
+    open_ = true;
+  }
+
+  // Waits until send() has been called.
+  void WaitForSend() {
+    mutex_.Lock();
+    while (entered_ == 0) {
+      mutex_.Unlock();
+      SleepForMilliseconds(1);
+      mutex_.Lock();
+    }
+    mutex_.Unlock();
+  }
+
+  vector<string> messages() {
+    MutexLock l(&mutex_);
+    return messages_;
+  }
+
+ private:
+  Mutex mutex_;
+  bool open_{false};
+  int entered_{0};
+  vector<string> messages_;
+};
+
+TEST(AsyncLogSink, logging) {
+  GatedLogSink gated;
+  AsyncLogSink::Options options;
+  options.max_queued_messages = 2;
+  options.overflow_policy = AsyncLogSink::kDropOldestWhenFull;
+  AsyncLogSink sink(&gated, options);
+
+  // While the sink is stuck in send(), logging still goes on.
+  LOG_TO_SINK_BUT_NOT_TO_LOGFILE(&sink, INFO) << "async 0";
+  gated.WaitForSend();
+  for (int i = 1; i <= 4; ++i) {
+    LOG_TO_SINK_BUT_NOT_TO_LOGFILE(&sink, INFO) << "async " << i;
+  }
+  EXPECT_EQ(sink.dropped_messages(), 2U);
+
+  gated.Open();
+  sink.Flush();
+  const vector<string> messages = gated.messages();
+  EXPECT_EQ(messages.size(), 3U);
+  EXPECT_EQ(messages[0], "async 0");
+  EXPECT_EQ(messages[1], "async 3");
+  EXPECT_EQ(messages[2], "async 4");
+}
+
 TEST(Strerror, logging) {
   int errcode = EINTR;
   char *msg = strdup(strerror(errcode));
@@ -1491,6 +2368,367 @@ TEST(UserDefinedClass, logging) {
   CHECK_EQ(u, u);
 }
 
+// Collects the text of every message it is sent.
+class MessageTextSink : public LogSink {
+ public:
+  MessageTextSink() { AddLogSink(this); }
+  ~MessageTextSink() override { RemoveLogSink(this); }
+  void send(LogSeverity /* severity */, const char* /* full_filename */,
+            const char* /* base_filename */, int /* line */,
+            const LogMessageTime& /* logmsgtime */, const char* message,
+            size_t message_len) override {
+    messages.emplace_back(message, message_len);
+  }
+  vector<string> messages;
+};
+
+TEST(LOGF, MatchesStreamOutput) {
+  MessageTextSink sink;
+  const string str = "string";
+  const char* null_str = nullptr;
+  int value = 42;
+  LOGF(INFO, "{} {} {} {} {} {}", value, -7L, 18446744073709551615ULL, true,
+       'c', static_cast<unsigned char>('u'));
+  LOGF(INFO, "{}|{}|{}|{}", 2.5, 1.0f / 3, 1e300, -0.0);
+  LOGF(INFO, "{} {} {}", str, "literal", null_str);
+  LOGF(INFO, "{{{}}} }}{{", UserDefinedClass());
+  LOGF(INFO, "{}", &value);
+  LOGF_IF(INFO, false, "not logged");
+  LOGF(INFO, "no arguments");
+
+  std::ostringstream pointer;
+  pointer << &value;
+  EXPECT_EQ(6U, sink.messages.size());
+  EXPECT_EQ("42 -7 18446744073709551615 1 c u", sink.messages[0]);
+  EXPECT_EQ("2.5|0.333333|1e+300|-0", sink.messages[1]);
+  EXPECT_EQ("string literal (null)", sink.messages[2]);
+  EXPECT_EQ("{OK} }{", sink.messages[3]);
+  EXPECT_EQ(pointer.str(), sink.messages[4]);
+  EXPECT_EQ("no arguments", sink.messages[5]);
+}
+
+TEST(LOGF, NullStringLikeStream) {
+  MessageTextSink sink;
+  const char* null_str = nullptr;
+  char* mutable_null_str = nullptr;
+  LOGF(INFO, "a {} b", null_str);
+  LOG(INFO) << "a " << null_str << " b";
+  LOG(INFO) << "a " << mutable_null_str << " b";
+  {
+    // Through std::ostream.
+    LogMessage message(__FILE__, __LINE__, GLOG_INFO);
+    message.stream().setf(std::ios_base::hex, std::ios_base::basefield);
+    message.stream() << "a " << null_str << " b";
+  }
+  EXPECT_EQ(4U, sink.messages.size());
+  for (const string& message : sink.messages) {
+    EXPECT_EQ("a (null) b", message);
+  }
+}
+
+struct CountsPrinting {
+  int* printed;
+};
+
+inline ostream& operator<<(ostream& out, const CountsPrinting& value) {
+  ++*value.printed;
+  return out << "printed";
+}
+
+TEST(LOGF, SkipsDroppedMessages) {
+  MessageTextSink sink;
+  int printed = 0;
+  const int32 saved_minloglevel = FLAGS_minloglevel;
+  FLAGS_minloglevel = GLOG_WARNING;
+  LOGF(INFO, "{} {}", CountsPrinting{&printed}, 42);
+  FLAGS_minloglevel = saved_minloglevel;
+  EXPECT_EQ(0, printed);
+  EXPECT_EQ(0U, sink.messages.size());
+
+  LOGF(INFO, "{} {}", CountsPrinting{&printed}, 42);
+  EXPECT_EQ(1, printed);
+  EXPECT_EQ(1U, sink.messages.size());
+  EXPECT_EQ("printed 42", sink.messages[0]);
+}
+
+TEST(LOGF, TruncatesLongMessages) {
+  MessageTextSink sink;
+  const string chunk(LogMessage::kMaxLogMessageLen / 2 - 100, 'x');
+  LOGF(INFO, "{}{}{}{}", chunk, chunk, chunk, 12345);
+  EXPECT_EQ(1U, sink.messages.size());
+  // Cut off in the third chunk, before the number.
+  EXPECT_GT(sink.messages[0].size(), 2 * chunk.size());
+  EXPECT_LT(sink.messages[0].size(), 3 * chunk.size());
+  EXPECT_EQ(string::npos, sink.messages[0].find_first_not_of('x'));
+}
+
+TEST(LogEveryNApprox, LogsOncePerPeriod) {
+  MessageTextSink sink;
+  for (int i = 0; i < 640; ++i) {
+    LOG_EVERY_N_APPROX(INFO, 64) << "hit " << COUNTER;
+  }
+  // A single thread adds its hits every 64 / 16 hits, which happen to
+  // line up with the period.
+  EXPECT_EQ(10U, sink.messages.size());
+  EXPECT_EQ("hit 1", sink.messages[0]);
+  EXPECT_EQ("hit 65", sink.messages[1]);
+  EXPECT_EQ("hit 577", sink.messages[9]);
+}
+
+TEST(LogFirstN, StopsCounting) {
+  MessageTextSink sink;
+  for (int i = 0; i < 10; ++i) {
+    LOG_FIRST_N(INFO, 3) << "first " << COUNTER;
+  }
+  EXPECT_EQ(3U, sink.messages.size());
+  EXPECT_EQ("first 3", sink.messages[2]);
+}
+
+TEST(LogRateLimited, SuppressesAndCounts) {
+  MessageTextSink sink;
+  for (int i = 0; i < 2; ++i) {
+    for (int j = 0; j < 10; ++j) {
+      LOG_RATE_LIMITED(INFO, 20, 1) << "limited " << i << ' ' << j;
+    }
+    // Refills the bucket.
+    SleepForMilliseconds(100);
+  }
+  EXPECT_EQ(3U, sink.messages.size());
+  EXPECT_EQ("limited 0 0", sink.messages[0]);
+  EXPECT_EQ(0U, sink.messages[1].find(
+                    "Suppressed 9 messages from logging_unittest.cc:"));
+  EXPECT_EQ("limited 1 0", sink.messages[2]);
+}
+
+TEST(LogRateLimited, ReportsWhenQuiet) {
+  // Reports what earlier tests left suppressed before we start counting.
+  FlushLogFiles(GLOG_INFO);
+  MessageTextSink sink;
+  for (int i = 0; i < 5; ++i) {
+    LOG_RATE_LIMITED(INFO, 20, 1) << "quiet " << i;
+  }
+  // Not yet: the bucket is still empty.
+  FlushLogFiles(GLOG_INFO);
+  EXPECT_EQ(1U, sink.messages.size());
+  SleepForMilliseconds(100);
+  FlushLogFiles(GLOG_INFO);
+  EXPECT_EQ(2U, sink.messages.size());
+  EXPECT_EQ("quiet 0", sink.messages[0]);
+  EXPECT_EQ(0U, sink.messages[1].find(
+                    "Suppressed 4 messages from logging_unittest.cc:"));
+}
+
+TEST(SetLogRateLimit, SuppressesAndCounts) {
+  MessageTextSink sink;
+  SetLogRateLimit(GLOG_INFO, 0.001, 2);
+  for (int i = 0; i < 5; ++i) {
+    LOG(INFO) << "limited " << i;
+  }
+  LOG(WARNING) << "not limited";
+  SetLogRateLimit(GLOG_INFO, 0, 0);
+  LOG(INFO) << "no limit";
+  EXPECT_EQ(5U, sink.messages.size());
+  EXPECT_EQ("limited 1", sink.messages[1]);
+  EXPECT_EQ("not limited", sink.messages[2]);
+  EXPECT_EQ("Suppressed 3 INFO messages over the rate limit",
+            sink.messages[3]);
+  EXPECT_EQ("no limit", sink.messages[4]);
+}
+
+TEST(LogRepeatWindow, CollapsesRepeatedMessages) {
+  MessageTextSink sink;
+  FLAGS_log_repeat_window_ms = 60000;
+  for (int i = 0; i < 5; ++i) {
+    LOG(INFO) << "retrying";
+  }
+  for (int i = 0; i < 3; ++i) {
+    LOG(INFO) << "attempt " << i;
+  }
+  LOG(INFO) << "done";
+  FLAGS_log_repeat_window_ms = 0;
+  EXPECT_EQ(6U, sink.messages.size());
+  EXPECT_EQ("retrying", sink.messages[0]);
+  EXPECT_EQ("Last message repeated 4 times", sink.messages[1]);
+  EXPECT_EQ("attempt 0", sink.messages[2]);
+  EXPECT_EQ("attempt 1", sink.messages[3]);
+  EXPECT_EQ("attempt 2", sink.messages[4]);
+  EXPECT_EQ("done", sink.messages[5]);
+}
+
+static void LogRetrying() {
+  LOG(INFO) << "retrying";
+}
+
+TEST(LogRepeatWindow, ReportsRepeatsOfExitedThread) {
+  MessageTextSink sink;
+  FLAGS_log_repeat_window_ms = 60000;
+  LogEveryNThread thread(&LogRetrying, 3);
+  thread.Start();
+  thread.Join();
+  FLAGS_log_repeat_window_ms = 0;
+  EXPECT_EQ(2U, sink.messages.size());
+  EXPECT_EQ("retrying", sink.messages[0]);
+  EXPECT_EQ("Last message repeated 2 times", sink.messages[1]);
+}
+
+TEST(LogRepeatWindow, ReportsRepeatsWhenWindowExpires) {
+  MessageTextSink sink;
+  FLAGS_log_repeat_window_ms = 200;
+  for (int i = 0; i < 3; ++i) {
+    LogRetrying();
+  }
+  SleepForMilliseconds(300);
+  FlushLogFiles(GLOG_INFO);
+  EXPECT_EQ(2U, sink.messages.size());
+  EXPECT_EQ("retrying", sink.messages[0]);
+  EXPECT_EQ("Last message repeated 2 times", sink.messages[1]);
+  // A new window starts.
+  LogRetrying();
+  LOG(INFO) << "done";
+  FLAGS_log_repeat_window_ms = 0;
+  EXPECT_EQ(4U, sink.messages.size());
+  EXPECT_EQ("Last message repeated 1 time", sink.messages[2]);
+  EXPECT_EQ("done", sink.messages[3]);
+}
+
+TEST(LogStream, MatchesOstream) {
+  char buffer[256];
+  LogMessage::LogStream stream(buffer, sizeof(buffer), 0);
+  std::ostringstream expected;
+  int value = 42;
+  const string str = "string";
+  stream << -7 << ' ' << 18446744073709551615ULL << ' ' << true << 'c'
+         << static_cast<unsigned char>('u') << ' ' << 2.5 << ' ' << 1.0f / 3
+         << ' ' << 1e300 << ' ' << -0.0 << ' ' << "literal " << str << ' '
+         << &value << ' ' << static_cast<void*>(nullptr);
+  expected << -7 << ' ' << 18446744073709551615ULL << ' ' << true << 'c'
+           << static_cast<unsigned char>('u') << ' ' << 2.5 << ' ' << 1.0f / 3
+           << ' ' << 1e300 << ' ' << -0.0 << ' ' << "literal " << str << ' '
+           << &value << ' ' << static_cast<void*>(nullptr);
+  // Non-default flags go through std::ostream.
+  stream.setf(std::ios_base::hex, std::ios_base::basefield);
+  stream << static_cast<short>(-1);
+  expected.setf(std::ios_base::hex, std::ios_base::basefield);
+  expected << static_cast<short>(-1);
+  EXPECT_EQ(expected.str(), string(stream.str(), stream.pcount()));
+}
+
+TEST(LogMessage, GrowsPastInlineBuffer) {
+  MessageTextSink sink;
+  // Written a few bytes at a time, through several larger buffers.
+  string expected;
+  {
+    LogMessage message(__FILE__, __LINE__, GLOG_INFO);
+    for (int i = 0; i < 2000; ++i) {
+      message.stream() << i << ' ';
+      expected += std::to_string(i) + ' ';
+    }
+  }
+  const string chunk(5000, 'y');
+  LOGF(INFO, "{}{}", chunk, chunk);
+  EXPECT_EQ(2U, sink.messages.size());
+  EXPECT_EQ(expected, sink.messages[0]);
+  EXPECT_EQ(chunk + chunk, sink.messages[1]);
+}
+
+// Records the numbers of the "sink list <n>" messages it gets, and counts
+// the calls that come after RemoveLogSink() has returned.
+class SinkListTestSink : public LogSink {
+ public:
+  void send(LogSeverity /* severity */, const char* /* full_filename */,
+            const char* /* base_filename */, int /* line */,
+            const LogMessageTime& /* logmsgtime */, const char* message,
+            size_t message_len) override {
+    if (removed) {
+      ++calls_after_removal;
+    }
+    const string text(message, message_len);
+    if (text.compare(0, 10, "sink list ") == 0) {
+      numbers.push_back(atoi(text.c_str() + 10));
+      received = numbers.size();
+    }
+  }
+  vector<int> numbers;
+  // Messages logged before AddLogSink() returned, and before RemoveLogSink()
+  // was called.
+  int logged_before_add{0};
+  int logged_before_remove{0};
+  std::atomic<size_t> received{0};
+  std::atomic<bool> removed{false};
+  std::atomic<int> calls_after_removal{0};
+};
+
+class SinkListLogThread : public Thread {
+ public:
+  explicit SinkListLogThread(int n) : n_(n) { SetJoinable(true); }
+  // The number of messages logged so far.
+  std::atomic<int> logged{0};
+  std::atomic<bool> done{false};
+
+ protected:
+  void Run() override {
+    for (int i = 0; i < n_; ++i) {
+      LOG(INFO) << "sink list " << i;
+      logged = i + 1;
+    }
+    done = true;
+  }
+
+ private:
+  int n_;
+};
+
+TEST(LogSink, AddAndRemoveWhileLogging) {
+  const int kMessages = 20000;
+  SinkListTestSink all;
+  AddLogSink(&all);
+  SinkListLogThread logger(kMessages);
+  logger.Start();
+  vector<std::unique_ptr<SinkListTestSink>> removed;
+  do {
+    std::unique_ptr<SinkListTestSink> sink(new SinkListTestSink);
+    AddLogSink(sink.get());
+    sink->logged_before_add = logger.logged;
+    while (sink->received < 2 && !logger.done) {
+      std::this_thread::yield();
+    }
+    sink->logged_before_remove = logger.logged;
+    RemoveLogSink(sink.get());
+    sink->removed = true;
+    removed.push_back(std::move(sink));
+  } while (!logger.done);
+  logger.Join();
+  RemoveLogSink(&all);
+  all.removed = true;
+  LOG(INFO) << "sink list " << kMessages;
+
+  // The sink registered throughout got every message, in order.
+  EXPECT_EQ(static_cast<size_t>(kMessages), all.numbers.size());
+  for (size_t i = 0; i < all.numbers.size(); ++i) {
+    EXPECT_EQ(static_cast<int>(i), all.numbers[i]);
+  }
+  // The others got every message logged while they were registered, and
+  // none after they were removed.  The message being logged while
+  // AddLogSink() returned may or may not have reached them.
+  EXPECT_TRUE(!removed.empty());
+  for (const auto& sink : removed) {
+    for (size_t i = 1; i < sink->numbers.size(); ++i) {
+      EXPECT_EQ(sink->numbers[i - 1] + 1, sink->numbers[i]);
+    }
+    const int first = sink->logged_before_add + 1;
+    const int last = sink->logged_before_remove - 1;
+    if (first <= last) {
+      EXPECT_TRUE(!sink->numbers.empty());
+      if (!sink->numbers.empty()) {
+        EXPECT_TRUE(sink->numbers.front() <= first);
+        EXPECT_TRUE(sink->numbers.back() >= last);
+      }
+    }
+    EXPECT_EQ(0, sink->calls_after_removal);
+  }
+  EXPECT_EQ(0, all.calls_after_removal);
+}
+
 TEST(LogMsgTime, gmtoff) {
   /*
    * Unit test for GMT offset API
@@ -1505,6 +2743,94 @@ TEST(LogMsgTime, gmtoff) {
   EXPECT_TRUE( (nGmtOff >= utc_min_offset) && (nGmtOff <= utc_max_offset) );
 }
 
+TEST(LogMsgTime, CachedMinute) {
+  // Times within one minute reuse the broken-down time of the previous
+  // message; they must still match a fresh localtime_r().
+  const time_t start = time(nullptr) / 60 * 60 - 600;
+  for (time_t t = start; t < start + 150; t += 7) {
+    google::LogMessageTime logmsgtime(t, static_cast<google::WallTime>(t) + 0.25);
+    std::tm expected;
+    localtime_r(&t, &expected);
+    EXPECT_EQ(expected.tm_year, logmsgtime.year());
+    EXPECT_EQ(expected.tm_mon, logmsgtime.month());
+    EXPECT_EQ(expected.tm_mday, logmsgtime.day());
+    EXPECT_EQ(expected.tm_hour, logmsgtime.hour());
+    EXPECT_EQ(expected.tm_min, logmsgtime.minute());
+    EXPECT_EQ(expected.tm_sec, logmsgtime.sec());
+    EXPECT_EQ(250000, logmsgtime.usec());
+    EXPECT_EQ(t, logmsgtime.timestamp());
+  }
+}
+
+_START_GOOGLE_NAMESPACE_
+namespace glog_internal_namespace_ {
+extern  // in logging.cc
+void AppendDefaultPrefix(std::streambuf* buf, LogSeverity severity,
+                         const LogMessageTime& time, unsigned int tid,
+                         const char* basename, int line);
+} // namespace glog_internal_namespace_
+using glog_internal_namespace_::AppendDefaultPrefix;
+_END_GOOGLE_NAMESPACE_
+
+// The prefix as LogMessage::Init() used to build it with iostream
+// manipulators.
+static string StreamLogPrefix(LogSeverity severity,
+                              const google::LogMessageTime& time,
+                              unsigned int tid, const char* basename,
+                              int line) {
+  std::ostringstream out;
+  out << setfill('0') << LogSeverityNames[severity][0];
+  if (FLAGS_log_year_in_prefix) {
+    out << setw(4) << 1900 + time.year();
+  }
+  out << setw(2) << 1 + time.month() << setw(2) << time.day() << ' '
+      << setw(2) << time.hour() << ':' << setw(2) << time.minute() << ':'
+      << setw(2) << time.sec() << "." << setw(6) << time.usec() << ' '
+      << setfill(' ') << setw(5) << tid << setfill('0') << ' ' << basename
+      << ':' << line << "] ";
+  return out.str();
+}
+
+TEST(LogPrefix, MatchesStreamFormatting) {
+  FlagSaver saver;
+  struct {
+    int year, month, day, hour, minute, sec;
+    time_t timestamp;
+    int32 usec;
+  } const times[] = {
+    {123, 0, 2, 3, 4, 5, 1672628645, 0},
+    {99, 11, 31, 23, 59, 59, 946684799, 999999},
+    {133, 4, 18, 3, 33, 20, 2000000000, 123},
+  };
+  const unsigned int tids[] = {0, 1, 4321, 54321, 1234567, 4294967295U};
+  const int lines[] = {0, 1, 4096, -1, 2147483647, -2147483647 - 1};
+  for (bool with_year : {false, true}) {
+    FLAGS_log_year_in_prefix = with_year;
+    for (const auto& t : times) {
+      std::tm tm = {};
+      tm.tm_year = t.year;
+      tm.tm_mon = t.month;
+      tm.tm_mday = t.day;
+      tm.tm_hour = t.hour;
+      tm.tm_min = t.minute;
+      tm.tm_sec = t.sec;
+      const google::LogMessageTime time(tm, t.timestamp, t.usec, 0);
+      for (int severity = 0; severity < NUM_SEVERITIES; ++severity) {
+        for (unsigned int tid : tids) {
+          for (int line : lines) {
+            std::ostringstream out;
+            AppendDefaultPrefix(out.rdbuf(), severity, time, tid,
+                                "logging_unittest.cc", line);
+            EXPECT_EQ(StreamLogPrefix(severity, time, tid,
+                                      "logging_unittest.cc", line),
+                      out.str());
+          }
+        }
+      }
+    }
+  }
+}
+
 #if 0  // Mgt. Decision: permanently disabled feature: no mailing logging or
        // anything. Hard Removal enforced. [GHo]
 
@@ -0,0 +1,188 @@
+// Copyright (c) 2024, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "mmap_file_writer.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "utilities.h"
+
+#ifdef GLOG_OS_LINUX
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+#endif
+
+_START_GOOGLE_NAMESPACE_
+
+bool MmapFileWriter::forked() const {
+  return ForkGeneration() != fork_generation_;
+}
+
+#ifdef GLOG_OS_LINUX
+
+namespace {
+
+// The end of the file runs ahead of the data by less than this, so that
+// tail -f and log shippers see little padding if the process dies.
+const size_t kSizeStep = 64 * 1024;
+
+}  // namespace
+
+std::unique_ptr<MmapFileWriter> MmapFileWriter::Create(int fd,
+                                                       size_t segment_size) {
+  struct stat st;
+  if (fstat(fd, &st) == -1) return nullptr;
+  const auto size = static_cast<size_t>(st.st_size);
+  // Without real preallocation, a full disk would raise SIGBUS in the
+  // middle of a memcpy.  Hence no ftruncate() fallback.  The blocks are
+  // allocated now, but the file only grows as it is written: see Extend().
+  if (fallocate(fd, FALLOC_FL_KEEP_SIZE, static_cast<off_t>(size),
+                static_cast<off_t>(segment_size)) != 0) {
+    return nullptr;
+  }
+  const size_t mapped = size + segment_size;
+  void* map =
+      mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    return nullptr;
+  }
+  // A process killed while writing the file left the padding up to its
+  // end of file: continue after the last message, which ends in '\n'.
+  // Older versions padded with a whole segment, hence the plain scan.
+  const char* data = static_cast<const char*>(map);
+  size_t length = size;
+  while (length > 0 && data[length - 1] == '\0') {
+    --length;
+  }
+  if (length != size && ftruncate(fd, static_cast<off_t>(length)) != 0) {
+    length = size;  // Keep the padding rather than write past the end.
+  }
+  return std::unique_ptr<MmapFileWriter>(new MmapFileWriter(
+      fd, static_cast<char*>(map), mapped, length, segment_size));
+}
+
+MmapFileWriter::MmapFileWriter(int fd, char* map, size_t mapped,
+                               size_t length, size_t segment_size)
+    : fd_(fd),
+      fork_generation_(ForkGeneration()),
+      segment_size_(segment_size),
+      map_(map),
+      mapped_(mapped),
+      size_(length),
+      length_(length),
+      flushed_(length) {}
+
+MmapFileWriter::~MmapFileWriter() {
+  munmap(map_, mapped_);
+  // The parent still writes to the preallocated space.
+  if (forked()) return;
+  if (ftruncate(fd_, static_cast<off_t>(length_)) != 0) {
+    // The file keeps its padding; nothing else to do about it.
+  }
+}
+
+int MmapFileWriter::Write(const char* data, size_t size) {
+  if (size > mapped_ - length_ && !Grow(size)) {
+    return ENOSPC;
+  }
+  if (length_ + size > size_ && !Extend(length_ + size)) {
+    return ENOSPC;
+  }
+  memcpy(map_ + length_, data, size);
+  length_ += size;
+  return 0;
+}
+
+bool MmapFileWriter::Grow(size_t size) {
+  // Only time-based rolling or a message straddling --max_log_size gets
+  // here.
+  const size_t extra = std::max(size, segment_size_);
+  if (fallocate(fd_, FALLOC_FL_KEEP_SIZE, static_cast<off_t>(mapped_),
+                static_cast<off_t>(extra)) != 0) {
+    return false;
+  }
+  void* map = mremap(map_, mapped_, mapped_ + extra, MREMAP_MAYMOVE);
+  if (map == MAP_FAILED) {
+    return false;
+  }
+  map_ = static_cast<char*>(map);
+  mapped_ += extra;
+  return true;
+}
+
+bool MmapFileWriter::Extend(size_t end) {
+  // Within the preallocated blocks: no allocation, just the size.
+  const size_t size = std::min((end + kSizeStep - 1) / kSizeStep * kSizeStep,
+                               mapped_);
+  if (ftruncate(fd_, static_cast<off_t>(size)) != 0) {
+    return false;
+  }
+  size_ = size;
+  return true;
+}
+
+void MmapFileWriter::Flush() {
+  if (flushed_ == length_) return;
+  // The data is visible to readers of the file already; this only starts
+  // writing it back.  msync(MS_ASYNC) would not: Linux leaves that to the
+  // flusher threads.  The mapping starts at offset 0 of the file.
+  const auto page_size = static_cast<size_t>(getpagesize());
+  const size_t start = flushed_ & ~(page_size - 1);
+  sync_file_range(fd_, static_cast<off_t>(start),
+                  static_cast<off_t>(length_ - start), SYNC_FILE_RANGE_WRITE);
+  flushed_ = length_;
+}
+
+void MmapFileWriter::DropPages(size_t offset, size_t size) {
+  // Dirty pages of a shared mapping stay in the page cache: this only
+  // shrinks the resident set.
+  madvise(map_ + offset, std::min(size, mapped_ - offset), MADV_DONTNEED);
+}
+
+#else  // GLOG_OS_LINUX
+
+std::unique_ptr<MmapFileWriter> MmapFileWriter::Create(
+    int /*fd*/, size_t /*segment_size*/) {
+  return nullptr;
+}
+
+MmapFileWriter::~MmapFileWriter() = default;
+int MmapFileWriter::Write(const char* /*data*/, size_t /*size*/) {
+  return 0;
+}
+void MmapFileWriter::Flush() {}
+void MmapFileWriter::DropPages(size_t /*offset*/, size_t /*size*/) {}
+
+#endif  // GLOG_OS_LINUX
+
+_END_GOOGLE_NAMESPACE_
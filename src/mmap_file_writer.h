@@ -0,0 +1,104 @@
+// Copyright (c) 2024, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Writes log files through a shared memory mapping (--log_mmap).
+//
+// The file's blocks are preallocated with fallocate() up front, so a write
+// is a memcpy: no stdio buffer, no extent allocation, and only every 64 KiB
+// a system call that moves the end of the file.  Flush() starts writeback
+// with sync_file_range(), and the file is truncated to what was written when the
+// writer is destroyed.  A process that dies without that leaves at most
+// 64 KiB of NUL bytes at the end of the file, which the next writer for
+// the file drops again.
+
+#ifndef GLOG_MMAP_FILE_WRITER_H_
+#define GLOG_MMAP_FILE_WRITER_H_
+
+#include "config.h"
+
+#include <cstddef>
+#include <memory>
+
+#include "glog/logging.h"
+
+_START_GOOGLE_NAMESPACE_
+
+// Not thread-safe: LogFileObject calls it with its lock held.
+class MmapFileWriter {
+ public:
+  // Preallocates segment_size bytes past the end of fd and maps the file.
+  // Writes go after the last byte that is not NUL.  Returns nullptr if
+  // that fails: not Linux, a filesystem without fallocate(), or not enough
+  // space.
+  static std::unique_ptr<MmapFileWriter> Create(int fd, size_t segment_size);
+
+  // Unmaps the file and truncates it to the bytes written, unless the
+  // process forked since.  Does not close the file.
+  ~MmapFileWriter();
+
+  // Returns 0, or ENOSPC if another segment was needed and could not be
+  // preallocated; then the message is dropped.
+  int Write(const char* data, size_t size);
+
+  // Starts writeback of what was written since the last call.
+  void Flush();
+
+  // Drops the pages of [offset, offset + size) from the mapping, once
+  // they are in the page cache.  offset must be page aligned.
+  void DropPages(size_t offset, size_t size);
+
+  // True in the child after fork(): the mapping is shared with the
+  // parent, so the writer must not be used any more, only destroyed.
+  bool forked() const;
+
+ private:
+  MmapFileWriter(int fd, char* map, size_t mapped, size_t length,
+                 size_t segment_size);
+
+  // Makes room for size more bytes.
+  bool Grow(size_t size);
+  // Moves the end of the file to at least end.
+  bool Extend(size_t end);
+
+  const int fd_;
+  const uint32 fork_generation_;
+  const size_t segment_size_;
+  char* map_;
+  size_t mapped_;   // Bytes preallocated and mapped.
+  size_t size_;     // The size of the file; at most mapped_.
+  size_t length_;   // Bytes written.
+  size_t flushed_;  // Bytes handed to sync_file_range().
+
+  MmapFileWriter(const MmapFileWriter&) = delete;
+  MmapFileWriter& operator=(const MmapFileWriter&) = delete;
+};
+
+_END_GOOGLE_NAMESPACE_
+
+#endif  // GLOG_MMAP_FILE_WRITER_H_
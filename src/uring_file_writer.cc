@@ -0,0 +1,449 @@
+// Copyright (c) 2024, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "uring_file_writer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+
+#include "utilities.h"
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_SYS_SYSCALL_H)
+# include <fcntl.h>
+# include <linux/io_uring.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# include <sys/uio.h>
+# include <unistd.h>
+// IORING_FEAT_NODROP came with Linux 5.5; everything used here is older.
+# if defined(__NR_io_uring_setup) && defined(IORING_FEAT_NODROP)
+#  define GLOG_HAVE_IO_URING
+# endif
+#endif
+
+_START_GOOGLE_NAMESPACE_
+
+bool UringFileWriter::forked() const {
+  return ForkGeneration() != fork_generation_;
+}
+
+#ifdef GLOG_HAVE_IO_URING
+
+namespace {
+
+// Chunks are allocated while writes are slow, up to kMaxChunks; only
+// then does Write() wait for the disk.
+const size_t kChunkSize = 256 * 1024;
+const size_t kMaxChunks = 32;
+// Room for a chain of all chunks and its fdatasync().
+const unsigned kRingEntries = 64;
+
+// See SetSubmitLimitForTesting().
+std::atomic<int> submit_limit{-1};
+
+int SysIoUringSetup(unsigned entries, io_uring_params* params) {
+  return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int SysIoUringEnter(int ring_fd, unsigned to_submit, unsigned min_complete,
+                    unsigned flags) {
+  return static_cast<int>(syscall(__NR_io_uring_enter, ring_fd, to_submit,
+                                  min_complete, flags, nullptr, 0));
+}
+
+void* MapRing(int ring_fd, size_t size, off_t offset) {
+  return mmap(nullptr, size, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+}
+
+}  // namespace
+
+struct UringFileWriter::Ring {
+  int fd{-1};
+  void* sq_ring{MAP_FAILED};
+  size_t sq_ring_size{0};
+  void* cq_ring{MAP_FAILED};  // May be sq_ring.
+  size_t cq_ring_size{0};
+  io_uring_sqe* sqes{static_cast<io_uring_sqe*>(MAP_FAILED)};
+  size_t sqes_size{0};
+
+  unsigned* sq_head{nullptr};
+  unsigned* sq_tail{nullptr};
+  unsigned sq_mask{0};
+  unsigned* sq_array{nullptr};
+  unsigned* cq_head{nullptr};
+  unsigned* cq_tail{nullptr};
+  unsigned cq_mask{0};
+  io_uring_cqe* cqes{nullptr};
+
+  ~Ring() {
+    if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+    if (cq_ring != MAP_FAILED && cq_ring != sq_ring) {
+      munmap(cq_ring, cq_ring_size);
+    }
+    if (sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_size);
+    if (fd != -1) close(fd);
+  }
+};
+
+struct UringFileWriter::Chunk {
+  std::unique_ptr<char[]> data{new char[kChunkSize]};
+  size_t size{0};
+  iovec iov;
+};
+
+std::unique_ptr<UringFileWriter> UringFileWriter::Create(int fd) {
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  auto ring = std::make_unique<Ring>();
+  ring->fd = SysIoUringSetup(kRingEntries, &params);
+  if (ring->fd == -1 || (params.features & IORING_FEAT_NODROP) == 0) {
+    return nullptr;
+  }
+
+  ring->sq_ring_size =
+      params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+    ring->sq_ring_size = ring->cq_ring_size =
+        std::max(ring->sq_ring_size, ring->cq_ring_size);
+  }
+  ring->sq_ring = MapRing(ring->fd, ring->sq_ring_size, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) return nullptr;
+  if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+    ring->cq_ring = ring->sq_ring;
+  } else {
+    ring->cq_ring = MapRing(ring->fd, ring->cq_ring_size, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) return nullptr;
+  }
+  ring->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+  ring->sqes = static_cast<io_uring_sqe*>(
+      MapRing(ring->fd, ring->sqes_size, IORING_OFF_SQES));
+  if (ring->sqes == MAP_FAILED) return nullptr;
+
+  char* sq = static_cast<char*>(ring->sq_ring);
+  ring->sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+  ring->sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  ring->sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  ring->sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  char* cq = static_cast<char*>(ring->cq_ring);
+  ring->cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  ring->cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  ring->cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  ring->cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+  // The writes carry no offset: the file must append.
+  const int flags = fcntl(fd, F_GETFL);
+  if (flags == -1 || ((flags & O_APPEND) == 0 &&
+                      fcntl(fd, F_SETFL, flags | O_APPEND) == -1)) {
+    return nullptr;
+  }
+
+  return std::unique_ptr<UringFileWriter>(
+      new UringFileWriter(fd, std::move(ring)));
+}
+
+UringFileWriter::UringFileWriter(int fd, std::unique_ptr<Ring> ring)
+    : fd_(fd),
+      fork_generation_(ForkGeneration()),
+      ring_(std::move(ring)) {}
+
+UringFileWriter::~UringFileWriter() {
+  if (forked()) return;
+  Wait();
+}
+
+void UringFileWriter::Wait() {
+  Flush(false);
+  while (in_flight_ > 0 || !queued_.empty()) {
+    if (in_flight_ == 0) {
+      // The kernel keeps refusing the chain.
+      WriteQueuedDirectly();
+      break;
+    }
+    if (!Enter(1)) break;
+    Reap();
+  }
+}
+
+void UringFileWriter::SetSubmitLimitForTesting(int limit) {
+  submit_limit.store(limit, std::memory_order_relaxed);
+}
+
+void UringFileWriter::Write(const char* data, size_t size) {
+  Reap();
+  while (size > 0) {
+    if (filling_ == nullptr) {
+      filling_ = TakeFreeChunk();
+    }
+    const size_t n = std::min(size, kChunkSize - filling_->size);
+    memcpy(filling_->data.get() + filling_->size, data, n);
+    filling_->size += n;
+    data += n;
+    size -= n;
+    if (filling_->size == kChunkSize) {
+      Queue(filling_);
+      filling_ = nullptr;
+    }
+  }
+  SubmitQueued();
+}
+
+void UringFileWriter::Flush(bool datasync) {
+  Reap();
+  if (filling_ != nullptr && filling_->size > 0) {
+    Queue(filling_);
+    filling_ = nullptr;
+  }
+  datasync_queued_ = datasync_queued_ || datasync;
+  SubmitQueued();
+}
+
+int UringFileWriter::TakeError() {
+  Reap();
+  const int error = error_;
+  error_ = 0;
+  return error;
+}
+
+UringFileWriter::Chunk* UringFileWriter::TakeFreeChunk() {
+  while (free_chunks_.empty()) {
+    if (chunks_.size() < kMaxChunks) {
+      chunks_.emplace_back(new Chunk);
+      return chunks_.back().get();
+    }
+    // Every chunk is queued or in flight: wait for the disk after all.
+    if (in_flight_ == 0) {
+      // Nothing to wait for: the kernel refused the queued chunks.
+      WriteQueuedDirectly();
+      continue;
+    }
+    if (!Enter(1)) {
+      // The ring is broken; drop what is queued to make room.
+      for (Chunk* chunk : queued_) {
+        chunk->size = 0;
+        free_chunks_.push_back(chunk);
+      }
+      queued_.clear();
+      break;
+    }
+    Reap();
+  }
+  Chunk* chunk = free_chunks_.back();
+  free_chunks_.pop_back();
+  return chunk;
+}
+
+void UringFileWriter::Queue(Chunk* chunk) {
+  chunk->iov.iov_base = chunk->data.get();
+  chunk->iov.iov_len = chunk->size;
+  queued_.push_back(chunk);
+}
+
+void UringFileWriter::SubmitQueued() {
+  if (in_flight_ > 0 || (queued_.empty() && !datasync_queued_)) return;
+
+  Ring& ring = *ring_;
+  unsigned tail = *ring.sq_tail;
+  auto next_sqe = [&ring, &tail]() {
+    const unsigned index = tail++ & ring.sq_mask;
+    ring.sq_array[index] = index;
+    io_uring_sqe* sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+  };
+  for (size_t i = 0; i < queued_.size(); ++i) {
+    io_uring_sqe* sqe = next_sqe();
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd_;
+    sqe->addr = reinterpret_cast<uintptr_t>(&queued_[i]->iov);
+    sqe->len = 1;
+    sqe->user_data = reinterpret_cast<uintptr_t>(queued_[i]);
+    // If a write fails, the rest of the chain is canceled: no later data
+    // lands in the file after a gap.
+    if (i + 1 < queued_.size() || datasync_queued_) {
+      sqe->flags = IOSQE_IO_LINK;
+    }
+  }
+  if (datasync_queued_) {
+    io_uring_sqe* sqe = next_sqe();
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = fd_;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    sqe->user_data = 0;
+  }
+  const unsigned count =
+      static_cast<unsigned>(queued_.size()) + (datasync_queued_ ? 1 : 0);
+  __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+  queued_.clear();
+  datasync_queued_ = false;
+  to_submit_ = count;
+  if (!Enter(0)) {
+    // The ring is broken, not the file.
+    WriteQueuedDirectly();
+  }
+}
+
+void UringFileWriter::Unsubmit() {
+  if (to_submit_ == 0) return;
+  // Without IORING_SETUP_SQPOLL, the kernel only reads the SQ in
+  // io_uring_enter(): the SQEs past its head are still ours.  They go out
+  // as a new chain once the part the kernel took has completed, so that
+  // no write overtakes an earlier one.
+  Ring& ring = *ring_;
+  const unsigned head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+  const unsigned tail = *ring.sq_tail;
+  auto position = queued_.begin();
+  for (unsigned i = head; i != tail; ++i) {
+    const io_uring_sqe& sqe = ring.sqes[ring.sq_array[i & ring.sq_mask]];
+    if (sqe.user_data == 0) {
+      datasync_queued_ = true;
+    } else {
+      position = queued_.insert(
+          position,
+          reinterpret_cast<Chunk*>(static_cast<uintptr_t>(sqe.user_data)));
+      ++position;
+    }
+  }
+  __atomic_store_n(ring.sq_tail, head, __ATOMIC_RELEASE);
+  to_submit_ = 0;
+}
+
+void UringFileWriter::WriteQueuedDirectly() {
+  // Like a failed chain, stop at the first error.
+  bool failed = false;
+  for (Chunk* chunk : queued_) {
+    const char* data = chunk->data.get();
+    size_t size = failed ? 0 : chunk->size;
+    while (size > 0) {
+      const ssize_t written = write(fd_, data, size);
+      if (written == -1 && errno == EINTR) continue;
+      if (written <= 0) {
+        if (error_ == 0) error_ = written == -1 ? errno : ENOSPC;
+        failed = true;
+        break;
+      }
+      data += written;
+      size -= static_cast<size_t>(written);
+      completed_bytes_ += static_cast<size_t>(written);
+    }
+    chunk->size = 0;
+    free_chunks_.push_back(chunk);
+  }
+  queued_.clear();
+  if (datasync_queued_ && !failed && fdatasync(fd_) == -1 && error_ == 0) {
+    error_ = errno;
+  }
+  datasync_queued_ = false;
+}
+
+void UringFileWriter::Reap() {
+  Ring& ring = *ring_;
+  unsigned head = *ring.cq_head;
+  const unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+  if (head == tail) return;
+  for (; head != tail; ++head) {
+    const io_uring_cqe& cqe = ring.cqes[head & ring.cq_mask];
+    auto* chunk =
+        reinterpret_cast<Chunk*>(static_cast<uintptr_t>(cqe.user_data));
+    int error = 0;
+    if (cqe.res < 0) {
+      // Canceled requests follow the one that failed.
+      if (cqe.res != -ECANCELED) error = -cqe.res;
+    } else if (chunk != nullptr) {
+      completed_bytes_ += static_cast<size_t>(cqe.res);
+      if (static_cast<size_t>(cqe.res) < chunk->size) error = ENOSPC;
+    }
+    if (error_ == 0) error_ = error;
+    if (chunk != nullptr) {
+      chunk->size = 0;
+      free_chunks_.push_back(chunk);
+    }
+    --in_flight_;
+  }
+  __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+  SubmitQueued();
+}
+
+bool UringFileWriter::Enter(unsigned min_complete) {
+  unsigned to_submit = to_submit_;
+  const int limit = submit_limit.load(std::memory_order_relaxed);
+  if (limit >= 0) {
+    to_submit = std::min(to_submit, static_cast<unsigned>(limit));
+  }
+  while (true) {
+    int submitted;
+    if (to_submit == 0 && to_submit_ > 0) {
+      submitted = -1;  // SetSubmitLimitForTesting(0)
+      errno = EAGAIN;
+    } else {
+      submitted = SysIoUringEnter(ring_->fd, to_submit, min_complete,
+                                  min_complete > 0 ? IORING_ENTER_GETEVENTS
+                                                   : 0);
+    }
+    if (submitted >= 0) {
+      const unsigned taken =
+          std::min(to_submit_, static_cast<unsigned>(submitted));
+      in_flight_ += taken;
+      to_submit_ -= taken;
+      Unsubmit();
+      return true;
+    }
+    if (errno == EINTR) continue;
+    const int error = errno;
+    Unsubmit();
+    // Out of kernel resources for now: SubmitQueued() tries again.
+    if (error == EAGAIN || error == EBUSY) return min_complete == 0;
+    if (error_ == 0) error_ = error;
+    return false;
+  }
+}
+
+#else  // GLOG_HAVE_IO_URING
+
+struct UringFileWriter::Ring {};
+struct UringFileWriter::Chunk {};
+
+std::unique_ptr<UringFileWriter> UringFileWriter::Create(int /*fd*/) {
+  return nullptr;
+}
+
+UringFileWriter::~UringFileWriter() = default;
+void UringFileWriter::SetSubmitLimitForTesting(int /*limit*/) {}
+void UringFileWriter::Write(const char* /*data*/, size_t /*size*/) {}
+void UringFileWriter::Flush(bool /*datasync*/) {}
+void UringFileWriter::Wait() {}
+int UringFileWriter::TakeError() { return 0; }
+
+#endif  // GLOG_HAVE_IO_URING
+
+_END_GOOGLE_NAMESPACE_
@@ -0,0 +1,132 @@
+// Copyright (c) 2024, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Writes log files with io_uring (--log_io_uring), so that the thread
+// that logs does not wait for the filesystem.
+//
+// Write() copies into a chunk.  Full chunks, and the partial one on
+// Flush(), are submitted as a chain of linked writes, optionally followed
+// by an fdatasync().  Only one chain is in flight at a time, which keeps
+// the writes to the O_APPEND file in order; chunks filled in the
+// meantime go out with the next chain.  If the kernel takes only part of
+// a chain, or none of it (EAGAIN), the rest is queued again and goes out
+// as soon as the part it took has completed.  Completions are reaped by
+// later calls, never waited for, except when all chunks are in use, in
+// Wait() and when the writer is destroyed.
+
+#ifndef GLOG_URING_FILE_WRITER_H_
+#define GLOG_URING_FILE_WRITER_H_
+
+#include "config.h"
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "glog/logging.h"
+
+_START_GOOGLE_NAMESPACE_
+
+// Not thread-safe: LogFileObject calls it with its lock held.
+class GOOGLE_GLOG_DLL_DECL UringFileWriter {
+ public:
+  // Returns nullptr if io_uring is not available: not Linux, a kernel
+  // older than 5.5, or io_uring disabled by a seccomp filter or sysctl.
+  static std::unique_ptr<UringFileWriter> Create(int fd);
+
+  // Waits until everything written so far is in the file, unless the
+  // process forked since.  Does not close the file.
+  ~UringFileWriter();
+
+  void Write(const char* data, size_t size);
+
+  // Submits everything written so far, followed by an fdatasync() if
+  // datasync is set.  Does not wait.
+  void Flush(bool datasync);
+
+  // Submits everything written so far and waits until it is in the file,
+  // for the caller to fdatasync() it.
+  void Wait();
+
+  // Returns the errno of the first write or fdatasync() that failed since
+  // the last call, or 0.  A short write counts as ENOSPC.
+  int TakeError();
+
+  // Bytes whose writes have completed.
+  size_t completed_bytes() const { return completed_bytes_; }
+
+  // True in the child after fork(): the ring is shared with the parent,
+  // so the writer must not be used any more, only destroyed.  Whatever it
+  // had not submitted yet is the parent's to write.
+  bool forked() const;
+
+  // For tests: makes the kernel take at most limit requests per
+  // submission, and none (EAGAIN) if limit is 0.  -1 lifts the limit.
+  static void SetSubmitLimitForTesting(int limit);
+
+ private:
+  struct Ring;
+  struct Chunk;
+
+  UringFileWriter(int fd, std::unique_ptr<Ring> ring);
+
+  Chunk* TakeFreeChunk();
+  void Queue(Chunk* chunk);
+  // Submits the queued chunks if no chain is in flight.
+  void SubmitQueued();
+  // Takes back the SQEs the kernel did not take, to queue them again.
+  void Unsubmit();
+  // Writes the queued chunks with write(2), when the kernel takes none.
+  void WriteQueuedDirectly();
+  // Handles the completions that have arrived.
+  void Reap();
+  // Submits the chain placed by SubmitQueued(), if any, and waits for at
+  // least min_complete completions.  Returns false on a permanent error.
+  bool Enter(unsigned min_complete);
+
+  const int fd_;
+  const uint32 fork_generation_;
+  std::unique_ptr<Ring> ring_;
+  std::vector<std::unique_ptr<Chunk>> chunks_;
+  std::vector<Chunk*> free_chunks_;
+  Chunk* filling_{nullptr};
+  std::vector<Chunk*> queued_;
+  bool datasync_queued_{false};
+  unsigned to_submit_{0};  // SQEs placed but not taken by the kernel.
+  unsigned in_flight_{0};  // Requests taken by the kernel, not completed.
+  int error_{0};
+  size_t completed_bytes_{0};
+
+  UringFileWriter(const UringFileWriter&) = delete;
+  UringFileWriter& operator=(const UringFileWriter&) = delete;
+};
+
+_END_GOOGLE_NAMESPACE_
+
+#endif  // GLOG_URING_FILE_WRITER_H_
@@ -32,6 +32,7 @@
 #include "config.h"
 #include "utilities.h"
 
+#include <atomic>
 #include <cstdio>
 #include <cstdlib>
 
@@ -243,6 +244,13 @@ int64 UsecToCycles(int64 usec) {
 }
 
 WallTime WallTime_Now() {
+#ifdef CLOCK_REALTIME_COARSE
+  if (FLAGS_log_coarse_clock) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return static_cast<WallTime>(ts.tv_sec) + ts.tv_nsec * 0.000000001;
+  }
+#endif
   // Now, cycle clock is retuning microseconds since the epoch.
   return CycleClock_Now() * 0.000001;
 }
@@ -252,7 +260,40 @@ int32 GetMainThreadPid() {
   return g_main_thread_pid;
 }
 
+#ifdef GLOG_THREAD_LOCAL_STORAGE
+// GetTID() of the current thread, or 0 if not known yet.
+static thread_local int g_thread_id = 0;
+#endif
+
+#ifdef HAVE_PTHREAD
+// Set in the child after fork(), so that PidHasChanged() does not need to
+// call getpid() for every message.
+static std::atomic<bool> g_pid_changed{false};
+static std::atomic<uint32> g_fork_generation{0};
+
+static void ResetIdsAfterFork() {
+  g_pid_changed.store(true, std::memory_order_relaxed);
+  g_fork_generation.fetch_add(1, std::memory_order_relaxed);
+#ifdef GLOG_THREAD_LOCAL_STORAGE
+  // Only the forking thread lives on in the child, with a new thread ID.
+  g_thread_id = 0;
+#endif
+}
+
+static struct ForkHandlerRegistrar {
+  ForkHandlerRegistrar() {
+    pthread_atfork(nullptr, nullptr, &ResetIdsAfterFork);
+  }
+} fork_handler_registrar;
+#endif
+
 bool PidHasChanged() {
+#ifdef HAVE_PTHREAD
+  if (!g_pid_changed.load(std::memory_order_relaxed)) {
+    return false;
+  }
+  g_pid_changed.store(false, std::memory_order_relaxed);
+#endif
   int32 pid = getpid();
   if (g_main_thread_pid == pid) {
     return false;
@@ -261,7 +302,15 @@ bool PidHasChanged() {
   return true;
 }
 
-int GetTID() {
+uint32 ForkGeneration() {
+#ifdef HAVE_PTHREAD
+  return g_fork_generation.load(std::memory_order_relaxed);
+#else
+  return 0;
+#endif
+}
+
+static int GetTIDUncached() {
   // On Linux and MacOSX, we try to use gettid().
 #if defined GLOG_OS_LINUX || defined GLOG_OS_MACOSX
 #ifndef __NR_gettid
@@ -311,6 +360,24 @@ int GetTID() {
 #endif
 }
 
+int GetTID() {
+#ifdef GLOG_THREAD_LOCAL_STORAGE
+  if (g_thread_id == 0) {
+    g_thread_id = GetTIDUncached();
+  }
+  return g_thread_id;
+#else
+  return GetTIDUncached();
+#endif
+}
+
+// Safely get max_log_size, overriding to 1 if it somehow gets defined as 0
+uint32 MaxLogSize() {
+  return (FLAGS_max_log_size > 0 && FLAGS_max_log_size < 4096
+              ? FLAGS_max_log_size
+              : 1);
+}
+
 const char* const_basename(const char* filepath) {
   const char* base = strrchr(filepath, '/');
 #ifdef GLOG_OS_WINDOWS  // Look for either path separator in Windows
@@ -151,8 +151,15 @@ WallTime WallTime_Now();
 int32 GetMainThreadPid();
 bool PidHasChanged();
 
+// Counts the fork()s in the ancestry of this process, so that state shared
+// with the parent can be recognized cheaply.  Always 0 without pthreads.
+uint32 ForkGeneration();
+
 int GetTID();
 
+// --max_log_size, in MiB, or 1 if it is out of range.
+uint32 MaxLogSize();
+
 const std::string& MyUserName();
 
 // Get the part of filepath after the last path separator.
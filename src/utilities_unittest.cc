@@ -35,6 +35,10 @@
 
 #include "testing.h"
 
+#ifdef HAVE_SYS_WAIT_H
+# include <sys/wait.h>
+#endif
+
 #ifdef HAVE_LIB_GFLAGS
 #include <gflags/gflags.h>
 using namespace GFLAGS_NAMESPACE;
@@ -49,6 +53,26 @@ TEST(utilities, sync_val_compare_and_swap) {
   EXPECT_TRUE(sync_val_compare_and_swap(&now_entering, false, true));
 }
 
+#if defined(HAVE_PTHREAD) && defined(GLOG_OS_LINUX)
+TEST(utilities, IdsAfterFork) {
+  EXPECT_EQ(getpid(), GetTID());
+  EXPECT_FALSE(PidHasChanged());
+  pid_t child = fork();
+  ASSERT_NE(-1, child);
+  if (child == 0) {
+    // The main thread's ID equals the PID, also in the child.
+    const bool ok = GetTID() == getpid() && PidHasChanged() &&
+                    !PidHasChanged() && GetMainThreadPid() == getpid();
+    _exit(ok ? 0 : 1);
+  }
+  int status;
+  ASSERT_EQ(child, waitpid(child, &status, 0));
+  EXPECT_TRUE(WIFEXITED(status));
+  EXPECT_EQ(0, WEXITSTATUS(status));
+  EXPECT_FALSE(PidHasChanged());
+}
+#endif
+
 TEST(utilities, InitGoogleLoggingDeathTest) {
   ASSERT_DEATH(InitGoogleLogging("foobar"), "");
 }
@@ -33,10 +33,14 @@
 // logging_unittest.cc covers the functionality herein
 
 #include <cerrno>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 
 #include "base/commandlineflags.h"
 #include "base/googleinit.h"
@@ -70,31 +74,37 @@ GOOGLE_GLOG_DLL_DECL bool SafeFNMatch_(const char* pattern, size_t patt_len,
 // of arguments and does not allocate any memory,
 // but we only support "*" and "?" wildcards, not the "[...]" patterns.
 // It's not a static function for the unittest.
+//
+// Iterative: on a mismatch it only backtracks to the last "*", which is
+// enough because a later "*" can absorb anything an earlier one could.
+// So it takes O(patt_len * str_len) at worst, where a recursive matcher
+// goes exponential on patterns like "*a*a*a*b".
 GOOGLE_GLOG_DLL_DECL bool SafeFNMatch_(const char* pattern, size_t patt_len,
                               const char* str, size_t str_len) {
   size_t p = 0;
   size_t s = 0;
-  while (true) {
-    if (p == patt_len  &&  s == str_len) return true;
-    if (p == patt_len) return false;
-    if (s == str_len) return p+1 == patt_len  &&  pattern[p] == '*';
-    if (pattern[p] == str[s]  ||  pattern[p] == '?') {
+  size_t star_p = patt_len;  // Position of the last "*" seen, if any.
+  size_t star_s = 0;         // Where str was when we saw it.
+  while (s < str_len) {
+    if (p < patt_len && (pattern[p] == str[s] || pattern[p] == '?')) {
       p += 1;
       s += 1;
-      continue;
-    }
-    if (pattern[p] == '*') {
-      if (p+1 == patt_len) return true;
-      do {
-        if (SafeFNMatch_(pattern+(p+1), patt_len-(p+1), str+s, str_len-s)) {
-          return true;
-        }
-        s += 1;
-      } while (s != str_len);
+    } else if (p < patt_len && pattern[p] == '*') {
+      star_p = p;
+      star_s = s;
+      p += 1;
+    } else if (star_p != patt_len) {
+      // Let the last "*" absorb one more character, and retry.
+      p = star_p + 1;
+      s = ++star_s;
+    } else {
       return false;
     }
-    return false;
   }
+  while (p < patt_len && pattern[p] == '*') {
+    p += 1;
+  }
+  return p == patt_len;
 }
 
 }  // namespace glog_internal_namespace_
@@ -116,12 +126,97 @@ struct VModuleInfo {
   const VModuleInfo* next;
 };
 
+namespace {
+
+// vmodule_list compiled for looking up which entry applies to a module:
+// a hash table for the plain module names, which are most of them, and
+// the patterns with wildcards in list order.  Rebuilt whenever the list
+// changes; lookups do not allocate.
+class VModuleMatcher {
+ public:
+  void Build(const VModuleInfo* list) {
+    names_.clear();
+    globs_.clear();
+    size_t order = 0;
+    for (const VModuleInfo* info = list; info != nullptr;
+         info = info->next, ++order) {
+      const string& pattern = info->module_pattern;
+      if (pattern.find_first_of("*?") == string::npos) {
+        // Only the first of equal names can match.
+        names_.emplace(std::string_view(pattern), Entry{order, info});
+      } else {
+        globs_.push_back(Entry{order, info});
+      }
+    }
+  }
+
+  // Returns the first entry of the list whose pattern matches the module
+  // name, or nullptr.
+  const VModuleInfo* Find(const char* name, size_t name_len) const {
+    const VModuleInfo* found = nullptr;
+    size_t found_order = SIZE_MAX;
+    auto it = names_.find(std::string_view(name, name_len));
+    if (it != names_.end()) {
+      found = it->second.info;
+      found_order = it->second.order;
+    }
+    for (const Entry& glob : globs_) {
+      if (glob.order > found_order) break;
+      const string& pattern = glob.info->module_pattern;
+      if (SafeFNMatch_(pattern.data(), pattern.size(), name, name_len)) {
+        return glob.info;
+      }
+    }
+    return found;
+  }
+
+ private:
+  struct Entry {
+    size_t order;  // Position in the list.
+    const VModuleInfo* info;
+  };
+
+  // The keys point into the module_pattern of list entries, which are
+  // never deleted.
+  std::unordered_map<std::string_view, Entry> names_;
+  std::vector<Entry> globs_;
+};
+
+}  // namespace
+
 // This protects the following global variables.
 static Mutex vmodule_lock;
 // Pointer to head of the VModuleInfo list.
 // It's a map from module pattern to logging level for those module(s).
 static VModuleInfo* vmodule_list = nullptr;
-static SiteFlag* cached_site_list = nullptr;
+static VModuleMatcher* vmodule_matcher = nullptr;
+
+// Starts at 1 so that the zero-initialized SiteFlags look up their level
+// on their first hit.
+// Written only under vmodule_lock, but VLOG_IS_ON reads it without.
+uint32 vlog_site_generation__ = 1;
+
+// Makes every VLOG site look up its level again on its next hit.
+// L >= vmodule_lock.
+static void BumpVLogSiteGeneration() {
+  uint32 generation = vlog_site_generation__ + 1;
+  if (generation == 0) {
+    generation = 1;
+  }
+#if defined(__GNUC__)
+  __atomic_store_n(&vlog_site_generation__, generation, __ATOMIC_RELAXED);
+#else
+  vlog_site_generation__ = generation;
+#endif
+}
+
+// L >= vmodule_lock.
+static void RebuildVModuleMatcher() {
+  if (vmodule_matcher == nullptr) {
+    vmodule_matcher = new VModuleMatcher;
+  }
+  vmodule_matcher->Build(vmodule_list);
+}
 
 // Boolean initialization flag.
 static bool inited_vmodule = false;
@@ -159,6 +254,8 @@ static void VLOG2Initializer() {
     tail->next = vmodule_list;
     vmodule_list = head;
   }
+  RebuildVModuleMatcher();
+  BumpVLogSiteGeneration();
   inited_vmodule = true;
 }
 
@@ -169,20 +266,20 @@ int SetVLOGLevel(const char* module_pattern, int log_level) {
   bool found = false;
   {
     MutexLock l(&vmodule_lock);  // protect whole read-modify-write
+    if (vmodule_matcher == nullptr) {
+      RebuildVModuleMatcher();
+    }
+    // A pattern matches itself, so this also finds the first entry equal
+    // to module_pattern.
+    if (const VModuleInfo* first =
+            vmodule_matcher->Find(module_pattern, pattern_len)) {
+      result = first->vlog_level;
+      found = true;
+    }
     for (const VModuleInfo* info = vmodule_list; info != nullptr;
          info = info->next) {
       if (info->module_pattern == module_pattern) {
-        if (!found) {
-          result = info->vlog_level;
-          found = true;
-        }
         info->vlog_level = log_level;
-      } else if (!found  &&
-                 SafeFNMatch_(info->module_pattern.c_str(),
-                              info->module_pattern.size(),
-                              module_pattern, pattern_len)) {
-        result = info->vlog_level;
-        found = true;
       }
     }
     if (!found) {
@@ -191,39 +288,21 @@ int SetVLOGLevel(const char* module_pattern, int log_level) {
       info->vlog_level = log_level;
       info->next = vmodule_list;
       vmodule_list = info;
-
-      SiteFlag** item_ptr = &cached_site_list;
-      SiteFlag* item = cached_site_list;
-
-      // We traverse the list fully because the pattern can match several items
-      // from the list.
-      while (item) {
-        if (SafeFNMatch_(module_pattern, pattern_len, item->base_name,
-                         item->base_len)) {
-          // Redirect the cached value to its module override.
-          item->level = &info->vlog_level;
-          *item_ptr = item->next;  // Remove the item from the list.
-        } else {
-          item_ptr = &item->next;
-        }
-        item = *item_ptr;
-      }
+      RebuildVModuleMatcher();
+      // The new pattern comes first, so sites that are bound to FLAGS_v or
+      // to a later pattern may now be controlled by it.
+      BumpVLogSiteGeneration();
     }
   }
   RAW_VLOG(1, "Set VLOG level for \"%s\" to %d", module_pattern, log_level);
   return result;
 }
 
-// NOTE: Individual VLOG statements cache the integer log level pointers.
-// NOTE: This function must not allocate memory or require any locks.
+// NOTE: Individual VLOG statements cache the integer log level pointers,
+// together with the vlog_site_generation__ they are valid for.
+// NOTE: This function must not allocate memory.
 bool InitVLOG3__(SiteFlag* site_flag, int32* level_default,
                  const char* fname, int32 verbose_level) {
-  MutexLock l(&vmodule_lock);
-  bool read_vmodule_flag = inited_vmodule;
-  if (!read_vmodule_flag) {
-    VLOG2Initializer();
-  }
-
   // protect the errno global in case someone writes:
   // VLOG(..) << "The last error was " << strerror(errno)
   int old_errno = errno;
@@ -253,18 +332,34 @@ bool InitVLOG3__(SiteFlag* site_flag, int32* level_default,
   // TODO: Trim out _unittest suffix?  Perhaps it is better to have
   // the extra control and just leave it there.
 
-  // find target in vector of modules, replace site_flag_value with
-  // a module-specific verbose level, if any.
-  for (const VModuleInfo* info = vmodule_list; info != nullptr;
-       info = info->next) {
-    if (SafeFNMatch_(info->module_pattern.c_str(), info->module_pattern.size(),
-                     base, base_length)) {
-      site_flag_value = &info->vlog_level;
-        // value at info->vlog_level is now what controls
-        // the VLOG at the caller site forever
-      break;
+  // Sites hitting this at the same time, e.g. right after a generation
+  // bump, only share the lock.
+  bool read_vmodule_flag;
+  uint32 generation = 0;
+  const VModuleInfo* info = nullptr;
+  {
+    ReaderMutexLock l(&vmodule_lock);
+    read_vmodule_flag = inited_vmodule;
+    if (read_vmodule_flag) {
+      // Read under the lock, so that it matches vmodule_matcher.
+      generation = vlog_site_generation__;
+      info = vmodule_matcher->Find(base, base_length);
     }
   }
+  if (!read_vmodule_flag) {
+    MutexLock l(&vmodule_lock);
+    if (!inited_vmodule) {
+      VLOG2Initializer();
+    }
+    info = vmodule_matcher->Find(base, base_length);
+  }
+
+  // replace site_flag_value with a module-specific verbose level, if any.
+  if (info != nullptr) {
+    site_flag_value = &info->vlog_level;
+      // value at info->vlog_level is now what controls
+      // the VLOG at the caller site until the next generation
+  }
 
   // Cache the vlog value pointer if --vmodule flag has been parsed.
   ANNOTATE_BENIGN_RACE(site_flag,
@@ -272,17 +367,12 @@ bool InitVLOG3__(SiteFlag* site_flag, int32* level_default,
                        " but the value will be the same");
   if (read_vmodule_flag) {
     site_flag->level = site_flag_value;
-    // If VLOG flag has been cached to the default site pointer,
-    // we want to add to the cached list in order to invalidate in case
-    // SetVModule is called afterwards with new modules.
-    // The performance penalty here is neglible, because InitVLOG3__ is called
-    // once per site.
-    if (site_flag_value == level_default && !site_flag->base_name) {
-      site_flag->base_name = base;
-      site_flag->base_len = base_length;
-      site_flag->next = cached_site_list;
-      cached_site_list = site_flag;
-    }
+    // Publish level before the generation that makes VLOG_IS_ON use it.
+#if defined(__GNUC__)
+    __atomic_store_n(&site_flag->generation, generation, __ATOMIC_RELEASE);
+#else
+    site_flag->generation = generation;
+#endif
   }
 
   // restore the errno in case something recoverable went wrong during